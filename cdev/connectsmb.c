@@ -36,7 +36,7 @@ static SMBConnectRec connectPB = {
     .serverIP = 0,
     .serverPort = 0,
     .serverName = NULL,
-    .flags = 0x00FF,
+    .flags = 0x00FF | CONNECT_FLAG_KEEPALIVE,
 };
 
 /*
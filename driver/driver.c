@@ -22,7 +22,9 @@
 #include <intmath.h>
 #include "driver/driver.h"
 #include "smb2/smb2.h"
+#include "smb2/changenotify.h"
 #include "utils/alloc.h"
+#include "helpers/dirlist.h"
 
 #define DRIVER_VERSION 0x001E             /* GS/OS driver version format */
 
@@ -261,6 +263,11 @@ static Word DoStatus(struct GSOSDP *dp) {
 
 void UnmountSMBVolume(DIB *dib) {
     if (dib->extendedDIBPtr != NULL) {
+        // The tree disconnect closes any handles held by cached listings,
+        // and the handle used to watch for changes.
+        DiscardDirListings(dib);
+        StopChangeNotify(dib);
+
         treeDisconnectRequest.Reserved = 0;
         SendRequestAndGetResponse(dib, SMB2_TREE_DISCONNECT,
             sizeof(treeDisconnectRequest));
@@ -53,6 +53,13 @@ struct DIB {
     // ID number that is unique for each "different" tree connect.
     // (Reconnects do not get a new ID number.)
     uint32_t treeConnectID;
+
+    // Handle on the share's root directory used to watch for changes, and
+    // MessageId of the CHANGE_NOTIFY request outstanding on it (only valid
+    // if watching is true; see smb2/changenotify.c)
+    bool watching;
+    SMB2_FILEID watchFileID;
+    uint64_t watchMessageId;
 };
 
 /* flags bits */
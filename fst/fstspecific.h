@@ -30,6 +30,7 @@
 #define SMB_SESSION_RETAIN     0xC004
 #define SMB_SESSION_RELEASE    0xC005
 #define SMB_MOUNT              0xC006
+#define SMB_COPY_FILE          0xC007
 
 typedef struct SMBConnectRec {
     Word pCount;
@@ -42,6 +43,10 @@ typedef struct SMBConnectRec {
     LongWord connectionID; /* out */
 } SMBConnectRec;
 
+/* SMB_Connect flags bits (the low byte is reserved) */
+#define CONNECT_FLAG_KEEPALIVE    0x0100 /* keep idle connection alive */
+#define CONNECT_FLAG_MULTICHANNEL 0x0200 /* use a second channel for reads */
+
 typedef struct SMBAuthenticateRec {
     Word pCount;
     Word fileSysID;
@@ -88,4 +93,20 @@ typedef struct SMBMountRec {
     GSString255 *volName;
 } SMBMountRec;
 
+/*
+ * SMB_CopyFile copies a file (both forks and its Finder info) on the
+ * server, without transferring the data over the network.  Both paths must
+ * be full pathnames on mounted SMB volumes using the same session.  The
+ * destination must not already exist.  If the server does not support
+ * server-side copies, this returns invalidFSTop, and the caller should
+ * copy the file itself.
+ */
+typedef struct SMBCopyFileRec {
+    Word pCount;
+    Word fileSysID;
+    Word commandNum;
+    GSString255 *sourcePath;
+    GSString255 *destPath;
+} SMBCopyFileRec;
+
 #endif
@@ -103,7 +103,15 @@ callNumber equ  $30                     ; GS/OS call number (GS/OS dp location)
         phk                             ; set databank (no need to save/restore)
         plb
 
-        txa
+        lda     watchCount              ; handle change notifications that
+        beq     docall                  ;   arrived between calls
+        phx
+        phy
+        jsl     PollChangeNotifications
+        ply
+        plx
+
+docall  txa
         asl     a
         tax
         
@@ -140,7 +148,13 @@ push_params anop
 
 thecall jsl     >000000                 ; modified above
 
-        ldx     volChangedDevNum
+        ldx     pendingBreakCount       ; acknowledge any oplock/lease breaks
+        beq     chkvol                  ;   that were waiting for a flush
+        pha
+        jsl     ProcessPendingBreaks
+        pla
+
+chkvol  ldx     volChangedDevNum
         beq     return
         stz     volChangedDevNum
         pha
@@ -247,6 +261,7 @@ fstspecific_calls anop
         dc      i4'SMB_Session_Retain'
         dc      i4'SMB_Session_Release'
         dc      i4'SMB_Mount'
+        dc      i4'SMB_CopyFile'
 fstspecific_end anop
 
 maxFSTSpecificCall equ -1+(fstspecific_end-fstspecific_calls)/4
@@ -27,6 +27,8 @@
 #include "helpers/path.h"
 #include "helpers/errors.h"
 #include "helpers/closerequest.h"
+#include "helpers/infocache.h"
+#include "helpers/writebehind.h"
 #include "fst/fstdata.h"
 
 Word ChangePath(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
@@ -44,6 +46,14 @@ Word ChangePath(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
         return unknownVol;
     }
 
+    // Send any deferred writes to the file before it is renamed.
+    retval = FlushVolumeWriteBehind(dib1,
+        (gsosdp->pathFlag & HAVE_PATH1) ? gsosdp->path1Ptr : NULL);
+    if (retval != 0)
+        return retval;
+
+    InvalidateInfoCache(dib1);
+
     /*
      * Open file for rename
      */
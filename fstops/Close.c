@@ -22,9 +22,17 @@
 #include "gsos/gsosdata.h"
 #include "driver/driver.h"
 #include "helpers/closerequest.h"
+#include "helpers/readahead.h"
+#include "helpers/writebehind.h"
+#include "helpers/dirinfo.h"
+#include "helpers/dircache.h"
+#include "helpers/dirlist.h"
+#include "smb2/oplock.h"
 
 Word Close(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     Word result;
+    Word flushResult;
+    bool keepOpen;
     VirtualPointer vp;
     FCR *fcr;
     VCR *vcr;
@@ -43,14 +51,38 @@ Word Close(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     if (i == NDIBS)
         return volNotFound;
 
-    if (fcr->dirCacheHandle != NULL) {
-        DisposeHandle(fcr->dirCacheHandle);
-        fcr->dirCacheHandle = NULL;
+    FreeDirInfo(fcr);
+    
+    FreeReadAhead(fcr);
+
+    /*
+     * If the deferred writes cannot be flushed, the file is still closed
+     * (so a lasting error does not leave it impossible to close), but the
+     * error is reported.
+     */
+    flushResult = FlushWriteBehind(fcr, &dibs[i]);
+    FreeWriteBehind(fcr);
+
+    CancelDirPrefetch(fcr, &dibs[i]);
+
+    /*
+     * Keep the directory listing for later opens.  If it is covered by a
+     * lease, the handle is kept open to hold the lease.
+     */
+    keepOpen = SaveDirListing(fcr, &dibs[i]);
+    FreeDirCache(fcr);
+
+    // Closing the file releases its oplock/lease, so no ack is needed.
+    if (fcr->cacheFlags & CACHE_BREAK_PENDING) {
+        fcr->cacheFlags &= ~CACHE_BREAK_PENDING;
+        pendingBreakCount--;
     }
 
-    result = SendCloseRequestAndGetResponse(&dibs[i], &fcr->fileID);
-    if (result != rsDone)
-        return networkError;
+    if (!keepOpen) {
+        result = SendCloseRequestAndGetResponse(&dibs[i], &fcr->fileID);
+        if (result != rsDone)
+            return networkError;
+    }
     
     i = fcr->refNum;
     asm {
@@ -65,5 +97,5 @@ Word Close(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
 
     vcr->openCount--;
     
-    return 0;
+    return flushResult;
 }
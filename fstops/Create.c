@@ -34,6 +34,7 @@
 #include "helpers/createcontext.h"
 #include "helpers/closerequest.h"
 #include "helpers/fsattributes.h"
+#include "helpers/infocache.h"
 #include "fst/fstdata.h"
 
 #define extendExistingFile 0x8005
@@ -80,6 +81,8 @@ Word Create(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     if (dib == NULL)
         return volNotFound;
 
+    InvalidateInfoCache(dib);
+
     /*
      * Get parameters
      */
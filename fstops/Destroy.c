@@ -27,6 +27,7 @@
 #include "helpers/path.h"
 #include "helpers/errors.h"
 #include "helpers/closerequest.h"
+#include "helpers/infocache.h"
 #include "fst/fstdata.h"
 
 Word Destroy(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
@@ -39,6 +40,8 @@ Word Destroy(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     dib = GetDIB(gsosdp, 1);
     if (dib == NULL)
         return volNotFound;
+
+    InvalidateInfoCache(dib);
     
     /*
      * Open file
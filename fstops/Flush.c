@@ -21,6 +21,7 @@
 #include "gsos/gsosdata.h"
 #include "driver/driver.h"
 #include "helpers/errors.h"
+#include "helpers/writebehind.h"
 
 /*
  * Flush pblock, including optional flush type as second parameter.
@@ -37,6 +38,7 @@ typedef struct FlushRecGS {
 
 Word Flush(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     Word result;
+    Word retval;
     VirtualPointer vp;
     FCR *fcr;
     unsigned i;
@@ -60,6 +62,10 @@ Word Flush(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
             return paramRangeErr;
     }    
 
+    retval = FlushWriteBehind(fcr, &dibs[i]);
+    if (retval != 0)
+        return retval;
+
     flushRequest.Reserved1 = 0;
     flushRequest.Reserved2 = 0;
     flushRequest.FileId = fcr->fileID;
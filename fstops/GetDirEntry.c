@@ -34,6 +34,10 @@
 #include "helpers/blocks.h"
 #include "helpers/attributes.h"
 #include "helpers/closerequest.h"
+#include "helpers/dirinfo.h"
+#include "helpers/dircache.h"
+#include "helpers/negcache.h"
+#include "helpers/writebehind.h"
 #include "utils/finderstate.h"
 
 #define NUMBER_OF_DOT_DIRS 2
@@ -60,6 +64,121 @@ static Word GDEError(ReadStatus rs) {
     (x) >= 0x8000 ? 0x8000 :    \
     (x) >= 0x4000 ? 0x4000 : 0)
 
+/*
+ * When a directory entry within this many entries of the end of the cached
+ * ones is returned, the next page of entries is requested in advance.
+ */
+#define DIR_PREFETCH_DISTANCE 32
+
+/*
+ * Set up a QUERY_DIRECTORY request in msg to get the next page of entries
+ * from the directory, or the first page if restart is true.  Returns the
+ * length of the request body.
+ */
+static uint16_t SetUpDirQuery(FCR *fcr, DIB *dib, bool restart) {
+    if (dib->flags & FLAG_AAPL_READDIR) {
+        queryDirectoryRequest.FileInformationClass =
+            FileIdBothDirectoryInformation;
+    } else {
+        queryDirectoryRequest.FileInformationClass =
+            FileDirectoryInformation;
+    }
+    queryDirectoryRequest.Flags = 0;
+    if (restart) {
+        queryDirectoryRequest.Flags |= SMB2_RESTART_SCANS;
+        fcr->nextServerEntryNum = -1;
+    }
+    queryDirectoryRequest.FileIndex = 0;
+    queryDirectoryRequest.FileId = fcr->fileID;
+    queryDirectoryRequest.FileNameOffset = sizeof(SMB2Header)
+        + offsetof(SMB2_QUERY_DIRECTORY_Request, Buffer);
+    queryDirectoryRequest.FileNameLength = sizeof(char16_t);
+    queryDirectoryRequest.OutputBufferLength = DIR_DATA_LENGTH(
+        sizeof(msg.body) - sizeof(SMB2_QUERY_DIRECTORY_Response));
+
+    /* 
+     * Note: [MS-SMB2] says the file name pattern is optional,
+     * but Mac (at least) requires it.
+     */
+    ((char16_t*)queryDirectoryRequest.Buffer)[0] = '*';
+
+    return sizeof(queryDirectoryRequest) + queryDirectoryRequest.FileNameLength;
+}
+
+/*
+ * If entryNum is near the end of the cached directory entries, and the
+ * next entries from the server would follow on from them, send the
+ * QUERY_DIRECTORY request for the next page of entries now.  The response
+ * is received when those entries are needed (see GetPrefetchedDirPage),
+ * so the round trip to the server overlaps with whatever the caller does
+ * with the entries it already has.
+ */
+static void PrefetchDirPage(FCR *fcr, DIB *dib, Word entryNum) {
+    int32_t cacheEnd;
+    uint16_t bodyLength;
+
+    if (fcr->smbFlags & SMB_FLAG_DIR_PREFETCH)
+        return;
+    if (fcr->dirCacheHandle == NULL)
+        return;
+
+    cacheEnd = fcr->firstCachedEntryNum + fcr->dirCachedCount;
+    if (fcr->nextServerEntryNum != cacheEnd
+        || (int32_t)entryNum + DIR_PREFETCH_DISTANCE < cacheEnd)
+        return;
+    
+    // Don't ask for more if we know all the entries are already cached
+    if (fcr->dirEntryCount >= 0 && cacheEnd > fcr->dirEntryCount)
+        return;
+
+    bodyLength = SetUpDirQuery(fcr, dib, false);
+    if (!SendPipelinedRequest(dib, SMB2_QUERY_DIRECTORY, bodyLength,
+        &fcr->dirPrefetchMessageId)) {
+        // The request may or may not have reached the server
+        fcr->nextServerEntryNum = INT32_MAX;
+        return;
+    }
+    fcr->dirPrefetchReconnectTime = dib->session->connection->reconnectTime;
+    fcr->smbFlags |= SMB_FLAG_DIR_PREFETCH;
+}
+
+/*
+ * If the next page of directory entries was requested in advance, get the
+ * response to that request into msg, setting *result to its status, and
+ * return true.  Otherwise (or if the response cannot be received), return
+ * false, and a new QUERY_DIRECTORY request should be sent.
+ *
+ * If entryNum precedes the next server entry, the scan will be restarted,
+ * so the prefetched page is not wanted.
+ */
+static bool GetPrefetchedDirPage(FCR *fcr, DIB *dib, Word entryNum,
+    ReadStatus *result) {
+    if (!(fcr->smbFlags & SMB_FLAG_DIR_PREFETCH))
+        return false;
+
+    /*
+     * Check that the connection has not been re-established since the
+     * request was sent, in which case its MessageId could now refer to a
+     * different request.
+     */
+    if (entryNum < fcr->nextServerEntryNum
+        || fcr->dirPrefetchReconnectTime
+            != dib->session->connection->reconnectTime) {
+        CancelDirPrefetch(fcr, dib);
+        return false;
+    }
+
+    fcr->smbFlags &= ~SMB_FLAG_DIR_PREFETCH;
+    *result = GetPipelinedResponseById(dib, SMB2_QUERY_DIRECTORY,
+        fcr->dirPrefetchMessageId);
+    if (*result == rsError) {
+        // Server's scan position is unknown, so start over
+        fcr->nextServerEntryNum = INT32_MAX;
+        return false;
+    }
+    return true;
+}
+
 Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     Word result;
     VirtualPointer vp;
@@ -69,13 +188,12 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     Word retval = 0;
     SMB2_QUERY_INFO_Request *queryInfoReq;
     uint16_t readMsgNum, queryInfoMsgNum, closeMsgNum;
+    uint16_t bodyLength;
 
     Word base, displacement, entryNum;
     
     uint32_t count;
-    FILE_NAMES_INFORMATION *namesEntry;
     static FILE_DIRECTORY_INFORMATION dirEntry;
-    uint16_t sizeLeft;
     bool needRestart;
     unsigned char *namePtr;
     unsigned nameLength;
@@ -87,14 +205,17 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     static uint64_t resourceEOF, resourceAlloc;
     static FileType fileType;
     enum {usingInfoStream, redoWithMainStream, usingMainStream} infoState;
+    bool haveInfo;
     
     uint16_t dirEntrySize;
-    bool entryCached;
-    int32_t cacheEntryNum;
     FILE_DIRECTORY_INFORMATION *entryPtr;
     FILE_DIRECTORY_INFORMATION *desiredEntry;
     uint16_t remainingSize;
+    int32_t pageFirstEntryNum;
+    bool cacheFull;
     static char16_t nameBuf[SMB2_MAX_NAME_LEN * sizeof(char16_t)];
+    static unsigned char afpInfoPath[NEG_CACHE_MAX_PATH];
+    uint16_t afpInfoPathLength;
 
     vp = gsosdp->fcrPtr;
     DerefVP(fcr, vp);
@@ -106,6 +227,14 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     if (i == NDIBS)
         return volNotFound;
 
+    /*
+     * Send any deferred writes to files on the volume, so the entries for
+     * them show their current EOF and modification date.
+     */
+    retval = FlushVolumeWriteBehind(&dibs[i], NULL);
+    if (retval != 0)
+        return retval;
+
     if (pcount == 0) {
         pblock = (void*)((char*)pblock - offsetof(DirEntryRecGS, refNum));
         pcount = 14;
@@ -114,6 +243,12 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
 
     base = pblock->base;
     displacement = pblock->displacement;
+
+    if (dibs[i].flags & FLAG_AAPL_READDIR) {
+        dirEntrySize = sizeof(FILE_ID_BOTH_DIR_INFORMATION);
+    } else {
+        dirEntrySize = sizeof(FILE_DIRECTORY_INFORMATION);
+    }
     
     if (base == 0 && displacement == 0) {
         /*
@@ -123,82 +258,92 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
         count = 0;
         fcr->dirEntryNum = 0;
 
-        // Ensure next query will restart (needed for Linux ksmbd)
-        fcr->nextServerEntryNum = INT32_MAX;
-
-        if (fcr->dirCacheHandle != NULL) {
-            DisposeHandle(fcr->dirCacheHandle);
-            fcr->dirCacheHandle = NULL;
+        // Use the count from a cached listing, if we have one.
+        if (fcr->dirEntryCount >= 0) {
+            pblock->entryNum = fcr->dirEntryCount;
+            return 0;
         }
+
+        CancelDirPrefetch(fcr, &dibs[i]);
+
+        FreeDirCache(fcr);
+        InvalidateDirInfo(fcr);
         
-        do {
-            queryDirectoryRequest.FileInformationClass = FileNamesInformation;
-            
-            if (count == 0) {
-                queryDirectoryRequest.Flags = SMB2_RESTART_SCANS;
-            } else {
-                queryDirectoryRequest.Flags = 0;
-            }
-            
-            queryDirectoryRequest.FileIndex = 0;
-            queryDirectoryRequest.FileId = fcr->fileID;
-            queryDirectoryRequest.FileNameOffset = sizeof(SMB2Header)
-                + offsetof(SMB2_QUERY_DIRECTORY_Request, Buffer);
-            queryDirectoryRequest.FileNameLength = sizeof(char16_t);
-            queryDirectoryRequest.OutputBufferLength = DIR_DATA_LENGTH(
-                sizeof(msg.body) - sizeof(SMB2_QUERY_DIRECTORY_Response));
+        /*
+         * The entries are fetched with full information and kept in the
+         * directory cache (up to DIR_CACHE_MAX_SIZE bytes of them), so that
+         * subsequent GetDirEntry calls do not need to fetch them again.
+         */
+        cacheFull = false;
         
-            /* 
-             * Note: [MS-SMB2] says the file name pattern is optional,
-             * but Mac (at least) requires it.
-             */
-            ((char16_t*)queryDirectoryRequest.Buffer)[0] = '*';
+        do {
+            bodyLength = SetUpDirQuery(fcr, &dibs[i], count == 0);
+
+            // Ensure next query will restart (needed for Linux ksmbd)
+            fcr->nextServerEntryNum = INT32_MAX;
 
             result = SendRequestAndGetResponse(&dibs[i], SMB2_QUERY_DIRECTORY,
-                sizeof(queryDirectoryRequest)
-                + queryDirectoryRequest.FileNameLength);
+                bodyLength);
             if (result == rsFailed
                 && msg.smb2Header.Status == STATUS_NO_MORE_FILES) {
                 break;
             } else if (result != rsDone) {
+                FreeDirCache(fcr);
                 return ConvertError(result);
             }
 
             if (queryDirectoryResponse.OutputBufferLength > DIR_DATA_LENGTH(
-                sizeof(msg.body) - sizeof(SMB2_QUERY_DIRECTORY_Response)))
-                return networkError;
-            if (!VerifyBuffer(queryDirectoryResponse.OutputBufferOffset,
-                queryDirectoryResponse.OutputBufferLength))
+                sizeof(msg.body) - sizeof(SMB2_QUERY_DIRECTORY_Response))
+                || !VerifyBuffer(queryDirectoryResponse.OutputBufferOffset,
+                    queryDirectoryResponse.OutputBufferLength)) {
+                FreeDirCache(fcr);
                 return networkError;
+            }
             
-            sizeLeft = queryDirectoryResponse.OutputBufferLength;
-            if (sizeLeft == 0)
+            remainingSize = queryDirectoryResponse.OutputBufferLength;
+            if (remainingSize == 0)
                 break;
 
-            namesEntry = (FILE_NAMES_INFORMATION *)((char*)&msg.smb2Header
+            entryPtr = (FILE_DIRECTORY_INFORMATION *)((char*)&msg.smb2Header
                 + queryDirectoryResponse.OutputBufferOffset);
 
+            // Entries -1 and 0 are "." and ".."
+            pageFirstEntryNum = (int32_t)count - 1;
             do {
-                if (sizeLeft < sizeof(FILE_NAMES_INFORMATION))
+                if (remainingSize < dirEntrySize
+                    || remainingSize - dirEntrySize < entryPtr->FileNameLength
+                    || entryPtr->NextEntryOffset > remainingSize) {
+                    FreeDirCache(fcr);
                     return networkError;
+                }
                 count++;
                 
-                if (namesEntry->NextEntryOffset == 0)
+                if (entryPtr->NextEntryOffset == 0)
                     break;
-                if (namesEntry->NextEntryOffset > sizeLeft)
-                    return networkError;
                 
-                sizeLeft -= namesEntry->NextEntryOffset;
-                namesEntry = (FILE_NAMES_INFORMATION *)
-                    ((char*)namesEntry + namesEntry->NextEntryOffset);
+                remainingSize -= entryPtr->NextEntryOffset;
+                entryPtr = (void*)((char*)entryPtr + entryPtr->NextEntryOffset);
             } while (1);
 
+            /*
+             * Keep the entries in the cache, until it is full.  Later
+             * entries can then be fetched again when they are needed.
+             */
+            if (!cacheFull) {
+                cacheFull = !AddToDirCache(fcr, (char*)&msg.smb2Header
+                    + queryDirectoryResponse.OutputBufferOffset,
+                    queryDirectoryResponse.OutputBufferLength,
+                    pageFirstEntryNum, false);
+            }
+
             if (count > 0xFFFFL + NUMBER_OF_DOT_DIRS)
                 break;
         } while (queryDirectoryResponse.OutputBufferLength != 0);
         
-        if (count < NUMBER_OF_DOT_DIRS)
+        if (count < NUMBER_OF_DOT_DIRS) {
+            FreeDirCache(fcr);
             return networkError;
+        }
         
         // Don't count "." and ".."
         count -= NUMBER_OF_DOT_DIRS;
@@ -208,6 +353,7 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
         if (count > 0xFFFF)
             return outOfRange;
         
+        fcr->dirEntryCount = count;
         return 0;
     }
     
@@ -232,100 +378,29 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     if (entryNum == 0)
         return endOfDir;
     
-    // Check if cache is valid, un-purged, and may contain desired entry
-    if (fcr->dirCacheHandle != NULL) {
-        HLock(fcr->dirCacheHandle);
-        if (*fcr->dirCacheHandle == NULL
-            || entryNum < fcr->firstCachedEntryNum) {
-            DisposeHandle(fcr->dirCacheHandle);
-            fcr->dirCacheHandle = NULL;
-        }
-    }
-
-    if (dibs[i].flags & FLAG_AAPL_READDIR) {
-        dirEntrySize = sizeof(FILE_ID_BOTH_DIR_INFORMATION);
-    } else {
-        dirEntrySize = sizeof(FILE_DIRECTORY_INFORMATION);
-    }
-
-    if (fcr->dirCacheHandle != NULL) {
-        if (entryNum >= fcr->lastUsedCachedEntryNum) {
-            cacheEntryNum = fcr->lastUsedCachedEntryNum;
-            entryPtr = (void*)((char*)*fcr->dirCacheHandle
-                + fcr->lastUsedCachedEntryOffset);
-            remainingSize = GetHandleSize(fcr->dirCacheHandle)
-                - fcr->lastUsedCachedEntryOffset;
-        } else {
-            cacheEntryNum = fcr->firstCachedEntryNum;
-            entryPtr = (void*)*fcr->dirCacheHandle;
-            remainingSize = GetHandleSize(fcr->dirCacheHandle);
-        }
+    // Use the cached entry, if the cache is valid and contains it
+    desiredEntry = NULL;
+    if (LockDirCache(fcr))
+        desiredEntry = GetCachedDirEntry(fcr, entryNum);
 
-        entryCached = true;
-        while (cacheEntryNum != entryNum) {
-            if (entryPtr->NextEntryOffset == 0) {
-                entryCached = false;
-                DisposeHandle(fcr->dirCacheHandle);
-                fcr->dirCacheHandle = NULL;
-                break;
-            }
-            
-            entryPtr = (void*)((char*)entryPtr + entryPtr->NextEntryOffset);
-            remainingSize -= entryPtr->NextEntryOffset;
-            cacheEntryNum++;
-        }
-    } else {
-        entryCached = false;
-    }
-    
-    if (entryCached) {
-        desiredEntry = entryPtr;
-        fcr->lastUsedCachedEntryNum = entryNum;
-        fcr->lastUsedCachedEntryOffset = (char*)entryPtr - *fcr->dirCacheHandle;
-    } else {    
-        needRestart = entryNum < fcr->nextServerEntryNum;
-        desiredEntry = NULL;
+    if (desiredEntry == NULL) {
+        UnlockDirCache(fcr);
     
         do {
-            if (dibs[i].flags & FLAG_AAPL_READDIR) {
-                queryDirectoryRequest.FileInformationClass =
-                    FileIdBothDirectoryInformation;
-            } else {
-                queryDirectoryRequest.FileInformationClass =
-                    FileDirectoryInformation;
-            }
-            queryDirectoryRequest.Flags = 0;
-            if (needRestart) {
-                queryDirectoryRequest.Flags |= SMB2_RESTART_SCANS;
-                fcr->nextServerEntryNum = -1;
-                needRestart = false;
+            // Use the page requested in advance, if any, or request one now
+            if (!GetPrefetchedDirPage(fcr, &dibs[i], entryNum, &result)) {
+                needRestart = entryNum < fcr->nextServerEntryNum;
+                result = SendRequestAndGetResponse(&dibs[i],
+                    SMB2_QUERY_DIRECTORY,
+                    SetUpDirQuery(fcr, &dibs[i], needRestart));
             }
-            queryDirectoryRequest.FileIndex = 0;
-            queryDirectoryRequest.FileId = fcr->fileID;
-            queryDirectoryRequest.FileNameOffset = sizeof(SMB2Header)
-                + offsetof(SMB2_QUERY_DIRECTORY_Request, Buffer);
-            queryDirectoryRequest.FileNameLength = sizeof(char16_t);
-            queryDirectoryRequest.OutputBufferLength = DIR_DATA_LENGTH(
-                sizeof(msg.body) - sizeof(SMB2_QUERY_DIRECTORY_Response));
-        
-            /* 
-             * Note: [MS-SMB2] says the file name pattern is optional,
-             * but Mac (at least) requires it.
-             */
-            ((char16_t*)queryDirectoryRequest.Buffer)[0] = '*';
-        
-            result = SendRequestAndGetResponse(&dibs[i], SMB2_QUERY_DIRECTORY,
-                sizeof(queryDirectoryRequest)
-                + queryDirectoryRequest.FileNameLength);
             if (result != rsDone) {
-                if (fcr->dirCacheHandle != NULL) {
-                    DisposeHandle(fcr->dirCacheHandle);
-                    fcr->dirCacheHandle = NULL;
-                }
                 if (result == rsFailed
                     && msg.smb2Header.Status == STATUS_NO_MORE_FILES) {
                     // Ensure next query will restart (needed for Linux ksmbd)
                     fcr->nextServerEntryNum = INT32_MAX;
+                } else {
+                    FreeDirCache(fcr);
                 }
                 return GDEError(result);
             }
@@ -337,7 +412,7 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
                 queryDirectoryResponse.OutputBufferLength))
                 return networkError;
 
-            fcr->firstCachedEntryNum = fcr->nextServerEntryNum;
+            pageFirstEntryNum = fcr->nextServerEntryNum;
 
             // Check that returned data is valid
             remainingSize = queryDirectoryResponse.OutputBufferLength;
@@ -360,26 +435,19 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
                 remainingSize -= entryPtr->NextEntryOffset;
                 entryPtr = (void*)((char*)entryPtr + entryPtr->NextEntryOffset);
             } while (1);
+
+            /*
+             * Cache the directory entries.  If they follow on from those
+             * already cached, they are added to them (dropping the earliest
+             * ones if necessary); otherwise, they replace them.
+             */
+            AddToDirCache(fcr, (char*)&msg.smb2Header
+                + queryDirectoryResponse.OutputBufferOffset,
+                queryDirectoryResponse.OutputBufferLength,
+                pageFirstEntryNum, true);
         } while (desiredEntry == NULL);
         
-        // Cache the directory entries
-        fcr->dirCacheHandle = NewHandle(
-            queryDirectoryResponse.OutputBufferLength, userid(),
-            attrLocked | attrNoSpec | attrPurge2, 0);
-        if (toolerror()) {
-            fcr->dirCacheHandle = NULL;
-        } else {
-            memcpy(*fcr->dirCacheHandle, (char*)&msg.smb2Header +
-                queryDirectoryResponse.OutputBufferOffset,
-                queryDirectoryResponse.OutputBufferLength);
-
-            fcr->lastUsedCachedEntryNum = entryNum;
-            fcr->lastUsedCachedEntryOffset =
-                (char*)desiredEntry - (char*)&msg.smb2Header
-                - queryDirectoryResponse.OutputBufferOffset;
-
-            HUnlock(fcr->dirCacheHandle);
-        }
+        InvalidateDirInfo(fcr);
     }
 
     /*
@@ -424,8 +492,7 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
         retval = SMBNameToGS(aaplDirEntry->FileName,
             aaplDirEntry->FileNameLength, pblock->name);
 
-        if (fcr->dirCacheHandle != NULL)
-            HUnlock(fcr->dirCacheHandle);
+        UnlockDirCache(fcr);
 #undef aaplDirEntry
     } else {
         /*
@@ -434,17 +501,30 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
 
         // Save file name to nameBuf
         if (dirEntry.FileNameLength > sizeof(nameBuf)) {
-            if (fcr->dirCacheHandle != NULL)
-                HUnlock(fcr->dirCacheHandle);
+            UnlockDirCache(fcr);
             return networkError;
         }
         memcpy(nameBuf, desiredEntry->FileName, desiredEntry->FileNameLength);
-        
-        if (fcr->dirCacheHandle != NULL)
-            HUnlock(fcr->dirCacheHandle);
 
         haveResourceFork = false;
         resourceEOF = resourceAlloc = 0;
+
+        /*
+         * Use prefetched information for this entry, if available.  If not,
+         * try to prefetch it together with the following cached entries.
+         */
+        haveInfo = GetPrefetchedDirInfo(fcr, entryNum,
+            &haveResourceFork, &resourceEOF, &resourceAlloc);
+        if (!haveInfo && fcr->dirCacheHandle != NULL) {
+            PrefetchDirInfo(fcr, &dibs[i], entryNum);
+            haveInfo = GetPrefetchedDirInfo(fcr, entryNum,
+                &haveResourceFork, &resourceEOF, &resourceAlloc);
+        }
+        
+        UnlockDirCache(fcr);
+
+        if (haveInfo)
+            goto have_info;
     
         infoState = usingInfoStream;
         do {
@@ -506,6 +586,23 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
             }
         
             createRequest.NameLength = namePtr - createRequest.Buffer;
+
+            /*
+             * Skip the AFP Info if it was just found not to exist.
+             * Otherwise, save its path in case it is not found now.
+             */
+            if (infoState == usingInfoStream) {
+                if (IsKnownMissing(&dibs[i], createRequest.Buffer,
+                    createRequest.NameLength)) {
+                    infoState = redoWithMainStream;
+                    continue;
+                }
+                afpInfoPathLength = createRequest.NameLength;
+                if (afpInfoPathLength <= NEG_CACHE_MAX_PATH) {
+                    memcpy(afpInfoPath, createRequest.Buffer,
+                        afpInfoPathLength);
+                }
+            }
             
             result = SendRequestAndGetResponse(&dibs[i], SMB2_CREATE,
                 sizeof(createRequest) + createRequest.NameLength);
@@ -525,6 +622,8 @@ Word GetDirEntry(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
                 // TODO maybe add an option to skip the extra resource fork check
                 // (This situation should not come up if using only the SMB FST.)
                 if (infoState == usingInfoStream) {
+                    if (msg.smb2Header.Status == STATUS_OBJECT_NAME_NOT_FOUND)
+                        CacheMissing(&dibs[i], afpInfoPath, afpInfoPathLength);
                     InitAFPInfo();
                     infoState = redoWithMainStream;
                     continue;
@@ -696,7 +795,8 @@ handle_close:
             if (retval)
                 return retval;
         } while (infoState == redoWithMainStream);
-        
+
+have_info:
         retval = SMBNameToGS(nameBuf, dirEntry.FileNameLength, pblock->name);
     }
 
@@ -707,6 +807,12 @@ handle_close:
      */
     fcr->dirEntryNum = entryNum;
 
+    /*
+     * If the caller is nearing the end of the cached entries, request the
+     * next page now.  (msg is not used below here.)
+     */
+    PrefetchDirPage(fcr, &dibs[i], entryNum);
+
     /*
      * Fill in results (name was done above)
      */
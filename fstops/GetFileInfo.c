@@ -29,6 +29,9 @@
 #include "helpers/afpinfo.h"
 #include "helpers/filetype.h"
 #include "helpers/closerequest.h"
+#include "helpers/infocache.h"
+#include "helpers/negcache.h"
+#include "helpers/writebehind.h"
 #include "fstops/GetFileInfo.h"
 #include "helpers/errors.h"
 
@@ -66,12 +69,30 @@ Word GetFileInfo_Impl(void *pblock, struct GSOSDP *gsosdp, Word pcount,
     static ProDOSTime pdosTime;
 
     static uint16_t createMsgNum, queryInfoMsgNum, closeMsgNum;
+    static AFPInfoRequests afpInfoRequests;
+    bool prefetchedAFPInfo = false;
     SMB2_QUERY_INFO_Request *queryInfoReq;
 
+    static CachedFileInfo cachedInfo;
+    static unsigned char cachePath[INFO_CACHE_MAX_PATH];
+    uint16_t cachePathLength;
+    bool cacheable = false;
+
     dib = GetDIB(gsosdp, 1);
     if (dib == NULL)
         return volNotFound;
 
+    /*
+     * Send any deferred writes to the file, so the server reports its
+     * current EOF and modification date (and they are cached correctly).
+     */
+    if (!alreadyOpen) {
+        retval = FlushVolumeWriteBehind(dib,
+            (gsosdp->pathFlag & HAVE_PATH1) ? gsosdp->path1Ptr : NULL);
+        if (retval != 0)
+            return retval;
+    }
+
 top:
     resourceEOF = resourceAlloc = 0;
 
@@ -101,6 +122,34 @@ top:
         if (createRequest.NameLength == 0xFFFF)
             return badPathSyntax;
         isRootDir = createRequest.NameLength == 0;
+
+        // Don't go to the server if the file was just found not to exist
+        if (IsKnownMissing(dib, createRequest.Buffer, createRequest.NameLength))
+            return fileNotFound;
+
+        /*
+         * Use cached information for the file, if available.  Otherwise,
+         * save the path so that the information we get can be cached.
+         */
+        cachePathLength = createRequest.NameLength;
+        if (cachePathLength <= INFO_CACHE_MAX_PATH) {
+            if (LookupCachedInfo(dib, createRequest.Buffer, cachePathLength,
+                &cachedInfo)) {
+                basicInfo.CreationTime = cachedInfo.creationTime;
+                basicInfo.LastWriteTime = cachedInfo.lastWriteTime;
+                basicInfo.FileAttributes = cachedInfo.fileAttributes;
+                dataEOF = cachedInfo.dataEOF;
+                dataAlloc = cachedInfo.dataAlloc;
+                haveDataForkSizes = true;
+                haveResourceFork = cachedInfo.haveResourceFork;
+                resourceEOF = cachedInfo.resourceEOF;
+                resourceAlloc = cachedInfo.resourceAlloc;
+                afpInfo = cachedInfo.afpInfo;
+                goto have_info;
+            }
+            memcpy(cachePath, createRequest.Buffer, cachePathLength);
+            cacheable = pcount != 2;
+        }
     
         createMsgNum = EnqueueRequest(dib, SMB2_CREATE,
             sizeof(createRequest) + createRequest.NameLength);
@@ -140,6 +189,16 @@ top:
             return fstError;
     }
 
+    /*
+     * If the file type or Finder Info will be needed, try to get the AFP Info
+     * in the same round trip.  If the file turns out not to have AFP Info,
+     * the responses for it are just ignored.
+     */
+    if (pcount != 2) {
+        prefetchedAFPInfo =
+            EnqueueAFPInfoRequests(dib, gsosdp, &afpInfoRequests) == 0;
+    }
+
     if (!alreadyOpen || pcount != 2)
         SendMessages(dib);
 
@@ -148,6 +207,10 @@ top:
         result = GetResponse(dib, createMsgNum);
         if (result != rsDone) {
             retval = ConvertError(result);
+            if (result == rsFailed
+                && msg.smb2Header.Status == STATUS_OBJECT_NAME_NOT_FOUND
+                && cachePathLength <= INFO_CACHE_MAX_PATH)
+                CacheMissing(dib, cachePath, cachePathLength);
         } else {
             basicInfo.CreationTime = createResponse.CreationTime;
             basicInfo.LastWriteTime = createResponse.LastWriteTime;
@@ -173,6 +236,10 @@ top:
                 && result == rsFailed
                 && (msg.smb2Header.Status == STATUS_ACCESS_DENIED
                     || msg.smb2Header.Status == STATUS_INVALID_PARAMETER)) {
+                if (prefetchedAFPInfo) {
+                    GetAFPInfoResponses(dib, &afpInfoRequests);
+                    prefetchedAFPInfo = false;
+                }
                 alreadyOpen = false;
                 goto top;
             }
@@ -274,11 +341,18 @@ handle_close:
     if (!alreadyOpen) {
         /* Handle CLOSE response */
         result = GetResponse(dib, closeMsgNum);
-        if (result != rsDone)
-            return retval ? retval : ConvertError(result);
+        if (result != rsDone && retval == 0)
+            retval = ConvertError(result);
     }
 
-    if (haveAFPInfo && retval == 0) {
+    if (prefetchedAFPInfo) {
+        if (haveAFPInfo && retval == 0) {
+            retval = GetAFPInfoResponses(dib, &afpInfoRequests);
+        } else {
+            GetAFPInfoResponses(dib, &afpInfoRequests);
+            InitAFPInfo();
+        }
+    } else if (haveAFPInfo && retval == 0) {
         retval = GetAFPInfo(dib, gsosdp);
     } else {
         InitAFPInfo();
@@ -288,6 +362,20 @@ handle_close:
     if (retval != 0)
         return retval;
 
+    if (cacheable) {
+        cachedInfo.creationTime = basicInfo.CreationTime;
+        cachedInfo.lastWriteTime = basicInfo.LastWriteTime;
+        cachedInfo.fileAttributes = basicInfo.FileAttributes;
+        cachedInfo.dataEOF = dataEOF;
+        cachedInfo.dataAlloc = dataAlloc;
+        cachedInfo.haveResourceFork = haveResourceFork;
+        cachedInfo.resourceEOF = resourceEOF;
+        cachedInfo.resourceAlloc = resourceAlloc;
+        cachedInfo.afpInfo = afpInfo;
+        CacheInfo(dib, cachePath, cachePathLength, &cachedInfo);
+    }
+
+have_info:
     if (pcount == 0) {
         #define pblock ((FileRec*)pblock)
         
@@ -21,6 +21,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include "smb2/smb2.h"
+#include "smb2/fileinfo.h"
 #include "driver/driver.h"
 #include "gsos/gsosutils.h"
 #include "helpers/path.h"
@@ -29,6 +30,12 @@
 #include "helpers/errors.h"
 #include "helpers/afpinfo.h"
 #include "helpers/closerequest.h"
+#include "helpers/writebehind.h"
+#include "helpers/dirlist.h"
+#include "helpers/negcache.h"
+#include "helpers/infocache.h"
+#include "smb2/oplock.h"
+#include "smb2/durable.h"
 #include "fstops/open.h"
 
 #define ACCESS_TYPE_COUNT 3
@@ -73,6 +80,35 @@ void SetOpenAccess(Word access, bool p16Sharing) {
     }
 }
 
+/*
+ * Record that the file specified by path1 was found not to exist.
+ * (The path is translated again, because msg now holds the response.)
+ */
+static void CacheMissingFile(DIB *dib, struct GSOSDP *gsosdp) {
+    unsigned pathLength;
+
+    pathLength = GSOSDPPathToSMB(gsosdp, 1, gbuf, GBUF_SIZE);
+    if (pathLength != 0xFFFF)
+        CacheMissing(dib, gbuf, pathLength);
+}
+
+/*
+ * Check if the file whose SMB path is in createRequest is known to be a
+ * directory (because it is the root directory, we have cached information
+ * about it, or we have a cached listing for it).
+ */
+static bool KnownDirectory(DIB *dib) {
+    static CachedFileInfo cachedInfo;
+
+    if (createRequest.NameLength == 0)
+        return true;
+    if (LookupCachedInfo(dib, createRequest.Buffer, createRequest.NameLength,
+        &cachedInfo))
+        return (cachedInfo.fileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    return HaveDirListing(dib, createRequest.Buffer,
+        createRequest.NameLength);
+}
+
 Word Open(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     static Word requestAccess[ACCESS_TYPE_COUNT];
     int i;
@@ -87,11 +123,26 @@ Word Open(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     static SMB2_FILEID fileID;
     enum {openDataFork, openResourceFork, openOrCreateResourceFork} forkOp;
     uint16_t createMsgNum, closeMsgNum;
+    uint16_t msgLen;
+    uint8_t oplockLevel;
+    bool missing;
+    bool isDirectory;
 
     dib = GetDIB(gsosdp, 1);
     if (dib == NULL)
         return volNotFound;
 
+    /*
+     * Opening the file may break an oplock or lease that we hold on another
+     * open of it, so send any deferred writes to it first, to allow the
+     * break to be acknowledged immediately.  (This is done before building
+     * the request, since flushing uses msg.)
+     */
+    retval = FlushVolumeWriteBehind(dib,
+        (gsosdp->pathFlag & HAVE_PATH1) ? gsosdp->path1Ptr : NULL);
+    if (retval != 0)
+        return retval;
+
     // Determine allowable access modes (most to least preferred)
     if (pcount >= 3 && ((OpenRecGS*)pblock)->requestAccess != 0) {
         requestAccess[0] = ((OpenRecGS*)pblock)->requestAccess;
@@ -139,6 +190,12 @@ retry:
         return badPathSyntax;
     isRootDir = createRequest.NameLength == 0;
 
+    // Don't go to the server if the file was just found not to exist
+    if (IsKnownMissing(dib, createRequest.Buffer, createRequest.NameLength))
+        return fileNotFound;
+
+    isDirectory = forkOp == openDataFork && KnownDirectory(dib);
+
     if (forkOp >= openResourceFork) {
         if (createRequest.NameLength >
             sizeof(msg.body) - offsetof(SMB2_CREATE_Request, Buffer)
@@ -149,12 +206,19 @@ retry:
         createRequest.NameLength += sizeof(resourceForkSuffix);
     }
 
+    // Request an oplock or lease, and a durable handle.
+    msgLen = sizeof(createRequest) + createRequest.NameLength;
+    RequestCaching(dib, &msgLen, isDirectory);
+    RequestDurableHandle(dib, &msgLen);
+    oplockLevel = createRequest.RequestedOplockLevel;
+
     for (i = 0; i < ACCESS_TYPE_COUNT; i++) {
         switch (requestAccess[i]) {
         case readEnable:
         case writeEnable:
         case readWriteEnable:    
             SetOpenAccess(requestAccess[i], pcount == 0);
+            createRequest.RequestedOplockLevel = oplockLevel;
             break;
     
         case 0:
@@ -164,8 +228,7 @@ retry:
             return invalidAccess;
         }
 
-        result = SendRequestAndGetResponse(dib, SMB2_CREATE,
-            sizeof(createRequest) + createRequest.NameLength);
+        result = SendRequestAndGetResponse(dib, SMB2_CREATE, msgLen);
         if (result != rsFailed)
             break;
         if (msg.smb2Header.Status == STATUS_OBJECT_NAME_NOT_FOUND)
@@ -218,17 +281,24 @@ open_done:
 
                 result = GetResponse(dib, createMsgNum);
                 retval = ConvertError(result);
+                missing = result == rsFailed
+                    && msg.smb2Header.Status == STATUS_OBJECT_NAME_NOT_FOUND;
                 
                 result = GetResponse(dib, closeMsgNum);
                 // ignore any errors on close
 
-                if (retval != 0)
+                if (retval != 0) {
+                    if (missing)
+                        CacheMissingFile(dib, gsosdp);
                     return retval;
+                }
                 
                 forkOp = openOrCreateResourceFork;
                 goto retry;
             } else if (forkOp == openOrCreateResourceFork) {
                 return resForkNotFound;
+            } else {
+                CacheMissingFile(dib, gsosdp);
             }
         }
         return ConvertError(result);
@@ -236,6 +306,14 @@ open_done:
     
     fileID = createResponse.FileId;
 
+    /*
+     * If the resource fork was just created, cached information about the
+     * file (e.g. whether it has a resource fork) is no longer valid.
+     */
+    if (forkOp == openOrCreateResourceFork
+        && createResponse.CreateAction != FILE_OPENED)
+        InvalidateInfoCache(dib);
+
     retval = GetVCR(dib, &vcr);
     if (retval != 0)
         goto close_on_error2;
@@ -281,9 +359,25 @@ open_done:
     fcr->dirEntryNum = 0;
     fcr->nextServerEntryNum = -1;
     fcr->dirCacheHandle = NULL;
+    fcr->dirIndexHandle = NULL;
+    fcr->dirCachedCount = 0;
+    fcr->dirEntryCount = -1;
+    fcr->dirInfoHandle = NULL;
+    fcr->dirInfoCount = 0;
+    fcr->readAheadHandle = NULL;
+    fcr->readAheadLength = 0;
+    fcr->writeBehindHandle = NULL;
+    fcr->writeBehindLength = 0;
+    SetGrantedCaching(fcr);
     fcr->smbFlags = pcount == 0 ? SMB_FLAG_P16SHARING : 0;
+    SetGrantedDurability(fcr);
     fcr->createTime = createResponse.CreationTime;
 
+    // Use a cached listing for the directory, if we have one.
+    if (forkOp == openDataFork
+        && (createResponse.FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        LoadDirListing(fcr, dib);
+
     /*
      * Cache EOF to use in checking whether SetMark goes past EOF.
      * Our copy of the EOF should remain valid if the server fully enforces
@@ -18,23 +18,289 @@
 #include <gsos.h>
 #include <prodos.h>
 #include <string.h>
+#include <memory.h>
+#include <orca.h>
+#include <misctool.h>
 #include "smb2/smb2.h"
+#include "smb2/connection.h"
+#include "smb2/session.h"
+#include "smb2/channel.h"
+#include "smb2/tuning.h"
 #include "gsos/gsosdata.h"
 #include "driver/driver.h"
 #include "helpers/errors.h"
+#include "helpers/readahead.h"
+#include "helpers/writebehind.h"
 #include "utils/buffersize.h"
 
+/*
+ * Max number of READ requests that may be outstanding at once when
+ * pipelining.  The actual number is also limited by the available credits.
+ */
+#define READ_PIPELINE_DEPTH 4
+
+// Minimum size of each READ request in a pipelined read
+#define MIN_PIPELINED_READ_SIZE 4096u
+
+// Max size of each READ request in a pipelined read (must fit in 16 bits)
+#define MAX_PIPELINED_READ_SIZE 0xFE00u
+
+// Max size of a single READ request, if the server supports large ones
+#define MAX_LARGE_READ_SIZE 0x20000ul
+
+/*
+ * Read data using several READ requests that are outstanding at once, so
+ * that the round-trip latency of each request overlaps with the transfer of
+ * data for the others.  This is used for large reads not in newline mode.
+ *
+ * Reads up to count bytes starting at fcr->mark into buf, using up to depth
+ * outstanding requests of up to chunkSize bytes each on each connection.
+ * If the session has an additional channel (see smb2/channel.c), requests
+ * are spread across it and the main connection.  The data for each request
+ * is received directly into the appropriate part of buf.
+ * *transferred is set to the number of contiguous bytes that were read
+ * (which may be less than count even if there is no error).
+ * Returns a GS/OS error code.
+ */
+static Word PipelinedRead(DIB *dib, FCR *fcr, unsigned char *buf,
+    uint32_t count, uint16_t chunkSize, unsigned depth,
+    uint32_t *transferred) {
+    static ReadDataTarget targets[2 * READ_PIPELINE_DEPTH];
+    static uint64_t offsets[2 * READ_PIPELINE_DEPTH];
+    static DIB *targetDIBs[2 * READ_PIPELINE_DEPTH];
+    DIB *channelDIB;
+    DIB *sendDIB;
+    unsigned numPending = 0;
+    unsigned mainPending = 0;
+    unsigned channelPending = 0;
+    unsigned channelDepth = 0;
+    unsigned j, k;
+    ReadStatus result;
+    Word retval = 0;
+    uint64_t startOffset = fcr->mark;
+    uint64_t nextOffset = startOffset;
+    uint64_t stopOffset = startOffset + count;
+    uint16_t length;
+
+    channelDIB = ChannelDIB(dib);
+    if (channelDIB != NULL) {
+        RequestCredits(channelDIB, READ_PIPELINE_DEPTH);
+        channelDepth = min(AvailableCredits(channelDIB), depth);
+    }
+
+    readDataTargets = targets;
+    readDataTargetCount = 0;
+
+    do {
+        // Send requests until the pipelines are full
+        while (nextOffset < stopOffset) {
+            if (channelPending < channelDepth
+                && (channelPending < mainPending || mainPending >= depth)) {
+                sendDIB = channelDIB;
+            } else if (mainPending < depth) {
+                sendDIB = dib;
+            } else {
+                break;
+            }
+        
+            length = min(stopOffset - nextOffset, chunkSize);
+
+            readRequest.Padding =
+                sizeof(SMB2Header) + offsetof(SMB2_READ_Response, Buffer);
+            readRequest.Flags = 0;
+            readRequest.Length = length;
+            readRequest.Offset = nextOffset;
+            readRequest.FileId = fcr->fileID;
+            readRequest.MinimumCount = 1;
+            readRequest.Channel = 0;
+            readRequest.RemainingBytes = 0;
+            readRequest.ReadChannelInfoOffset = 0;
+            readRequest.ReadChannelInfoLength = 0;
+
+            if (!SendPipelinedRequest(sendDIB, SMB2_READ, sizeof(readRequest),
+                &targets[numPending].messageId)) {
+                if (sendDIB != dib) {
+                    // Stop using the channel, but carry on without it.
+                    channelDepth = 0;
+                    continue;
+                }
+                stopOffset = nextOffset;
+                retval = networkError;
+                break;
+            }
+
+            targets[numPending].connection = sendDIB->session->connection;
+            targets[numPending].buffer =
+                buf + (uint32_t)(nextOffset - startOffset);
+            targets[numPending].size = length;
+            offsets[numPending] = nextOffset;
+            targetDIBs[numPending] = sendDIB;
+            if (sendDIB == dib) {
+                mainPending++;
+            } else {
+                channelPending++;
+            }
+            readDataTargetCount = ++numPending;
+            nextOffset += length;
+        }
+        
+        if (numPending == 0)
+            break;
+
+        // Wait on the connection used for the earliest outstanding request.
+        k = 0;
+        for (j = 1; j < numPending; j++) {
+            if (offsets[j] < offsets[k])
+                k = j;
+        }
+        sendDIB = targetDIBs[k];
+
+        result = GetPipelinedResponse(sendDIB, SMB2_READ);
+        
+        for (j = 0; j < numPending; j++) {
+            if (result != rsError
+                && targets[j].connection == sendDIB->session->connection
+                && targets[j].messageId == msg.smb2Header.MessageId)
+                break;
+        }
+        if (j == numPending && sendDIB != dib) {
+            /*
+             * The channel failed.  Drop it, and stop before the first of its
+             * requests.  Requests on the main connection are still received,
+             * and the rest of the data can be read using it alone.
+             */
+            DropChannel(dib->session);
+            channelDepth = 0;
+            channelPending = 0;
+            for (j = 0; j < numPending; j++) {
+                if (targetDIBs[j] != dib) {
+                    if (offsets[j] < stopOffset)
+                        stopOffset = offsets[j];
+                    numPending--;
+                    targets[j] = targets[numPending];
+                    offsets[j] = offsets[numPending];
+                    targetDIBs[j] = targetDIBs[numPending];
+                    j--;
+                }
+            }
+            readDataTargetCount = numPending;
+            if (nextOffset > stopOffset)
+                nextOffset = stopOffset;
+            continue;
+        }
+        if (j == numPending) {
+            /*
+             * We cannot match up the remaining responses, so give up on them.
+             * Only the data before the first outstanding request is valid.
+             * The requests are abandoned, so their responses will be
+             * discarded if they arrive later.
+             */
+            for (j = 0; j < numPending; j++) {
+                if (offsets[j] < stopOffset)
+                    stopOffset = offsets[j];
+                AbandonPipelinedRequest(targetDIBs[j], targets[j].messageId);
+            }
+            DropChannel(dib->session);
+            retval = networkError;
+            break;
+        }
+
+        if (result != rsDone) {
+            if (offsets[j] < stopOffset) {
+                stopOffset = offsets[j];
+                retval = ConvertError(result);
+            }
+        } else if (readResponse.DataLength == 0
+            || readResponse.DataLength > targets[j].size
+            || (readResponse.DataOffset != 0 && !VerifyBuffer(
+                readResponse.DataOffset, readResponse.DataLength)))
+        {
+            if (offsets[j] < stopOffset) {
+                stopOffset = offsets[j];
+                retval = networkError;
+            }
+        } else if (offsets[j] < stopOffset) {
+            // Data is normally already in place, but may be in msg.
+            if (readResponse.DataOffset != 0) {
+                memcpy(targets[j].buffer,
+                    (unsigned char *)&msg.smb2Header + readResponse.DataOffset,
+                    readResponse.DataLength);
+            }
+
+            // On a short read, data past what was returned is not valid.
+            if (readResponse.DataLength < targets[j].size) {
+                stopOffset = offsets[j] + readResponse.DataLength;
+                retval = 0;
+            }
+        }
+        
+        if (targetDIBs[j] == dib) {
+            mainPending--;
+        } else {
+            channelPending--;
+        }
+        numPending--;
+        targets[j] = targets[numPending];
+        offsets[j] = offsets[numPending];
+        targetDIBs[j] = targetDIBs[numPending];
+        readDataTargetCount = numPending;
+    } while (numPending != 0 || nextOffset < stopOffset);
+
+    readDataTargets = NULL;
+    readDataTargetCount = 0;
+
+    *transferred = stopOffset - startOffset;
+    return retval;
+}
+
+/*
+ * Determine the size to use for READ requests larger than IO_BUFFER_SIZE,
+ * if the server supports them.  Returns 0 if they should not be used.
+ */
+static uint32_t LargeReadSize(DIB *dib, uint32_t count) {
+    Connection *connection = dib->session->connection;
+    uint32_t largeSize;
+    uint16_t credits;
+    
+    largeSize = min(count, connection->maxReadSize);
+    largeSize = min(largeSize, MAX_LARGE_READ_SIZE);
+    largeSize = TransferMemoryLimit(largeSize);
+    if (largeSize <= IO_BUFFER_SIZE)
+        return 0;
+
+    RequestCredits(dib, (largeSize - 1) / 0x10000 + 1);
+    credits = AvailableCredits(dib);
+    largeSize = min(largeSize, credits * 0x10000ul);
+    if (largeSize <= IO_BUFFER_SIZE)
+        return 0;
+    
+    return largeSize;
+}
+
 Word Read(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     Word result;
     VirtualPointer vp;
     FCR *fcr;
     unsigned i, j, ch;
     unsigned char *buf;
+    unsigned char *data;
     uint32_t remainingCount;
-    uint16_t transferCount;
+    uint32_t transferCount;
+    uint32_t k;
     unsigned char *newlineList;
     Word retval;
     uint16_t blockSize;
+    uint16_t chunkSize;
+    unsigned depth;
+    uint32_t transferred;
+    uint32_t readSize;
+    uint32_t window;
+    uint32_t startCount;
+    LongWord startTime;
+    Handle largeBufHandle = NULL;
+    bool newlineFound;
+    bool readAheadFilled;
+    bool useLargeRead;
 
     if (pcount != 0)
         pblock = &(((IORecGS*)pblock)->refNum);
@@ -58,12 +324,122 @@ Word Read(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     if (remainingCount == 0)
         return 0;
 
+    // Flush buffered writes to any part of the file we may read
+    retval = FlushWriteBehindRange(fcr, &dibs[i], fcr->mark,
+        fcr->mark + max(remainingCount, READ_AHEAD_SIZE));
+    if (retval != 0)
+        return retval;
+
+    /*
+     * Use data from the read-ahead buffer, if available.  If the remaining
+     * request is small, refill the buffer from the server and use it again.
+     * This is only done if our oplock or lease allows read caching.
+     */
+    if (fcr->cacheFlags & CACHE_READ) {
+        readAheadFilled = false;
+        do {
+            transferred =
+                ReadFromReadAhead(fcr, buf, remainingCount, &newlineFound);
+            remainingCount -= transferred;
+            buf += transferred;
+            pblock->transferCount += transferred;
+            fcr->mark += transferred;
+            if (newlineFound || remainingCount == 0)
+                return 0;
+            
+            if (remainingCount >= READ_AHEAD_THRESHOLD || readAheadFilled)
+                break;
+            
+            retval = FillReadAhead(fcr, &dibs[i]);
+            if (retval != 0) {
+                if (retval == eofEncountered && pblock->transferCount != 0)
+                    retval = 0;
+                return retval;
+            }
+            readAheadFilled = true;
+        } while (fcr->readAheadLength != 0);
+    }
+
     blockSize = GetBufferSize(min(remainingCount, IO_BUFFER_SIZE));
     if (blockSize == 0)
         return outOfMem;
 
+    /*
+     * If the server supports it, use READ requests larger than
+     * IO_BUFFER_SIZE.  We only do this if memory is not tight.
+     */
+    readSize = 0;
+    if (blockSize == IO_BUFFER_SIZE)
+        readSize = LargeReadSize(&dibs[i], remainingCount);
+
+    if (fcr->newlineLen == 0) {
+        /*
+         * Otherwise (or if the measured transfer window is larger than a
+         * single large READ would cover), keep several requests outstanding
+         * at once for large reads.  Their total size on each connection is
+         * kept within the transfer window (see smb2/tuning.c), or blockSize
+         * if memory is tight, so Marinetti will not need to queue up more
+         * data on it than we have allowed for.  Without measurements, the
+         * window is IO_BUFFER_SIZE, so a single large READ is used.
+         */
+        window = blockSize;
+        if (blockSize == IO_BUFFER_SIZE)
+            window = TransferWindow(dibs[i].session->connection);
+        useLargeRead = readSize != 0 && window <= readSize;
+        RequestCredits(&dibs[i], READ_PIPELINE_DEPTH);
+        depth = min(AvailableCredits(&dibs[i]), READ_PIPELINE_DEPTH);
+        if (depth > 1) {
+            window = min(window / depth, MAX_PIPELINED_READ_SIZE);
+            window = min(window, dibs[i].session->connection->maxReadSize);
+            chunkSize = window & 0xFE00;
+        } else {
+            chunkSize = 0;
+        }
+        if (!useLargeRead
+            && remainingCount > blockSize
+            && chunkSize >= MIN_PIPELINED_READ_SIZE
+            && !(dibs[i].flags & FLAG_PIPE_SHARE)) {
+            startTime = GetTick();
+            startCount = pblock->transferCount;
+            do {
+                retval = PipelinedRead(&dibs[i], fcr, buf, remainingCount,
+                    chunkSize, depth, &transferred);
+                
+                remainingCount -= transferred;
+                buf += transferred;
+                pblock->transferCount += transferred;
+                fcr->mark += transferred;
+            } while (retval == 0 && remainingCount != 0);
+
+            NoteTransfer(dibs[i].session->connection,
+                pblock->transferCount - startCount, GetTick() - startTime);
+            
+            if (retval == eofEncountered && pblock->transferCount != 0)
+                retval = 0;
+            
+            return retval;
+        }
+    } else if (readSize != 0) {
+        /*
+         * In newline mode, we cannot read data directly into the caller's
+         * buffer, since it may go past the newline.  Large reads are done
+         * into a separately allocated buffer instead of msg.
+         */
+        largeBufHandle =
+            NewHandle(readSize, userid(), attrLocked | attrFixed, 0);
+        if (toolerror()) {
+            largeBufHandle = NULL;
+            readSize = 0;
+        }
+    }
+
+    if (readSize == 0)
+        readSize = blockSize;
+
+    startTime = GetTick();
+    startCount = pblock->transferCount;
     do {
-        transferCount = min(remainingCount, blockSize);
+        transferCount = min(remainingCount, readSize);
         readRequest.Padding =
             sizeof(SMB2Header) + offsetof(SMB2_READ_Response, Buffer);
         readRequest.Flags = 0;
@@ -80,28 +456,45 @@ Word Read(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
         readRequest.ReadChannelInfoOffset = 0;
         readRequest.ReadChannelInfoLength = 0;
 
+        // Receive the data directly into its destination, if possible.
+        if (fcr->newlineLen == 0) {
+            readDataBuffer = buf;
+        } else if (largeBufHandle != NULL) {
+            readDataBuffer = (unsigned char *)*largeBufHandle;
+        }
+        readDataBufferSize = transferCount;
+        data = readDataBuffer;
+
         result = SendRequestAndGetResponse(&dibs[i], SMB2_READ,
             sizeof(readRequest));
+        readDataBuffer = NULL;
         if (result != rsDone)
             break;
         
         if (readResponse.DataLength == 0
-            || readResponse.DataLength > transferCount)
-            return networkError;
+            || readResponse.DataLength > transferCount) {
+            retval = networkError;
+            goto done;
+        }
 
-        if (!VerifyBuffer(readResponse.DataOffset, readResponse.DataLength))
-            return networkError;
+        if (readResponse.DataOffset != 0 || data == NULL) {
+            if (!VerifyBuffer(readResponse.DataOffset,
+                readResponse.DataLength)) {
+                retval = networkError;
+                goto done;
+            }
+            data = (unsigned char *)&msg.smb2Header + readResponse.DataOffset;
+        }
 
         // newline processing
         if (fcr->newlineLen != 0) {
             vp = fcr->newline;
             DerefVP(newlineList, vp);
-            for (i = 0; i < readResponse.DataLength; i++) {
-                ch = ((uint8_t *)&msg.smb2Header)[readResponse.DataOffset + i]
-                    & fcr->mask;
+            for (k = 0; k < readResponse.DataLength; k++) {
+                ch = data[k] & fcr->mask;
                 for (j = 0; j < fcr->newlineLen; j++) {
                     if (ch == newlineList[j]) {
-                        readResponse.DataLength = remainingCount = i + 1;
+                        readResponse.DataLength = remainingCount = k + 1;
                         goto newline_done;
                     }
                 }
@@ -109,23 +502,29 @@ Word Read(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
         }
 newline_done:
 
-        memcpy(buf, (unsigned char *)&msg.smb2Header + readResponse.DataOffset,
-            readResponse.DataLength);
+        if (data != buf)
+            memcpy(buf, data, readResponse.DataLength);
         
         remainingCount -= readResponse.DataLength;
         buf += readResponse.DataLength;
         pblock->transferCount += readResponse.DataLength;
         fcr->mark += readResponse.DataLength;
     } while (remainingCount != 0);
+
+    NoteTransfer(dibs[i].session->connection,
+        pblock->transferCount - startCount, GetTick() - startTime);
     
     if (remainingCount == 0) {
-        return 0;
+        retval = 0;
     } else {
         retval = ConvertError(result);
         
         if (retval == eofEncountered && pblock->transferCount !=  0)
             retval = 0;
-        
-        return retval;
     }
+
+done:
+    if (largeBufHandle != NULL)
+        DisposeHandle(largeBufHandle);
+    return retval;
 }
@@ -24,6 +24,9 @@
 #include "driver/driver.h"
 #include "helpers/position.h"
 #include "helpers/errors.h"
+#include "helpers/readahead.h"
+#include "helpers/writebehind.h"
+#include "helpers/infocache.h"
 #include "fst/fstdata.h"
 
 Word SetEOF(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
@@ -67,6 +70,13 @@ Word SetEOF(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     if (retval != 0)
         return retval;
 
+    InvalidateReadAhead(fcr);
+    InvalidateInfoCache(&dibs[i]);
+
+    retval = FlushWriteBehind(fcr, &dibs[i]);
+    if (retval != 0)
+        return retval;
+
     /*
      * Set EOF
      */
@@ -31,6 +31,7 @@
 #include "helpers/errors.h"
 #include "helpers/closerequest.h"
 #include "helpers/fsattributes.h"
+#include "helpers/infocache.h"
 #include "fst/fstdata.h"
 
 Word SetFileInfo(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
@@ -60,6 +61,8 @@ Word SetFileInfo(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     if (dib == NULL)
         return volNotFound;
 
+    InvalidateInfoCache(dib);
+
     if (pcount == 0) {
         #define pblock ((FileRec*)pblock)
         
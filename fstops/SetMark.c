@@ -24,6 +24,7 @@
 #include "driver/driver.h"
 #include "helpers/position.h"
 #include "helpers/errors.h"
+#include "helpers/writebehind.h"
 
 Word SetMark(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     VirtualPointer vp;
@@ -65,6 +66,19 @@ Word SetMark(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     if (retval != 0)
         return retval;
 
+    /*
+     * Flush buffered writes if the new position is outside of (and not
+     * immediately after) the buffered data, since further writes could
+     * not be combined with them.
+     */
+    if (fcr->writeBehindLength != 0
+        && (pos < fcr->writeBehindOffset
+            || pos > fcr->writeBehindOffset + fcr->writeBehindLength)) {
+        retval = FlushWriteBehind(fcr, &dibs[i]);
+        if (retval != 0)
+            return retval;
+    }
+
     /*
      * Check for position past our cached copy of EOF.  If it appears to be
      * past EOF, confirm EOF with server before reporting an error.
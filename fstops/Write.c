@@ -19,20 +19,56 @@
 #include <prodos.h>
 #include <string.h>
 #include "smb2/smb2.h"
+#include "smb2/connection.h"
+#include "smb2/session.h"
+#include "smb2/tuning.h"
 #include "gsos/gsosdata.h"
 #include "driver/driver.h"
 #include "helpers/errors.h"
+#include "helpers/readahead.h"
+#include "helpers/writebehind.h"
+#include "helpers/infocache.h"
 #include "fst/fstdata.h"
 #include "utils/buffersize.h"
 
+// Max size of a single WRITE request, if the server supports large ones
+#define MAX_LARGE_WRITE_SIZE 0x20000ul
+
+/*
+ * Determine the size to use for WRITE requests larger than IO_BUFFER_SIZE,
+ * if the server supports them.  Returns 0 if they should not be used.
+ */
+static uint32_t LargeWriteSize(DIB *dib, uint32_t count) {
+    Connection *connection = dib->session->connection;
+    uint32_t largeSize;
+    uint16_t credits;
+    
+    largeSize = min(count, connection->maxWriteSize);
+    largeSize = min(largeSize, MAX_LARGE_WRITE_SIZE);
+    largeSize = TransferMemoryLimit(largeSize);
+    if (largeSize <= IO_BUFFER_SIZE)
+        return 0;
+
+    RequestCredits(dib, (largeSize - 1) / 0x10000 + 1);
+    credits = AvailableCredits(dib);
+    largeSize = min(largeSize, credits * 0x10000ul);
+    if (largeSize <= IO_BUFFER_SIZE)
+        return 0;
+    
+    return largeSize;
+}
+
 Word Write(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     Word result;
+    Word retval;
+    bool buffered;
     VirtualPointer vp;
     FCR *fcr;
     unsigned i;
     unsigned char *buf;
     uint32_t remainingCount;
-    uint16_t transferCount;
+    uint32_t transferCount;
+    uint32_t writeSize;
     uint16_t blockSize;
 
     if (pcount != 0)
@@ -62,8 +98,61 @@ Word Write(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
     if (blockSize == 0)
         return outOfMem;
 
+    InvalidateReadAhead(fcr);
+
+    /*
+     * Cached information about the file (e.g. its EOF) will be out of date
+     * once the data is written, so invalidate it.  This is only done once
+     * for a series of writes held in the write-behind buffer; the flag is
+     * cleared when they are flushed, or before writing directly to the server
+     * (so that later writes will invalidate it again).
+     */
+    if (!(fcr->smbFlags & SMB_FLAG_DIRTY)) {
+        InvalidateInfoCache(&dibs[i]);
+        fcr->smbFlags |= SMB_FLAG_DIRTY;
+    }
+
+    /*
+     * Small writes are held in the write-behind buffer, so that adjacent
+     * ones can be sent to the server together.  Otherwise, any buffered
+     * data is flushed first, so that writes reach the server in order.
+     * Writes are only deferred if our oplock or lease allows write caching.
+     */
+    if (remainingCount < WRITE_BEHIND_THRESHOLD
+        && (fcr->cacheFlags & CACHE_WRITE)) {
+        retval = BufferWrite(fcr, &dibs[i], buf, remainingCount, &buffered);
+        if (retval != 0)
+            return retval;
+        
+        if (buffered) {
+            volChangedDevNum = dibs[i].DIBDevNum;
+            pblock->transferCount = remainingCount;
+            fcr->mark += remainingCount;
+            if (fcr->mark > fcr->eof)
+                fcr->eof = fcr->mark;
+            return 0;
+        }
+    }
+    
+    retval = FlushWriteBehind(fcr, &dibs[i]);
+    if (retval != 0)
+        return retval;
+
+    // Data written directly is not covered by the invalidation above.
+    fcr->smbFlags &= ~SMB_FLAG_DIRTY;
+
+    /*
+     * If the server supports it, use WRITE requests larger than
+     * IO_BUFFER_SIZE.  We only do this if memory is not tight.
+     */
+    writeSize = 0;
+    if (blockSize == IO_BUFFER_SIZE)
+        writeSize = LargeWriteSize(&dibs[i], remainingCount);
+    if (writeSize == 0)
+        writeSize = blockSize;
+
     do {
-        transferCount = min(remainingCount, blockSize);
+        transferCount = min(remainingCount, writeSize);
         writeRequest.DataOffset =
             sizeof(SMB2Header) + offsetof(SMB2_WRITE_Request, Buffer);
         writeRequest.Length = transferCount;
@@ -78,10 +167,10 @@ Word Write(void *pblock, struct GSOSDP *gsosdp, Word pcount) {
         writeRequest.WriteChannelInfoOffset = 0;
         writeRequest.WriteChannelInfoLength = 0;
         writeRequest.Flags = 0;
-        memcpy(writeRequest.Buffer, buf, writeRequest.Length);
 
-        result = SendRequestAndGetResponse(&dibs[i], SMB2_WRITE,
-            sizeof(writeRequest) + transferCount);
+        // The data is sent directly from the caller's buffer.
+        result = SendRequestWithDataAndGetResponse(&dibs[i], SMB2_WRITE,
+            sizeof(writeRequest), buf, transferCount);
         if (result != rsDone)
             break;
 
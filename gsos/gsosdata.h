@@ -142,16 +142,27 @@ typedef struct FCR {
     // (. and .. are considered entries -1 and 0; GDE returns entries 1 onward)
     int32_t nextServerEntryNum; 
 
-    // Handle holding cached directory entires
+    // Handle holding cached directory entires (see helpers/dircache.c)
     Handle dirCacheHandle;
+    // Handle holding offsets of the cached entries within dirCacheHandle
+    Handle dirIndexHandle;
 
     /* These fields are only valid if dirCacheHandle != NULL */
     // First entry in the cache
     int32_t firstCachedEntryNum;
-    // Last used entry in the cache
-    uint16_t lastUsedCachedEntryNum;
-    // Offset of last used entry within cached data
-    uint16_t lastUsedCachedEntryOffset;
+    // Number of entries in the cache
+    uint16_t dirCachedCount;
+    // Tick count when the cached entries were fetched from the server
+    LongWord dirCacheTime;
+
+    // Number of directory entries, if known from a previous count, else -1
+    int32_t dirEntryCount;
+
+    // MessageId of QUERY_DIRECTORY sent in advance for the next page of
+    // entries, and connection's reconnectTime when it was sent (these are
+    // only valid if SMB_FLAG_DIR_PREFETCH is set)
+    uint64_t dirPrefetchMessageId;
+    LongWord dirPrefetchReconnectTime;
     
     uint16_t smbFlags;
     uint64_t createTime;
@@ -160,13 +171,55 @@ typedef struct FCR {
     // going to the server to check if a SetMark call would go past EOF,
     // and is otherwise not treated as authoritative.
     uint64_t eof;
+
+    // Handle holding read-ahead data (see helpers/readahead.c), or NULL
+    Handle readAheadHandle;
+    // File offset and length of valid data in the read-ahead buffer
+    uint64_t readAheadOffset;
+    uint16_t readAheadLength;
+
+    // Handle holding write-behind data (see helpers/writebehind.c), or NULL
+    Handle writeBehindHandle;
+    // File offset and length of data in the write-behind buffer
+    uint64_t writeBehindOffset;
+    uint16_t writeBehindLength;
+
+    // Handle holding prefetched info for directory entries (helpers/dirinfo.c)
+    Handle dirInfoHandle;
+    // First entry with prefetched info, and number of entries with it
+    uint16_t firstDirInfoEntryNum;
+    uint16_t dirInfoCount;
+
+    // Caching allowed by the oplock or lease held on the file (CACHE_* flags)
+    uint16_t cacheFlags;
+    // Lease key, if CACHE_LEASE is set
+    smb_u128 leaseKey;
+    // Lease epoch, if CACHE_LEASE_V2 is set
+    uint16_t leaseEpoch;
+    // Oplock level or lease state to acknowledge, if CACHE_BREAK_PENDING is set
+    uint32_t breakToState;
+
+    // CreateGuid of the durable handle, if SMB_FLAG_DURABLE is set
+    GUID createGuid;
 } FCR;
 
+/* cacheFlags bits (see smb2/oplock.c) */
+#define CACHE_READ          0x0001 /* may cache data read from the file */
+#define CACHE_WRITE         0x0002 /* may defer writes to the file */
+#define CACHE_LEASE         0x0004 /* caching is governed by a lease */
+#define CACHE_LEASE_V2      0x0008 /* lease uses the version 2 context */
+#define CACHE_HANDLE        0x0010 /* may keep the handle open (lease) */
+#define CACHE_BREAK_PENDING 0x8000 /* break to be acknowledged after flush */
+
 /* access bits (in addition to standard access flags in low bits) */
 #define ACCESS_FLAG_CLEAN 0x8000
 #define ACCESS_FLAG_RFORK 0x4000
 
 #define SMB_FLAG_P16SHARING 0x0001
+#define SMB_FLAG_UNLEASED_LISTING 0x0002 /* dir cache from a TTL-only listing */
+#define SMB_FLAG_DIR_PREFETCH     0x0004 /* next dir page has been requested */
+#define SMB_FLAG_DURABLE          0x0008 /* handle is durable (smb2/durable.c) */
+#define SMB_FLAG_DIRTY            0x0010 /* info cache invalidated for writes */
 
 extern unsigned char *gbuf;
 extern struct GSOSDP *gsosDP;  /* GS/OS direct page ptr */
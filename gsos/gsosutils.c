@@ -54,13 +54,41 @@ Word WritePString(Word length, char *str, char *buf) {
     return 0;
 }
 
+/*
+ * Get DIB for the SMB volume named at the start of a full path.
+ * Returns NULL if the path does not start with the name of a mounted volume.
+ */
+DIB *GetDIBForPath(GSString *path) {
+    size_t volNameLen;
+    unsigned i;
+    char *sep;
+
+    if (path->length == 0 || path->text[0] != ':')
+        return NULL;
+
+    sep = memchr(path->text+1, ':', path->length-1);
+    if (sep) {
+        volNameLen = sep - path->text - 1;
+    } else {
+        volNameLen = path->length - 1;
+    }
+
+    for (i = 0; i < NDIBS; i++) {
+        if (dibs[i].extendedDIBPtr != 0
+            && dibs[i].volName->length == volNameLen
+            && memcasecmp(dibs[i].volName->text, path->text+1, volNameLen)
+                == 0)
+            return &dibs[i];
+    }
+
+    return NULL;
+}
+
 /* Get device number for call from GS/OS DP (path 1 or 2). */
 DIB *GetDIB(struct GSOSDP *gsosdp, int num) {
     Word devNum;
     GSString *path;
-    size_t volNameLen;
     unsigned i;
-    char *sep;
 
     if ((num == 1 && (gsosdp->pathFlag & HAVE_PATH1)) ||
         (num == 2 && (gsosdp->pathFlag & HAVE_PATH2))) {
@@ -75,20 +103,7 @@ DIB *GetDIB(struct GSOSDP *gsosdp, int num) {
         if (path->text[0] != ':')
             goto useDevNum;
 
-        sep = memchr(path->text+1, ':', path->length-1);
-        if (sep) {
-            volNameLen = sep - path->text - 1;
-        } else {
-            volNameLen = path->length - 1;
-        }
-
-        for (i = 0; i < NDIBS; i++) {
-            if (dibs[i].extendedDIBPtr != 0
-                && dibs[i].volName->length == volNameLen
-                && memcasecmp(dibs[i].volName->text, path->text+1, volNameLen)
-                    == 0)
-                return &dibs[i];
-        }
+        return GetDIBForPath(path);
     } else {
 useDevNum:
         if (num == 1) {
@@ -106,6 +121,35 @@ useDevNum:
     return NULL;
 }
 
+/*
+ * Get the FCR with the specified index in GS/OS's list of FCRs (starting
+ * from 1).  Returns NULL if there are no FCRs at or after that index.
+ */
+FCR *GetFCR(unsigned index) {
+    VirtualPointer vp;
+    FCR *fcr;
+    bool done = false;
+
+    asm {
+        ldx index
+        phd
+        lda gsosDP
+        tcd
+        txa
+        jsl GET_FCR
+        pld
+        rol done
+        stx vp
+        sty vp+2
+    }
+    
+    if (done)
+        return NULL;
+    
+    DerefVP(fcr, vp);
+    return fcr;
+}
+
 /*
  * Get VCR for the SMB volume mounted on the specified device.
  * Returns 0 on success, or a GS/OS error code.
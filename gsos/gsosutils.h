@@ -23,7 +23,9 @@
 
 Word WriteGSOSString(Word length, char *str, ResultBufPtr buf);
 Word WritePString(Word length, char *str, char *buf);
+DIB *GetDIBForPath(GSString *path);
 DIB *GetDIB(struct GSOSDP *gsosdp, int num);
 Word GetVCR(DIB *dib, VCR **vcrPtrPtr);
+FCR *GetFCR(unsigned index);
 
 #endif
@@ -29,59 +29,69 @@ const char16_t afpInfoSuffix[18] = u":AFP_AfpInfo:$DATA";
 const char16_t resourceForkSuffix[19] = u":AFP_Resource:$DATA";
 
 /*
- * Get the AFP Info data stream for a file.
- * This fills in afpInfo with the info.  Returns a GS/OS result code.
+ * Enqueue requests to open the AFP Info data stream for a file, read it,
+ * and close it.  These may follow other requests in a compound chain, so
+ * that the AFP Info is fetched in the same round trip as other information.
+ * The message numbers are stored in *requests, for use with
+ * GetAFPInfoResponses.
+ *
+ * Returns a GS/OS result code.  On failure (including if there is not
+ * enough buffer space or credits to add the requests to the chain), no
+ * requests are enqueued, but any that were previously enqueued are kept.
  */
-Word GetAFPInfo(DIB *dib, struct GSOSDP *gsosdp) {
-    ReadStatus result;
-    Word retval = 0;
+Word EnqueueAFPInfoRequests(DIB *dib, struct GSOSDP *gsosdp,
+    AFPInfoRequests *requests) {
+    SMB2_CREATE_Request *createReq;
     SMB2_READ_Request *readReq;
-    uint16_t createMsgNum, readMsgNum, closeMsgNum;
-    
-    memset(&afpInfo, 0, sizeof(AFPInfo));
+    uint16_t nameSpace;
 
-    /*
-     * Open AFP Info ADS
-     */
-    createRequest.SecurityFlags = 0;
-    createRequest.RequestedOplockLevel = SMB2_OPLOCK_LEVEL_NONE;
-    createRequest.ImpersonationLevel = Impersonation;
-    createRequest.SmbCreateFlags = 0;
-    createRequest.Reserved = 0;
-    createRequest.DesiredAccess = FILE_READ_DATA;
-    createRequest.FileAttributes = 0;
-    createRequest.ShareAccess = FILE_SHARE_READ;
-    createRequest.CreateDisposition = FILE_OPEN;
-    createRequest.CreateOptions = 0; // TODO maybe FILE_NO_EA_KNOWLEDGE
-    createRequest.NameOffset =
-        sizeof(SMB2Header) + offsetof(SMB2_CREATE_Request, Buffer);
-    createRequest.CreateContextsOffset = 0;
-    createRequest.CreateContextsLength = 0;
+    createReq = (SMB2_CREATE_Request*)nextMsg->Body;
+    if (createReq->Buffer + sizeof(afpInfoSuffix) >= msg.body + sizeof(msg.body))
+        return fstError;
+    nameSpace = msg.body + sizeof(msg.body) - createReq->Buffer;
 
     // translate filename to SMB format
-    createRequest.NameLength = GSOSDPPathToSMB(gsosdp, 1, createRequest.Buffer,
-        sizeof(msg.body) - offsetof(SMB2_CREATE_Request, Buffer));
-    if (createRequest.NameLength == 0xFFFF)
+    createReq->NameLength =
+        GSOSDPPathToSMB(gsosdp, 1, createReq->Buffer, nameSpace);
+    if (createReq->NameLength == 0xFFFF)
         return badPathSyntax;
 
-    if (createRequest.NameLength >
-        sizeof(msg.body) - offsetof(SMB2_CREATE_Request, Buffer)
-        - sizeof(afpInfoSuffix))
+    if (createReq->NameLength > nameSpace - sizeof(afpInfoSuffix))
         return badPathSyntax;
 
-    memcpy(createRequest.Buffer + createRequest.NameLength,
+    memcpy(createReq->Buffer + createReq->NameLength,
         afpInfoSuffix, sizeof(afpInfoSuffix));
-    createRequest.NameLength += sizeof(afpInfoSuffix);
+    createReq->NameLength += sizeof(afpInfoSuffix);
     
-    createMsgNum = EnqueueRequest(dib, SMB2_CREATE,
-        sizeof(createRequest) + createRequest.NameLength);
+    if (!CanAddToCompound(dib, 3, sizeof(*createReq) + createReq->NameLength
+        + sizeof(SMB2_READ_Request) + sizeof(SMB2_CLOSE_Request)))
+        return fstError;
+
+    /*
+     * Open AFP Info ADS
+     */
+    createReq->SecurityFlags = 0;
+    createReq->RequestedOplockLevel = SMB2_OPLOCK_LEVEL_NONE;
+    createReq->ImpersonationLevel = Impersonation;
+    createReq->SmbCreateFlags = 0;
+    createReq->Reserved = 0;
+    createReq->DesiredAccess = FILE_READ_DATA;
+    createReq->FileAttributes = 0;
+    createReq->ShareAccess = FILE_SHARE_READ;
+    createReq->CreateDisposition = FILE_OPEN;
+    createReq->CreateOptions = 0; // TODO maybe FILE_NO_EA_KNOWLEDGE
+    createReq->NameOffset = (char*)createReq->Buffer - (char*)nextMsg;
+    createReq->CreateContextsOffset = 0;
+    createReq->CreateContextsLength = 0;
+    
+    requests->createMsgNum = EnqueueRequest(dib, SMB2_CREATE,
+        sizeof(*createReq) + createReq->NameLength);
 
     /*
      * Read AFP Info
      */
     readReq = (SMB2_READ_Request*)nextMsg->Body;
-    if (!SpaceAvailable(sizeof(*readReq)))
-        return fstError;
+    // no need to check for space (checked above)
     
     readReq->Padding =
         sizeof(SMB2Header) + offsetof(SMB2_READ_Response, Buffer);
@@ -95,24 +105,35 @@ Word GetAFPInfo(DIB *dib, struct GSOSDP *gsosdp) {
     readReq->ReadChannelInfoOffset = 0;
     readReq->ReadChannelInfoLength = 0;
 
-    readMsgNum = EnqueueRequest(dib, SMB2_READ, sizeof(*readReq));
+    requests->readMsgNum = EnqueueRequest(dib, SMB2_READ, sizeof(*readReq));
 
     /*
      * Close AFP Info ADS
      */
-    closeMsgNum = EnqueueCloseRequest(dib, &fileIDFromPrevious);
-    if (closeMsgNum == 0xFFFF)
-        return fstError;
+    requests->closeMsgNum = EnqueueCloseRequest(dib, &fileIDFromPrevious);
+    // Cannot fail, because space was checked above
 
-    SendMessages(dib);
+    return 0;
+}
 
-    result = GetResponse(dib, createMsgNum);
+/*
+ * Get the responses to requests enqueued by EnqueueAFPInfoRequests (after
+ * they have been sent).  This fills in afpInfo with the info.
+ * Returns a GS/OS result code.
+ */
+Word GetAFPInfoResponses(DIB *dib, const AFPInfoRequests *requests) {
+    ReadStatus result;
+    Word retval = 0;
+
+    memset(&afpInfo, 0, sizeof(AFPInfo));
+
+    result = GetResponse(dib, requests->createMsgNum);
     if (result != rsDone) {
         // TODO maybe give no error for "no Finder Info found"
         retval = ConvertError(result);
     }
 
-    result = GetResponse(dib, readMsgNum);
+    result = GetResponse(dib, requests->readMsgNum);
     if (result != rsDone && retval == 0)
         retval = ConvertError(result);
 
@@ -132,7 +153,7 @@ Word GetAFPInfo(DIB *dib, struct GSOSDP *gsosdp) {
     if (!AFPInfoValid(&afpInfo))
         InitAFPInfo();
 
-    result = GetResponse(dib, closeMsgNum);
+    result = GetResponse(dib, requests->closeMsgNum);
     if (result != rsDone && retval == 0) {
         // TODO give appropriate error code
         retval = ConvertError(result);
@@ -141,6 +162,27 @@ Word GetAFPInfo(DIB *dib, struct GSOSDP *gsosdp) {
     return retval;
 }
 
+/*
+ * Get the AFP Info data stream for a file.
+ * This fills in afpInfo with the info.  Returns a GS/OS result code.
+ */
+Word GetAFPInfo(DIB *dib, struct GSOSDP *gsosdp) {
+    static AFPInfoRequests requests;
+    Word retval;
+    
+    memset(&afpInfo, 0, sizeof(AFPInfo));
+
+    retval = EnqueueAFPInfoRequests(dib, gsosdp, &requests);
+    if (retval != 0) {
+        ResetSendStatus();
+        return retval;
+    }
+
+    SendMessages(dib);
+
+    return GetAFPInfoResponses(dib, &requests);
+}
+
 
 /*
  * Does *info hold a valid AFP Info record?
@@ -97,6 +97,18 @@ extern const char16_t resourceForkSuffix[19];
 
 extern AFPInfo afpInfo;
 
+/*
+ * Message numbers for requests enqueued to get AFP Info
+ */
+typedef struct {
+    uint16_t createMsgNum;
+    uint16_t readMsgNum;
+    uint16_t closeMsgNum;
+} AFPInfoRequests;
+
+Word EnqueueAFPInfoRequests(DIB *dib, struct GSOSDP *gsosdp,
+    AFPInfoRequests *requests);
+Word GetAFPInfoResponses(DIB *dib, const AFPInfoRequests *requests);
 Word GetAFPInfo(DIB *dib, struct GSOSDP *gsosdp);
 bool AFPInfoValid(AFPInfo *info);
 void InitAFPInfo(void);
@@ -36,6 +36,22 @@ unsigned EnqueueCloseRequest(DIB *dib, const SMB2_FILEID *fileID) {
     return EnqueueRequest(dib, SMB2_CLOSE, sizeof(*closeReq));
 }
 
+/*
+ * Send a close request out of band, without waiting for the response.
+ * This may be used while processing another response.
+ */
+bool SendOutOfBandCloseRequest(DIB *dib, const SMB2_FILEID *fileID) {
+    static SMB2_CLOSE_Request closeReq;
+
+    closeReq.StructureSize = sizeof(closeReq);
+    closeReq.Flags = 0;
+    closeReq.Reserved = 0;
+    closeReq.FileId = *fileID;
+
+    return SendOutOfBandRequest(dib, SMB2_CLOSE, &closeReq, sizeof(closeReq),
+        NULL);
+}
+
 /*
  * Send a close request as non-compounded message, and get the response.
  */
@@ -22,5 +22,6 @@
 
 unsigned EnqueueCloseRequest(DIB *dib, const SMB2_FILEID *fileID);
 ReadStatus SendCloseRequestAndGetResponse(DIB *dib, const SMB2_FILEID *fileID);
+bool SendOutOfBandCloseRequest(DIB *dib, const SMB2_FILEID *fileID);
 
 #endif
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <gsos.h>
+#include <memory.h>
+#include <misctool.h>
+#include <orca.h>
+#include <string.h>
+#include "smb2/smb2.h"
+#include "gsos/gsosdata.h"
+#include "helpers/dircache.h"
+
+/*
+ * The directory cache for an open directory holds a run of consecutive
+ * directory entries, which may come from several QUERY_DIRECTORY responses.
+ * The entries are stored in dirCacheHandle, linked by NextEntryOffset as in
+ * the responses.  dirIndexHandle holds an array with the offset of each
+ * entry, so any cached entry can be found directly, and entries can be
+ * dropped from the start of the cache to make room for new ones.
+ *
+ * The entry data is purgeable (except while it is being modified).  If it
+ * is purged, the whole cache is freed the next time it is used.
+ */
+
+#define DirIndex(fcr) ((uint16_t *)*(fcr)->dirIndexHandle)
+
+/*
+ * Lock the directory cache so pointers to entries in it remain valid.
+ * Returns false if there is no cache (or it was purged).
+ */
+bool LockDirCache(FCR *fcr) {
+    if (fcr->dirCacheHandle == NULL)
+        return false;
+    
+    HLock(fcr->dirCacheHandle);
+    if (*fcr->dirCacheHandle == NULL) {
+        FreeDirCache(fcr);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Unlock the directory cache, if any.
+ */
+void UnlockDirCache(FCR *fcr) {
+    if (fcr->dirCacheHandle != NULL)
+        HUnlock(fcr->dirCacheHandle);
+}
+
+/*
+ * Get a pointer to the cached directory entry with number entryNum,
+ * or NULL if it is not cached.  The cache must be locked.
+ */
+FILE_DIRECTORY_INFORMATION *GetCachedDirEntry(FCR *fcr, int32_t entryNum) {
+    if (fcr->dirCacheHandle == NULL
+        || entryNum < fcr->firstCachedEntryNum
+        || entryNum - fcr->firstCachedEntryNum >= fcr->dirCachedCount)
+        return NULL;
+    
+    return (void*)(*fcr->dirCacheHandle
+        + DirIndex(fcr)[entryNum - fcr->firstCachedEntryNum]);
+}
+
+/*
+ * Count the entries in directory entry data that has been validated.
+ */
+static uint16_t CountEntries(const unsigned char *data) {
+    const FILE_DIRECTORY_INFORMATION *entryPtr = (const void*)data;
+    uint16_t count = 1;
+    
+    while (entryPtr->NextEntryOffset != 0) {
+        entryPtr = (const void*)((char*)entryPtr + entryPtr->NextEntryOffset);
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Fill in index entries for the entries starting at offset in the cache.
+ */
+static void IndexEntries(FCR *fcr, uint16_t offset) {
+    FILE_DIRECTORY_INFORMATION *entryPtr;
+    uint16_t *index = DirIndex(fcr);
+    
+    while (1) {
+        index[fcr->dirCachedCount++] = offset;
+        entryPtr = (void*)(*fcr->dirCacheHandle + offset);
+        if (entryPtr->NextEntryOffset == 0)
+            break;
+        offset += entryPtr->NextEntryOffset;
+    }
+}
+
+/*
+ * Drop entries from the start of the cache to free at least needed bytes.
+ */
+static void TrimDirCache(FCR *fcr, uint32_t needed) {
+    uint16_t *index = DirIndex(fcr);
+    uint16_t cacheSize = GetHandleSize(fcr->dirCacheHandle);
+    uint16_t first, shift, i;
+    
+    for (first = 0; first < fcr->dirCachedCount; first++) {
+        if (index[first] >= needed)
+            break;
+    }
+    if (first == fcr->dirCachedCount) {
+        FreeDirCache(fcr);
+        return;
+    }
+    
+    shift = index[first];
+    memmove(*fcr->dirCacheHandle, *fcr->dirCacheHandle + shift,
+        cacheSize - shift);
+    SetHandleSize(cacheSize - shift, fcr->dirCacheHandle);
+    
+    for (i = first; i < fcr->dirCachedCount; i++)
+        index[i - first] = index[i] - shift;
+    fcr->dirCachedCount -= first;
+    fcr->firstCachedEntryNum += first;
+}
+
+/*
+ * Add size bytes of directory entry data (already validated), starting
+ * with entry number firstEntryNum, to the directory cache.  If they do not
+ * follow on from the entries already cached, they replace them.  If there
+ * is not enough room for them, entries are dropped from the start of the
+ * cache if trim is true; otherwise, the cache is left unchanged.
+ *
+ * Returns true if the entries were added to the cache.
+ */
+bool AddToDirCache(FCR *fcr, const void *data, uint16_t size,
+    int32_t firstEntryNum, bool trim) {
+    uint16_t count, cacheSize;
+    
+    if (size == 0)
+        return false;
+
+    if (LockDirCache(fcr)) {
+        HUnlock(fcr->dirCacheHandle);
+        if (firstEntryNum
+            != fcr->firstCachedEntryNum + fcr->dirCachedCount)
+            FreeDirCache(fcr);
+    }
+    
+    count = CountEntries(data);
+
+    if (fcr->dirCacheHandle != NULL) {
+        if (GetHandleSize(fcr->dirCacheHandle) + size > DIR_CACHE_MAX_SIZE) {
+            if (!trim)
+                return false;
+            TrimDirCache(fcr,
+                GetHandleSize(fcr->dirCacheHandle) + size - DIR_CACHE_MAX_SIZE);
+        }
+    }
+
+    if (fcr->dirCacheHandle == NULL) {
+        fcr->dirCacheHandle = NewHandle(size, userid(), attrNoSpec, 0);
+        if (toolerror()) {
+            fcr->dirCacheHandle = NULL;
+            return false;
+        }
+        fcr->dirIndexHandle = NewHandle(count * sizeof(uint16_t), userid(),
+            attrNoSpec, 0);
+        if (toolerror()) {
+            fcr->dirIndexHandle = NULL;
+            FreeDirCache(fcr);
+            return false;
+        }
+        fcr->firstCachedEntryNum = firstEntryNum;
+        fcr->dirCachedCount = 0;
+        fcr->dirCacheTime = GetTick();
+        fcr->smbFlags &= ~SMB_FLAG_UNLEASED_LISTING;
+        cacheSize = 0;
+    } else {
+        SetPurge(0, fcr->dirCacheHandle);
+        cacheSize = GetHandleSize(fcr->dirCacheHandle);
+        SetHandleSize(cacheSize + size, fcr->dirCacheHandle);
+        if (toolerror()) {
+            FreeDirCache(fcr);
+            return false;
+        }
+        SetHandleSize((fcr->dirCachedCount + count) * sizeof(uint16_t),
+            fcr->dirIndexHandle);
+        if (toolerror()) {
+            FreeDirCache(fcr);
+            return false;
+        }
+    }
+
+    memcpy(*fcr->dirCacheHandle + cacheSize, data, size);
+    
+    // Link the last entry previously cached to the first new one.
+    if (fcr->dirCachedCount != 0) {
+        ((FILE_DIRECTORY_INFORMATION *)(*fcr->dirCacheHandle
+            + DirIndex(fcr)[fcr->dirCachedCount - 1]))->NextEntryOffset =
+            cacheSize - DirIndex(fcr)[fcr->dirCachedCount - 1];
+    }
+    IndexEntries(fcr, cacheSize);
+
+    SetPurge(2, fcr->dirCacheHandle);
+    return true;
+}
+
+/*
+ * Set up the directory cache with the (validated) entry data in dataHandle,
+ * starting with entry number firstEntryNum.  This takes ownership of
+ * dataHandle, which must be unlocked and not purgeable.  Any existing cache
+ * is replaced.  Returns false if the cache could not be set up.
+ */
+bool SetDirCache(FCR *fcr, Handle dataHandle, int32_t firstEntryNum) {
+    FreeDirCache(fcr);
+    
+    fcr->dirCacheHandle = dataHandle;
+    fcr->dirIndexHandle = NewHandle(
+        CountEntries((void*)*dataHandle) * sizeof(uint16_t), userid(),
+        attrNoSpec, 0);
+    if (toolerror()) {
+        fcr->dirIndexHandle = NULL;
+        FreeDirCache(fcr);
+        return false;
+    }
+    
+    fcr->firstCachedEntryNum = firstEntryNum;
+    fcr->dirCachedCount = 0;
+    IndexEntries(fcr, 0);
+
+    SetPurge(2, fcr->dirCacheHandle);
+    return true;
+}
+
+/*
+ * Free the directory cache, if any.
+ */
+void FreeDirCache(FCR *fcr) {
+    if (fcr->dirCacheHandle != NULL) {
+        DisposeHandle(fcr->dirCacheHandle);
+        fcr->dirCacheHandle = NULL;
+    }
+    if (fcr->dirIndexHandle != NULL) {
+        DisposeHandle(fcr->dirIndexHandle);
+        fcr->dirIndexHandle = NULL;
+    }
+    fcr->dirCachedCount = 0;
+}
+
+/*
+ * Give up on the QUERY_DIRECTORY request for the next page of entries that
+ * was sent in advance (see GetDirEntry), if there is one.  The server's scan
+ * position is then unknown, so the next query will restart the scan.
+ */
+void CancelDirPrefetch(FCR *fcr, DIB *dib) {
+    if (!(fcr->smbFlags & SMB_FLAG_DIR_PREFETCH))
+        return;
+
+    AbandonPipelinedRequest(dib, fcr->dirPrefetchMessageId);
+    fcr->smbFlags &= ~SMB_FLAG_DIR_PREFETCH;
+    fcr->nextServerEntryNum = INT32_MAX;
+}
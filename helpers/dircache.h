@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <types.h>
+#include "smb2/fileinfo.h"
+#include "gsos/gsosdata.h"
+
+/*
+ * Max size of the directory entry data in the cache.  Offsets within it
+ * must fit in 16 bits.
+ */
+#define DIR_CACHE_MAX_SIZE 0xFFF0u
+
+bool LockDirCache(FCR *fcr);
+void UnlockDirCache(FCR *fcr);
+FILE_DIRECTORY_INFORMATION *GetCachedDirEntry(FCR *fcr, int32_t entryNum);
+bool AddToDirCache(FCR *fcr, const void *data, uint16_t size,
+    int32_t firstEntryNum, bool trim);
+bool SetDirCache(FCR *fcr, Handle dataHandle, int32_t firstEntryNum);
+void FreeDirCache(FCR *fcr);
+void CancelDirPrefetch(FCR *fcr, DIB *dib);
+
+#endif
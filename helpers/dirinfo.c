@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <gsos.h>
+#include <memory.h>
+#include <orca.h>
+#include <string.h>
+#include "smb2/smb2.h"
+#include "smb2/fileinfo.h"
+#include "gsos/gsosdata.h"
+#include "driver/driver.h"
+#include "helpers/path.h"
+#include "helpers/afpinfo.h"
+#include "helpers/closerequest.h"
+#include "helpers/dirinfo.h"
+#include "helpers/dircache.h"
+
+/*
+ * When not using Apple extensions, getting the AFP Info and resource fork
+ * size for each directory entry takes several requests.  To avoid a round
+ * trip per entry, GetDirEntry uses this code to fetch that information for
+ * a batch of entries from the directory cache in one compound request, and
+ * keeps it in a handle attached to the FCR.
+ *
+ * For each entry, the requests are a CREATE of the main stream, a
+ * QUERY_INFO for FileStreamInformation, and a CLOSE, followed by a CREATE,
+ * READ, and CLOSE of the AFP Info stream.  Each CREATE starts a new group of
+ * related requests, so a failure for one entry does not affect the others.
+ * The number of entries in a batch is limited by the space in msg and the
+ * credits available.
+ */
+
+// Number of requests sent per directory entry
+#define MSGS_PER_ENTRY 6
+
+// Max number of directory entries to prefetch information for at once
+#define DIR_INFO_BATCH (MAX_COMPOUND_SIZE / MSGS_PER_ENTRY)
+
+typedef struct {
+    AFPInfo afpInfo;
+    bool haveResourceFork;
+    uint64_t resourceEOF;
+    uint64_t resourceAlloc;
+} DirInfo;
+
+typedef struct {
+    uint16_t createMsgNum, queryInfoMsgNum, closeMsgNum;
+    AFPInfoRequests afpInfoRequests;
+} DirInfoRequests;
+
+/*
+ * Get the length of the name for a directory entry (in SMB format), given
+ * the length of the directory path.
+ */
+#define EntryNameLength(dirPathLength, entry) \
+    ((dirPathLength) + ((dirPathLength) != 0 ? sizeof(char16_t) : 0) \
+    + (entry)->FileNameLength)
+
+/*
+ * Enqueue a CREATE request for a directory entry (or its AFP Info stream,
+ * if afpInfoStream is true).  dirPath points to the directory path in SMB
+ * format, which may be in the name buffer of the message being enqueued.
+ * The caller must have checked that there is space for the message.
+ *
+ * The CREATE is not marked as related to the preceding requests, so it
+ * starts a new group of related requests.
+ */
+static uint16_t EnqueueEntryCreate(DIB *dib, const unsigned char *dirPath,
+    uint16_t dirPathLength, const FILE_DIRECTORY_INFORMATION *entry,
+    bool afpInfoStream) {
+    SMB2Message *message = nextMsg;
+    SMB2_CREATE_Request *createReq;
+    unsigned char *namePtr;
+    uint16_t nameLength;
+    uint16_t msgNum;
+
+    createReq = (SMB2_CREATE_Request*)nextMsg->Body;
+
+    nameLength = EntryNameLength(dirPathLength, entry);
+    if (afpInfoStream)
+        nameLength += sizeof(afpInfoSuffix);
+
+    namePtr = createReq->Buffer;
+    if (namePtr != dirPath)
+        memmove(namePtr, dirPath, dirPathLength);
+    namePtr += dirPathLength;
+    if (dirPathLength != 0) {
+        *(char16_t*)namePtr = '\\';
+        namePtr += sizeof(char16_t);
+    }
+    memcpy(namePtr, entry->FileName, entry->FileNameLength);
+    namePtr += entry->FileNameLength;
+    if (afpInfoStream)
+        memcpy(namePtr, afpInfoSuffix, sizeof(afpInfoSuffix));
+
+    createReq->SecurityFlags = 0;
+    createReq->RequestedOplockLevel = SMB2_OPLOCK_LEVEL_NONE;
+    createReq->ImpersonationLevel = Impersonation;
+    createReq->SmbCreateFlags = 0;
+    createReq->Reserved = 0;
+    if (afpInfoStream) {
+        createReq->DesiredAccess = FILE_READ_DATA | FILE_READ_ATTRIBUTES;
+    } else {
+        createReq->DesiredAccess = FILE_READ_ATTRIBUTES;
+    }
+    createReq->FileAttributes = 0;
+    createReq->ShareAccess = FILE_SHARE_READ;
+    createReq->CreateDisposition = FILE_OPEN;
+    createReq->CreateOptions = 0;
+    createReq->NameOffset = (char*)createReq->Buffer - (char*)nextMsg;
+    createReq->NameLength = nameLength;
+    createReq->CreateContextsOffset = 0;
+    createReq->CreateContextsLength = 0;
+
+    msgNum = EnqueueRequest(dib, SMB2_CREATE, sizeof(*createReq) + nameLength);
+    message->Header.Flags &= ~SMB2_FLAGS_RELATED_OPERATIONS;
+    return msgNum;
+}
+
+/*
+ * Enqueue the requests to get information about one directory entry.
+ * Returns false if there is not enough space or credits for them.
+ */
+static bool EnqueueEntryRequests(DIB *dib, const unsigned char *dirPath,
+    uint16_t dirPathLength, const FILE_DIRECTORY_INFORMATION *entry,
+    DirInfoRequests *requests) {
+    SMB2_QUERY_INFO_Request *queryInfoReq;
+    SMB2_READ_Request *readReq;
+
+    if (!CanAddToCompound(dib, MSGS_PER_ENTRY,
+        2 * (sizeof(SMB2_CREATE_Request) + EntryNameLength(dirPathLength, entry)
+            + sizeof(SMB2_CLOSE_Request))
+        + sizeof(afpInfoSuffix) + sizeof(SMB2_QUERY_INFO_Request)
+        + sizeof(SMB2_READ_Request)))
+        return false;
+
+    /*
+     * Main stream: get stream information
+     */
+    requests->createMsgNum =
+        EnqueueEntryCreate(dib, dirPath, dirPathLength, entry, false);
+
+    queryInfoReq = (SMB2_QUERY_INFO_Request*)nextMsg->Body;
+    // no need to check for space (checked above)
+    queryInfoReq->InfoType = SMB2_0_INFO_FILE;
+    queryInfoReq->FileInfoClass = FileStreamInformation;
+    queryInfoReq->OutputBufferLength =
+        sizeof(msg.body) - offsetof(SMB2_QUERY_INFO_Response, Buffer);
+    queryInfoReq->InputBufferOffset = 0;
+    queryInfoReq->Reserved = 0;
+    queryInfoReq->InputBufferLength = 0;
+    queryInfoReq->AdditionalInformation = 0;
+    queryInfoReq->Flags = 0;
+    queryInfoReq->FileId = fileIDFromPrevious;
+    requests->queryInfoMsgNum = EnqueueRequest(dib, SMB2_QUERY_INFO,
+        sizeof(*queryInfoReq));
+
+    requests->closeMsgNum = EnqueueCloseRequest(dib, &fileIDFromPrevious);
+
+    /*
+     * AFP Info stream: read it
+     */
+    requests->afpInfoRequests.createMsgNum =
+        EnqueueEntryCreate(dib, dirPath, dirPathLength, entry, true);
+
+    readReq = (SMB2_READ_Request*)nextMsg->Body;
+    // no need to check for space (checked above)
+    readReq->Padding =
+        sizeof(SMB2Header) + offsetof(SMB2_READ_Response, Buffer);
+    readReq->Flags = 0;
+    readReq->Length = sizeof(AFPInfo);
+    readReq->Offset = 0;
+    readReq->FileId = fileIDFromPrevious;
+    readReq->MinimumCount = sizeof(AFPInfo);
+    readReq->Channel = 0;
+    readReq->RemainingBytes = 0;
+    readReq->ReadChannelInfoOffset = 0;
+    readReq->ReadChannelInfoLength = 0;
+    requests->afpInfoRequests.readMsgNum =
+        EnqueueRequest(dib, SMB2_READ, sizeof(*readReq));
+
+    requests->afpInfoRequests.closeMsgNum =
+        EnqueueCloseRequest(dib, &fileIDFromPrevious);
+
+    return true;
+}
+
+/*
+ * Get the responses to the requests for one directory entry.
+ * Returns false if there was a network error (as opposed to an error
+ * response for the entry, which is just treated as "no information").
+ */
+static bool GetEntryResponses(DIB *dib, const DirInfoRequests *requests,
+    DirInfo *info) {
+    ReadStatus result, closeResult;
+    FILE_STREAM_INFORMATION *streamInfo;
+    uint16_t streamInfoLen;
+    bool ok = true;
+
+    info->haveResourceFork = false;
+    info->resourceEOF = info->resourceAlloc = 0;
+
+    result = GetResponse(dib, requests->createMsgNum);
+    if (result != rsDone && result != rsFailed)
+        ok = false;
+
+    result = GetResponse(dib, requests->queryInfoMsgNum);
+    if (result == rsDone) {
+        if (queryInfoResponse.OutputBufferLength >
+            sizeof(msg.body) - offsetof(SMB2_QUERY_INFO_Response, Buffer)
+            || !VerifyBuffer(queryInfoResponse.OutputBufferOffset,
+                queryInfoResponse.OutputBufferLength)) {
+            ok = false;
+            goto main_close;
+        }
+
+        streamInfoLen = queryInfoResponse.OutputBufferLength;
+        streamInfo = (FILE_STREAM_INFORMATION *)(
+            (unsigned char *)&msg.smb2Header +
+            queryInfoResponse.OutputBufferOffset);
+
+        while (streamInfoLen >= sizeof(FILE_STREAM_INFORMATION)) {
+            if (streamInfo->NextEntryOffset > streamInfoLen
+                || streamInfo->StreamNameLength > streamInfoLen
+                    - offsetof(FILE_STREAM_INFORMATION, StreamName)) {
+                ok = false;
+                break;
+            }
+    
+            if (streamInfo->StreamNameLength == sizeof(resourceForkSuffix)
+                && memcmp(streamInfo->StreamName, resourceForkSuffix,
+                    sizeof(resourceForkSuffix)) == 0)
+            {
+                info->haveResourceFork = true;
+                info->resourceEOF = streamInfo->StreamSize;
+                info->resourceAlloc = streamInfo->StreamAllocationSize;
+                break;
+            }
+    
+            if (streamInfo->NextEntryOffset == 0)
+                break;
+            streamInfoLen -= streamInfo->NextEntryOffset;
+            streamInfo =
+                (void*)((char*)streamInfo + streamInfo->NextEntryOffset);
+        }
+    } else if (result != rsFailed) {
+        ok = false;
+    }
+
+main_close:
+    closeResult = GetResponse(dib, requests->closeMsgNum);
+    if (closeResult != rsDone && closeResult != rsFailed)
+        ok = false;
+
+    /*
+     * Errors accessing the AFP Info are ignored; we just act like it is
+     * not present (GetAFPInfoResponses leaves afpInfo in a valid state).
+     */
+    GetAFPInfoResponses(dib, &requests->afpInfoRequests);
+    info->afpInfo = afpInfo;
+
+    return ok;
+}
+
+/*
+ * Get prefetched information for entryNum, if available.  If so, this fills
+ * in afpInfo and the other information, and returns true.
+ */
+bool GetPrefetchedDirInfo(FCR *fcr, uint16_t entryNum,
+    bool *haveResourceFork, uint64_t *resourceEOF, uint64_t *resourceAlloc) {
+    DirInfo *info;
+
+    if (fcr->dirInfoCount == 0
+        || entryNum < fcr->firstDirInfoEntryNum
+        || entryNum - fcr->firstDirInfoEntryNum >= fcr->dirInfoCount)
+        return false;
+    
+    info = &((DirInfo*)*fcr->dirInfoHandle)
+        [entryNum - fcr->firstDirInfoEntryNum];
+    afpInfo = info->afpInfo;
+    *haveResourceFork = info->haveResourceFork;
+    *resourceEOF = info->resourceEOF;
+    *resourceAlloc = info->resourceAlloc;
+    return true;
+}
+
+/*
+ * Fetch AFP Info and resource fork information for a batch of cached
+ * directory entries, starting with entryNum.  This leaves the directory
+ * cache locked.  On failure, no information is cached, and GetDirEntry
+ * gets it for each entry individually.
+ */
+void PrefetchDirInfo(FCR *fcr, DIB *dib, uint16_t entryNum) {
+    static DirInfoRequests requests[DIR_INFO_BATCH];
+    FILE_DIRECTORY_INFORMATION *entryPtr;
+    VirtualPointer vp;
+    GSString *pathName;
+    SMB2_CREATE_Request *createReq;
+    unsigned char *dirPath;
+    uint16_t dirPathLength;
+    unsigned count, n;
+    bool ok;
+
+    fcr->dirInfoCount = 0;
+
+    if (!LockDirCache(fcr))
+        return;
+    entryPtr = GetCachedDirEntry(fcr, entryNum);
+    if (entryPtr == NULL)
+        return;
+
+    if (fcr->dirInfoHandle == NULL) {
+        fcr->dirInfoHandle = NewHandle(sizeof(DirInfo) * DIR_INFO_BATCH,
+            userid(), attrLocked | attrFixed | attrNoCross | attrNoSpec, 0);
+        if (toolerror()) {
+            fcr->dirInfoHandle = NULL;
+            return;
+        }
+    }
+
+    RequestCredits(dib, DIR_INFO_BATCH * MSGS_PER_ENTRY);
+
+    /*
+     * Translate the directory path to SMB format once, in the name buffer of
+     * the first CREATE.  Subsequent CREATEs copy it from there.
+     */
+    vp = fcr->pathName;
+    DerefVP(pathName, vp);
+    createReq = (SMB2_CREATE_Request*)nextMsg->Body;
+    dirPath = createReq->Buffer;
+    dirPathLength = GSPathToSMB(pathName, dirPath,
+        msg.body + sizeof(msg.body) - dirPath);
+    if (dirPathLength == 0xFFFF)
+        return;
+
+    // The entries in the cache were validated when it was filled.
+    for (count = 0; count < DIR_INFO_BATCH; ) {
+        if (!EnqueueEntryRequests(dib, dirPath, dirPathLength, entryPtr,
+            &requests[count]))
+            break;
+        count++;
+        
+        if (entryPtr->NextEntryOffset == 0)
+            break;
+        entryPtr = (void*)((char*)entryPtr + entryPtr->NextEntryOffset);
+    }
+
+    if (count == 0) {
+        ResetSendStatus();
+        return;
+    }
+
+    SendMessages(dib);
+
+    /*
+     * Get the responses for all the entries, even after an error, so that
+     * the rest of them are not left to be held as outstanding responses.
+     */
+    ok = true;
+    for (n = 0; n < count; n++) {
+        if (!GetEntryResponses(dib, &requests[n],
+            &((DirInfo*)*fcr->dirInfoHandle)[n]))
+            ok = false;
+    }
+    if (!ok)
+        return;
+
+    fcr->firstDirInfoEntryNum = entryNum;
+    fcr->dirInfoCount = count;
+}
+
+/*
+ * Discard any prefetched directory entry information.  This should be done
+ * whenever the directory cache is refilled, since entry numbers may then
+ * refer to different entries.
+ */
+void InvalidateDirInfo(FCR *fcr) {
+    fcr->dirInfoCount = 0;
+}
+
+/*
+ * Free the prefetched directory entry information (when closing the file).
+ */
+void FreeDirInfo(FCR *fcr) {
+    if (fcr->dirInfoHandle != NULL) {
+        DisposeHandle(fcr->dirInfoHandle);
+        fcr->dirInfoHandle = NULL;
+    }
+    fcr->dirInfoCount = 0;
+}
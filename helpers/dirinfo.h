@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DIRINFO_H
+#define DIRINFO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <types.h>
+#include "gsos/gsosdata.h"
+#include "driver/driver.h"
+
+void PrefetchDirInfo(FCR *fcr, DIB *dib, uint16_t entryNum);
+bool GetPrefetchedDirInfo(FCR *fcr, uint16_t entryNum,
+    bool *haveResourceFork, uint64_t *resourceEOF, uint64_t *resourceAlloc);
+void InvalidateDirInfo(FCR *fcr);
+void FreeDirInfo(FCR *fcr);
+
+#endif
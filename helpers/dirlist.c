@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <gsos.h>
+#include <memory.h>
+#include <misctool.h>
+#include <orca.h>
+#include <string.h>
+#include "smb2/smb2.h"
+#include "smb2/keepalive.h"
+#include "smb2/changenotify.h"
+#include "gsos/gsosdata.h"
+#include "gsos/gsosutils.h"
+#include "driver/driver.h"
+#include "fst/fstspecific.h"
+#include "helpers/path.h"
+#include "helpers/closerequest.h"
+#include "helpers/dirlist.h"
+#include "helpers/dircache.h"
+
+/*
+ * The Finder opens the same directories over and over.  To avoid listing
+ * them from the server each time, the first page of directory entries that
+ * was cached for an open directory (along with the entry count, if known)
+ * is kept here when it is closed, and copied into the FCR when the same
+ * directory is opened again.
+ *
+ * If the server supports directory leasing and granted a lease with read
+ * and handle caching on the directory (see smb2/oplock.c), its handle is
+ * kept open when the directory is closed, and the listing remains valid
+ * until the lease is broken.  This is only done while breaks are handled in
+ * the background (see smb2/keepalive.c), since other clients' changes to
+ * the directory wait until we close the handle in response to a break.
+ * Even then, the handle is only held for DIR_LIST_HELD_TTL.  Otherwise, the
+ * listing is only used for a short time (DIR_LIST_TTL) after it was fetched
+ * from the server, or somewhat longer if the volume is watched for changes
+ * (see ChangesWatched in smb2/changenotify.c).  Our own calls that may
+ * change files on a volume, and change notifications for it, invalidate all
+ * its cached listings.
+ */
+
+// TTL for listings without a directory lease on dib
+#define DirListTTL(dib) \
+    (ChangesWatched(dib) ? DIR_LIST_WATCHED_TTL : DIR_LIST_TTL)
+
+typedef struct {
+    DIB *dib;               // NULL if entry is unused
+    uint32_t treeConnectID;
+    LongWord time;          // tick count when listing was fetched
+    Handle listHandle;      // directory entries (purgeable)
+    int32_t entryCount;     // number of entries, or -1 if not known
+    bool leased;            // listing is covered by a lease on fileID
+    SMB2_FILEID fileID;
+    smb_u128 leaseKey;
+    uint16_t pathLength;
+    unsigned char path[DIR_LIST_MAX_PATH];
+} DirListing;
+
+static DirListing dirListings[DIR_LIST_CACHE_SIZE];
+
+// Index of the entry to replace next
+static unsigned nextDirListing;
+
+static unsigned char pathBuf[DIR_LIST_MAX_PATH];
+
+/*
+ * Get the SMB path for the directory open in fcr into pathBuf.
+ * Returns its length, or 0xFFFF if it does not fit.
+ */
+static uint16_t GetDirPath(FCR *fcr) {
+    VirtualPointer vp;
+    GSString *pathName;
+
+    vp = fcr->pathName;
+    DerefVP(pathName, vp);
+    return GSPathToSMB(pathName, pathBuf, sizeof(pathBuf));
+}
+
+/*
+ * Find the cached listing for the directory at path (in SMB format).
+ */
+static DirListing *FindDirListing(DIB *dib, const void *path,
+    uint16_t pathLength) {
+    unsigned i;
+
+    for (i = 0; i < DIR_LIST_CACHE_SIZE; i++) {
+        if (dirListings[i].dib == dib
+            && dirListings[i].treeConnectID == dib->treeConnectID
+            && dirListings[i].pathLength == pathLength
+            && memcmp(dirListings[i].path, path, pathLength) == 0)
+            return &dirListings[i];
+    }
+    
+    return NULL;
+}
+
+/*
+ * Check if there is a cached listing (valid or not) for the directory at
+ * path (in SMB format).  This is used to tell that a path being opened is
+ * a directory.
+ */
+bool HaveDirListing(DIB *dib, const void *path, uint16_t pathLength) {
+    return FindDirListing(dib, path, pathLength) != NULL;
+}
+
+/*
+ * Free a cached listing.  If closeHandle is true, the handle held open for
+ * its lease (if any) is closed.
+ */
+static void FreeDirListing(DirListing *listing, bool closeHandle) {
+    if (listing->dib == NULL)
+        return;
+    
+    if (listing->leased && closeHandle)
+        SendOutOfBandCloseRequest(listing->dib, &listing->fileID);
+    if (listing->listHandle != NULL)
+        DisposeHandle(listing->listHandle);
+    listing->listHandle = NULL;
+    listing->dib = NULL;
+}
+
+/*
+ * Check if a cached listing is valid (un-purged, and still covered by a
+ * lease or within its TTL).
+ */
+static bool DirListingValid(DirListing *listing) {
+    if (*listing->listHandle == NULL)
+        return false;
+    if (listing->leased)
+        return GetTick() - listing->time <= DIR_LIST_HELD_TTL;
+    return GetTick() - listing->time <= DirListTTL(listing->dib);
+}
+
+/*
+ * Close the handles held for listings that have been held for longer than
+ * DIR_LIST_HELD_TTL, or whose breaks are no longer handled in the
+ * background.  This is called periodically by the keepalive task, as well
+ * as when directories are opened and closed.
+ */
+void ExpireDirListings(void) {
+    unsigned i;
+
+    for (i = 0; i < DIR_LIST_CACHE_SIZE; i++) {
+        if (dirListings[i].dib != NULL
+            && dirListings[i].leased
+            && (GetTick() - dirListings[i].time > DIR_LIST_HELD_TTL
+                || !BreaksHandledInBackground(
+                    dirListings[i].dib->session->connection)))
+            FreeDirListing(&dirListings[i], true);
+    }
+}
+
+/*
+ * Set up the directory cache of a newly-opened directory from a cached
+ * listing for it, if there is a valid one.
+ */
+void LoadDirListing(FCR *fcr, DIB *dib) {
+    DirListing *listing;
+    Handle dataHandle;
+    uint16_t pathLength;
+    Long size;
+
+    fcr->dirEntryCount = -1;
+
+    ExpireDirListings();
+
+    pathLength = GetDirPath(fcr);
+    if (pathLength == 0xFFFF)
+        return;
+
+    listing = FindDirListing(dib, pathBuf, pathLength);
+    if (listing == NULL)
+        return;
+    if (!DirListingValid(listing)) {
+        FreeDirListing(listing, true);
+        return;
+    }
+
+    size = GetHandleSize(listing->listHandle);
+    dataHandle = NewHandle(size, userid(), attrNoSpec, 0);
+    if (toolerror())
+        return;
+    
+    /*
+     * Allocating the new handle may have purged the cached listing.
+     */
+    if (*listing->listHandle == NULL) {
+        DisposeHandle(dataHandle);
+        FreeDirListing(listing, true);
+        return;
+    }
+    
+    memcpy(*dataHandle, *listing->listHandle, size);
+    if (!SetDirCache(fcr, dataHandle, -1))
+        return;
+    fcr->dirCacheTime = listing->time;
+    fcr->dirEntryCount = listing->entryCount;
+    if (!listing->leased)
+        fcr->smbFlags |= SMB_FLAG_UNLEASED_LISTING;
+}
+
+/*
+ * Save the directory listing of a directory that is being closed.  This
+ * takes over the entry data from its directory cache, if it starts at the
+ * beginning of the directory.  If this returns true, the listing has also
+ * taken over the directory's handle (to hold its lease), and the caller
+ * should not close it.
+ */
+bool SaveDirListing(FCR *fcr, DIB *dib) {
+    DirListing *listing;
+    uint16_t pathLength;
+    bool leased;
+
+    ExpireDirListings();
+
+    if (fcr->dirCacheHandle == NULL || *fcr->dirCacheHandle == NULL
+        || fcr->firstCachedEntryNum != -1)
+        return false;
+
+    /*
+     * The listing is covered by our lease on the directory only if it was
+     * not loaded from a listing that was just subject to a TTL.  We only
+     * hold the handle for the lease if breaks are handled in the background.
+     */
+    leased = dib->session->connection->dirLeasing
+        && (fcr->cacheFlags & (CACHE_LEASE | CACHE_READ | CACHE_HANDLE))
+            == (CACHE_LEASE | CACHE_READ | CACHE_HANDLE)
+        && !(fcr->smbFlags & SMB_FLAG_UNLEASED_LISTING)
+        && BreaksHandledInBackground(dib->session->connection)
+        && GetTick() - fcr->dirCacheTime <= DIR_LIST_HELD_TTL;
+    if (!leased && GetTick() - fcr->dirCacheTime > DirListTTL(dib))
+        return false;
+
+    pathLength = GetDirPath(fcr);
+    if (pathLength == 0xFFFF)
+        return false;
+
+    /*
+     * Keep an existing listing for the directory if it is still covered
+     * by a lease.  Otherwise, replace it.
+     */
+    listing = FindDirListing(dib, pathBuf, pathLength);
+    if (listing != NULL) {
+        if (listing->leased && DirListingValid(listing))
+            return false;
+    } else {
+        listing = &dirListings[nextDirListing];
+        nextDirListing = (nextDirListing + 1) % DIR_LIST_CACHE_SIZE;
+    }
+    FreeDirListing(listing, true);
+
+    listing->dib = dib;
+    listing->treeConnectID = dib->treeConnectID;
+    listing->time = fcr->dirCacheTime;
+    listing->listHandle = fcr->dirCacheHandle;
+    listing->entryCount = fcr->dirEntryCount;
+    listing->leased = leased;
+    listing->fileID = fcr->fileID;
+    listing->leaseKey = fcr->leaseKey;
+    listing->pathLength = pathLength;
+    memcpy(listing->path, pathBuf, pathLength);
+
+    fcr->dirCacheHandle = NULL;
+    return leased;
+}
+
+/*
+ * Handle a lease break notification (in msg) for a directory whose handle
+ * is held open by a cached listing.  The listing is discarded and the
+ * handle is closed, which releases the lease (so no acknowledgment is
+ * needed).  Returns false if the break is not for a cached listing.
+ */
+bool HandleDirListingBreak(Connection *connection) {
+    SMB2_LEASE_BREAK_Notification *leaseBreak =
+        (SMB2_LEASE_BREAK_Notification*)msg.body;
+    unsigned i;
+
+    for (i = 0; i < DIR_LIST_CACHE_SIZE; i++) {
+        if (dirListings[i].dib != NULL
+            && dirListings[i].leased
+            && dirListings[i].dib->session->connection == connection
+            && memcmp(&dirListings[i].leaseKey, &leaseBreak->LeaseKey,
+                sizeof(smb_u128)) == 0) {
+            FreeDirListing(&dirListings[i], true);
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/*
+ * Invalidate all cached listings for directories on dib, as well as the
+ * entry counts cached in the FCRs of open directories on it.  This should
+ * be called by any operation that may change files on the volume.
+ */
+void InvalidateDirListings(DIB *dib) {
+    VCR *vcr;
+    FCR *fcr;
+    unsigned i;
+
+    for (i = 0; i < DIR_LIST_CACHE_SIZE; i++) {
+        if (dirListings[i].dib == dib)
+            FreeDirListing(&dirListings[i], true);
+    }
+
+    if (GetVCR(dib, &vcr) != 0 || vcr->openCount == 0)
+        return;
+
+    for (i = 1; (fcr = GetFCR(i)) != NULL; i++) {
+        if (fcr->volID == vcr->id && fcr->fstID == smbFSID)
+            fcr->dirEntryCount = -1;
+    }
+}
+
+/*
+ * Discard all cached listings for directories on dib, without closing
+ * their handles.  This is used when the handles are no longer valid
+ * (after a reconnect) or are about to be closed (by a tree disconnect).
+ */
+void DiscardDirListings(DIB *dib) {
+    unsigned i;
+
+    for (i = 0; i < DIR_LIST_CACHE_SIZE; i++) {
+        if (dirListings[i].dib == dib)
+            FreeDirListing(&dirListings[i], false);
+    }
+}
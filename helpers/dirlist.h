@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DIRLIST_H
+#define DIRLIST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "smb2/connection.h"
+#include "gsos/gsosdata.h"
+#include "driver/driver.h"
+
+// Number of directory listings that are cached
+#define DIR_LIST_CACHE_SIZE 4
+
+// Max length of an SMB path (in bytes) for a cached directory listing
+#define DIR_LIST_MAX_PATH 128
+
+// Time (in ticks) that a listing without a directory lease remains valid
+#define DIR_LIST_TTL 300
+
+// Time (in ticks) that such a listing remains valid if the volume is watched
+#define DIR_LIST_WATCHED_TTL (5*60*60)
+
+// Max time (in ticks) that a directory's handle is held open for its lease
+#define DIR_LIST_HELD_TTL (60*60)
+
+void LoadDirListing(FCR *fcr, DIB *dib);
+bool SaveDirListing(FCR *fcr, DIB *dib);
+bool HaveDirListing(DIB *dib, const void *path, uint16_t pathLength);
+bool HandleDirListingBreak(Connection *connection);
+void ExpireDirListings(void);
+void InvalidateDirListings(DIB *dib);
+void DiscardDirListings(DIB *dib);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <misctool.h>
+#include <string.h>
+#include "driver/driver.h"
+#include "smb2/changenotify.h"
+#include "helpers/infocache.h"
+#include "helpers/dirlist.h"
+#include "helpers/negcache.h"
+
+/*
+ * The Finder and Standard File tend to call GetFileInfo repeatedly on the
+ * same paths.  To avoid a round trip to the server for each of these calls,
+ * recent results are kept in this cache, keyed by volume and SMB path.
+ *
+ * Entries are only used for a short time (INFO_CACHE_TTL), since the files
+ * may be changed by other clients.  Our own calls that may change a file
+ * invalidate all the entries for its volume.  If the volume is watched for
+ * changes (see smb2/changenotify.c), changes by other clients also
+ * invalidate the entries, so they are kept for longer.
+ */
+
+typedef struct {
+    DIB *dib;               // NULL if entry is unused
+    uint32_t treeConnectID;
+    LongWord time;          // tick count when cached
+    uint16_t pathLength;
+    unsigned char path[INFO_CACHE_MAX_PATH];
+    CachedFileInfo info;
+} InfoCacheEntry;
+
+static InfoCacheEntry infoCache[INFO_CACHE_SIZE];
+
+// Index of the entry to replace next
+static unsigned nextInfoCacheEntry;
+
+/*
+ * Look up information for path (in SMB format) on dib.
+ * Returns true and fills in info if valid cached information is found.
+ */
+bool LookupCachedInfo(DIB *dib, const void *path, uint16_t pathLength,
+    CachedFileInfo *info) {
+    unsigned i;
+
+    for (i = 0; i < INFO_CACHE_SIZE; i++) {
+        if (infoCache[i].dib == dib
+            && infoCache[i].treeConnectID == dib->treeConnectID
+            && infoCache[i].pathLength == pathLength
+            && memcmp(infoCache[i].path, path, pathLength) == 0) {
+            if (GetTick() - infoCache[i].time > (ChangesWatched(dib)
+                ? INFO_CACHE_WATCHED_TTL : INFO_CACHE_TTL)) {
+                infoCache[i].dib = NULL;
+                return false;
+            }
+            *info = infoCache[i].info;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/*
+ * Cache information for path (in SMB format) on dib.
+ */
+void CacheInfo(DIB *dib, const void *path, uint16_t pathLength,
+    const CachedFileInfo *info) {
+    unsigned i;
+
+    if (pathLength > INFO_CACHE_MAX_PATH)
+        return;
+
+    // Replace an existing entry for the same path, if any.
+    for (i = 0; i < INFO_CACHE_SIZE; i++) {
+        if (infoCache[i].dib == dib
+            && infoCache[i].pathLength == pathLength
+            && memcmp(infoCache[i].path, path, pathLength) == 0)
+            break;
+    }
+    if (i == INFO_CACHE_SIZE) {
+        i = nextInfoCacheEntry;
+        nextInfoCacheEntry = (nextInfoCacheEntry + 1) % INFO_CACHE_SIZE;
+    }
+
+    infoCache[i].dib = dib;
+    infoCache[i].treeConnectID = dib->treeConnectID;
+    infoCache[i].time = GetTick();
+    infoCache[i].pathLength = pathLength;
+    memcpy(infoCache[i].path, path, pathLength);
+    infoCache[i].info = *info;
+}
+
+/*
+ * Invalidate all cached information for files on dib, including cached
+ * directory listings and "not found" results.  This should be called by
+ * any operation that may change files on the volume.
+ */
+void InvalidateInfoCache(DIB *dib) {
+    unsigned i;
+
+    InvalidateDirListings(dib);
+    InvalidateNegativeCache(dib);
+
+    for (i = 0; i < INFO_CACHE_SIZE; i++) {
+        if (infoCache[i].dib == dib)
+            infoCache[i].dib = NULL;
+    }
+}
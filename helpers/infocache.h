@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef INFOCACHE_H
+#define INFOCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/driver.h"
+#include "helpers/afpinfo.h"
+
+// Number of GetFileInfo results that are cached
+#define INFO_CACHE_SIZE 8
+
+// Max length of an SMB path (in bytes) that can be cached
+#define INFO_CACHE_MAX_PATH 128
+
+// Time (in ticks) that cached information is considered valid
+#define INFO_CACHE_TTL 120
+
+// Time (in ticks) that cached information is valid if the volume is watched
+#define INFO_CACHE_WATCHED_TTL (60*60)
+
+typedef struct {
+    uint64_t creationTime;
+    uint64_t lastWriteTime;
+    uint32_t fileAttributes;
+    uint64_t dataEOF, dataAlloc;
+    bool haveResourceFork;
+    uint64_t resourceEOF, resourceAlloc;
+    AFPInfo afpInfo;
+} CachedFileInfo;
+
+bool LookupCachedInfo(DIB *dib, const void *path, uint16_t pathLength,
+    CachedFileInfo *info);
+void CacheInfo(DIB *dib, const void *path, uint16_t pathLength,
+    const CachedFileInfo *info);
+void InvalidateInfoCache(DIB *dib);
+
+#endif
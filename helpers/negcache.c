@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <misctool.h>
+#include <string.h>
+#include "driver/driver.h"
+#include "smb2/changenotify.h"
+#include "helpers/negcache.h"
+
+/*
+ * Programs often check for files that do not exist (preferences files,
+ * AFP Info streams on files that have none, etc.), and may do so
+ * repeatedly.  Each check needs a CREATE request that fails with
+ * STATUS_OBJECT_NAME_NOT_FOUND.  To avoid repeating these, paths that were
+ * recently found not to exist are kept in this cache, keyed by volume and
+ * SMB path (which may include a stream name).
+ *
+ * Entries are only used for a short time (NEG_CACHE_TTL), since the files
+ * may be created by other clients.  Our own calls that may create or rename
+ * files invalidate all the entries for their volume (via InvalidateInfoCache),
+ * as do change notifications, which also let the entries be kept for longer
+ * (see smb2/changenotify.c).
+ */
+
+typedef struct {
+    DIB *dib;               // NULL if entry is unused
+    uint32_t treeConnectID;
+    LongWord time;          // tick count when cached
+    uint16_t pathLength;
+    unsigned char path[NEG_CACHE_MAX_PATH];
+} NegCacheEntry;
+
+static NegCacheEntry negCache[NEG_CACHE_SIZE];
+
+// Index of the entry to replace next
+static unsigned nextNegCacheEntry;
+
+/*
+ * Find the entry for path (in SMB format) on dib, if any.
+ */
+static NegCacheEntry *FindNegCacheEntry(DIB *dib, const void *path,
+    uint16_t pathLength) {
+    unsigned i;
+
+    for (i = 0; i < NEG_CACHE_SIZE; i++) {
+        if (negCache[i].dib == dib
+            && negCache[i].treeConnectID == dib->treeConnectID
+            && negCache[i].pathLength == pathLength
+            && memcmp(negCache[i].path, path, pathLength) == 0)
+            return &negCache[i];
+    }
+    
+    return NULL;
+}
+
+/*
+ * Check if path (in SMB format) on dib was recently found not to exist.
+ */
+bool IsKnownMissing(DIB *dib, const void *path, uint16_t pathLength) {
+    NegCacheEntry *entry;
+
+    entry = FindNegCacheEntry(dib, path, pathLength);
+    if (entry == NULL)
+        return false;
+    if (GetTick() - entry->time
+        > (ChangesWatched(dib) ? NEG_CACHE_WATCHED_TTL : NEG_CACHE_TTL)) {
+        entry->dib = NULL;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Record that path (in SMB format) on dib was found not to exist.
+ */
+void CacheMissing(DIB *dib, const void *path, uint16_t pathLength) {
+    NegCacheEntry *entry;
+
+    if (pathLength > NEG_CACHE_MAX_PATH)
+        return;
+
+    entry = FindNegCacheEntry(dib, path, pathLength);
+    if (entry == NULL) {
+        entry = &negCache[nextNegCacheEntry];
+        nextNegCacheEntry = (nextNegCacheEntry + 1) % NEG_CACHE_SIZE;
+    }
+
+    entry->dib = dib;
+    entry->treeConnectID = dib->treeConnectID;
+    entry->time = GetTick();
+    entry->pathLength = pathLength;
+    memcpy(entry->path, path, pathLength);
+}
+
+/*
+ * Invalidate all cached "not found" results for dib.
+ */
+void InvalidateNegativeCache(DIB *dib) {
+    unsigned i;
+
+    for (i = 0; i < NEG_CACHE_SIZE; i++) {
+        if (negCache[i].dib == dib)
+            negCache[i].dib = NULL;
+    }
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef NEGCACHE_H
+#define NEGCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/driver.h"
+
+// Number of "not found" results that are cached
+#define NEG_CACHE_SIZE 16
+
+// Max length of an SMB path (in bytes) that can be cached
+#define NEG_CACHE_MAX_PATH 128
+
+// Time (in ticks) that a cached "not found" result is considered valid
+#define NEG_CACHE_TTL 300
+
+// Time (in ticks) that a cached result is valid if the volume is watched
+#define NEG_CACHE_WATCHED_TTL (60*60)
+
+bool IsKnownMissing(DIB *dib, const void *path, uint16_t pathLength);
+void CacheMissing(DIB *dib, const void *path, uint16_t pathLength);
+void InvalidateNegativeCache(DIB *dib);
+
+#endif
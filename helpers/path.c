@@ -29,6 +29,109 @@
  */
 #define ESCAPE_CHAR_MASK 0xFC
 
+/*
+ * Characters that are illegal per [MS-FSCC] are represented using the "SFM"
+ * mapping to Unicode private use area codepoints U+F001 to U+F027.  See:
+ * https://github.com/apple-oss-distributions/xnu/blob/xnu-10002.81.5/bsd/vfs/vfs_utfconv.c#L1122
+ */
+#define SFM_BASE  0xF000
+#define SFM_COUNT 0x28
+
+/*
+ * Translation tables, set up by InitPathTables.
+ *
+ * gsToSMB gives the SMB code unit for each GS/OS character (0 if illegal).
+ * The reverse mappings are split up by range: latin1ToGS and sfmToGS are
+ * indexed directly, and other code units are found in otherUCS2 (sorted)
+ * by binary search.  Their entries are 0 for code units that are not mapped.
+ */
+static char16_t gsToSMB[256];
+static unsigned char latin1ToGS[0x80];
+static unsigned char sfmToGS[SFM_COUNT];
+static char16_t otherUCS2[0x80];
+static unsigned char otherGS[0x80];
+static unsigned otherCount;
+
+/*
+ * Recently converted directory paths.  Calls for files in the same directory
+ * (or its subdirectories) reuse the converted form of the directory path,
+ * and only convert the rest.
+ */
+#define PATH_CACHE_SIZE 4
+#define PATH_CACHE_MAX_LEN 96   /* max GS/OS length of a cached path */
+
+typedef struct {
+    uint16_t gsLength;          // 0 if entry is unused
+    uint16_t smbLength;
+    char gsPath[PATH_CACHE_MAX_LEN];
+    uint8_t smbPath[PATH_CACHE_MAX_LEN * 2];
+} PathCacheEntry;
+
+static PathCacheEntry pathCache[PATH_CACHE_SIZE];
+
+// Index of the entry to replace next
+static unsigned nextPathCacheEntry;
+
+/*
+ * Set up the tables used for path translation.
+ */
+void InitPathTables(void) {
+    unsigned i, j;
+    char16_t ch;
+
+    for (i = 0; i < 0x80; i++)
+        gsToSMB[i] = i;
+    for (i = 0x80; i < 0x100; i++)
+        gsToSMB[i] = macRomanToUCS2[i & 0x7f];
+
+    gsToSMB[0x00] = 0;          /* null byte is illegal */
+    for (i = 0x01; i < 0x20; i++)
+        gsToSMB[i] = SFM_BASE | i;
+    gsToSMB['"'] = 0xF020;
+    gsToSMB['*'] = 0xF021;
+    gsToSMB['/'] = 0xF022;
+    gsToSMB['<'] = 0xF023;
+    gsToSMB['>'] = 0xF024;
+    gsToSMB['?'] = 0xF025;
+    gsToSMB['\\'] = 0xF026;
+    gsToSMB['|'] = 0xF027;
+    // TODO Map ' ' and '.' at end of name, like macOS does?
+    gsToSMB[':'] = '\\';        /* path separator */
+
+    for (i = 0x01; i < 0x20; i++)
+        sfmToGS[i] = i;
+    sfmToGS[0x20] = '"';
+    sfmToGS[0x21] = '*';
+    sfmToGS[0x22] = '/';
+    sfmToGS[0x23] = '<';
+    sfmToGS[0x24] = '>';
+    sfmToGS[0x25] = '?';
+    sfmToGS[0x26] = '\\';
+    sfmToGS[0x27] = '|';
+
+    /*
+     * Characters at or above ESCAPE_CHAR_MASK start escape sequences, so
+     * they are not produced by the reverse mapping.
+     */
+    otherCount = 0;
+    for (i = 0x80; i < ESCAPE_CHAR_MASK; i++) {
+        ch = gsToSMB[i];
+        if (ch < 0x100) {
+            if (latin1ToGS[ch & 0x7f] == 0)
+                latin1ToGS[ch & 0x7f] = i;
+        } else {
+            // insertion sort into otherUCS2/otherGS
+            for (j = otherCount; j > 0 && otherUCS2[j-1] > ch; j--) {
+                otherUCS2[j] = otherUCS2[j-1];
+                otherGS[j] = otherGS[j-1];
+            }
+            otherUCS2[j] = ch;
+            otherGS[j] = i;
+            otherCount++;
+        }
+    }
+}
+
 /*
  * Translate a path from the GS/OS direct page (path1 or path2, indicated by
  * num) to SMB format.  It is written to smbpath, with maximum length bufsize.
@@ -60,9 +163,13 @@ unsigned GSOSDPPathToSMB(
  * returned; 0xFFFF indicates an error.
  */
 unsigned GSPathToSMB(GSString *gspath, uint8_t *smbpath, unsigned bufsize) {
-    const char *path;
+    const unsigned char *path, *start, *sep;
     unsigned len;
-    unsigned out_pos = 0;
+    unsigned out_pos = 0, sep_out_pos;
+    unsigned char c;
+    char16_t ch;
+    unsigned i;
+    PathCacheEntry *entry, *prefix;
 
     if (gspath->length != 0 && gspath->text[0] == ':') {
         path = memchr(gspath->text + 1, ':', gspath->length - 1);
@@ -70,81 +177,56 @@ unsigned GSPathToSMB(GSString *gspath, uint8_t *smbpath, unsigned bufsize) {
             len = 0;
         } else {
             path++;
-            len = gspath->length - (path - gspath->text);
+            len = gspath->length - ((char*)path - gspath->text);
         }
     } else {
-        path = gspath->text;
+        path = (unsigned char *)gspath->text;
         len = gspath->length;
     }
     
     bufsize &= 0xfffe;
-    
-    while (len-- > 0) {
-        char16_t ch = *path++;
 
-        switch (ch) {
-        /* null byte is illegal */
-        case 0x00:
+    /*
+     * Start with the longest cached directory path that the path is in.
+     */
+    start = path;
+    prefix = NULL;
+    for (i = 0; i < PATH_CACHE_SIZE; i++) {
+        entry = &pathCache[i];
+        if (entry->gsLength != 0
+            && entry->gsLength < len
+            && (prefix == NULL || entry->gsLength > prefix->gsLength)
+            && path[entry->gsLength] == ':'
+            && memcmp(entry->gsPath, path, entry->gsLength) == 0)
+            prefix = entry;
+    }
+    if (prefix != NULL) {
+        if (prefix->smbLength > bufsize)
             return 0xFFFF;
-    
-        /*
-         * Certain characters are illegal per [MS-FSCC], but can be represented
-         * by "SFM" mapping to Unicode private use area codepoints.  See:
-         * https://github.com/apple-oss-distributions/xnu/blob/xnu-10002.81.5/bsd/vfs/vfs_utfconv.c#L1122
-         */
-        case 0x01: case 0x02: case 0x03:
-        case 0x04: case 0x05: case 0x06: case 0x07:
-        case 0x08: case 0x09: case 0x0A: case 0x0B:
-        case 0x0C: case 0x0D: case 0x0E: case 0x0F:
-        case 0x10: case 0x11: case 0x12: case 0x13:
-        case 0x14: case 0x15: case 0x16: case 0x17:
-        case 0x18: case 0x19: case 0x1A: case 0x1B:
-        case 0x1C: case 0x1D: case 0x1E: case 0x1F:
-            ch |= 0xF000;
-            break;
-        case '"':
-            ch = 0xF020;
-            break;
-        case '*':
-            ch = 0xF021;
-            break;
-        case '/':
-            ch = 0xF022;
-            break;
-        case '<':
-            ch = 0xF023;
-            break;
-        case '>':
-            ch = 0xF024;
-            break;
-        case '?':
-            ch = 0xF025;
-            break;
-        case '\\':
-            ch = 0xF026;
-            break;
-        case '|':
-            ch = 0xF027;
-            break;
-        // TODO Map ' ' and '.' at end of name, like macOS does?
+        memcpy(smbpath, prefix->smbPath, prefix->smbLength);
+        out_pos = prefix->smbLength;
+        path += prefix->gsLength;
+        len -= prefix->gsLength;
+    }
 
-        /* Path separator: : -> \ */
-        case ':':
-            ch = '\\';
-            break;
+    sep = NULL;
+    while (len-- > 0) {
+        c = *path++;
 
-        default:
-            if (ch & 0x80) {
-                if (ch >= ESCAPE_CHAR_MASK && len >= 2
-                    && (path[0] & 0x80) && (path[1] & 0x80)) {
-                    // Convert a Unicode escape sequence
-                    ch = ((ch & 0x03) << 14) 
-                        | ((path[0] & 0x7f) << 7) | (path[1] & 0x7f);
-                    len -= 2;
-                    path += 2;
-                } else {
-                    ch = macRomanToUCS2[ch & 0x7f];
-                }
+        if (c >= ESCAPE_CHAR_MASK && len >= 2
+            && (path[0] & 0x80) && (path[1] & 0x80)) {
+            // Convert a Unicode escape sequence
+            ch = ((c & 0x03) << 14) 
+                | ((path[0] & 0x7f) << 7) | (path[1] & 0x7f);
+            len -= 2;
+            path += 2;
+        } else {
+            ch = gsToSMB[c];
+            if (ch == 0)
+                return 0xFFFF;
+            if (c == ':') {
+                sep = path - 1;
+                sep_out_pos = out_pos;
             }
         }
 
@@ -153,6 +235,20 @@ unsigned GSPathToSMB(GSString *gspath, uint8_t *smbpath, unsigned bufsize) {
         *(char16_t*)(smbpath+out_pos) = ch;
         out_pos += 2;
     }
+
+    /*
+     * Cache the converted form of the directory path, unless it was already
+     * cached (in which case we started with it).
+     */
+    if (sep != NULL && sep > start && sep - start <= PATH_CACHE_MAX_LEN
+        && (prefix == NULL || sep - start > prefix->gsLength)) {
+        entry = &pathCache[nextPathCacheEntry];
+        nextPathCacheEntry = (nextPathCacheEntry + 1) % PATH_CACHE_SIZE;
+        entry->gsLength = sep - start;
+        entry->smbLength = sep_out_pos;
+        memcpy(entry->gsPath, start, entry->gsLength);
+        memcpy(entry->smbPath, smbpath, sep_out_pos);
+    }
     
     return out_pos;
 }
@@ -163,8 +259,8 @@ unsigned GSPathToSMB(GSString *gspath, uint8_t *smbpath, unsigned bufsize) {
  */
 Word SMBNameToGS(char16_t *name, uint16_t length, ResultBuf* buf) {
     char16_t ch;
-    unsigned i;
-    bool mapped;
+    unsigned char gsCh;
+    unsigned lo, hi, mid;
     unsigned outputLength;
     unsigned bufSize;
     char *outPtr;
@@ -188,58 +284,36 @@ Word SMBNameToGS(char16_t *name, uint16_t length, ResultBuf* buf) {
     while (length-- > 0) {
         ch = *name++;
 
-        // Assume character will be successfully mapped
-        mapped = true;
-
         if (ch == 0) {
             buf->bufString.length = 0;
             return badPathSyntax;
         } else if (ch < 0x80) {
-            // leave unchanged
-        } else if (ch >= 0xF001 && ch <= 0xF01F) {
-            ch &= 0x00FF;
-        } else if (ch >= 0xF020 && ch <= 0xF027) {
-            // TODO Map ' ' and '.' at end of name, like macOS does?
-            switch (ch) {
-            case 0xF020:
-                ch = '"';
-                break;
-            case 0xF021:
-                ch = '*';
-                break;
-            case 0xF022:
-                ch = '/';
-                break;
-            case 0xF023:
-                ch = '<';
-                break;
-            case 0xF024:
-                ch = '>';
-                break;
-            case 0xF025:
-                ch = '?';
-                break;
-            case 0xF026:
-                ch = '\\';
-                break;
-            case 0xF027:
-                ch = '|';
-                break;
-            }
+            gsCh = ch;
+        } else if (ch < 0x100) {
+            gsCh = latin1ToGS[ch & 0x7f];
+        } else if (ch >= SFM_BASE && ch < SFM_BASE + SFM_COUNT) {
+            gsCh = sfmToGS[ch - SFM_BASE];
         } else {
-            for (i = 0; i < (ESCAPE_CHAR_MASK & 0x7F); i++) {
-                if (macRomanToUCS2[i] == ch) {
-                    ch = i | 0x80;
+            // binary search for other mapped characters
+            gsCh = 0;
+            lo = 0;
+            hi = otherCount;
+            while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (otherUCS2[mid] < ch) {
+                    lo = mid + 1;
+                } else if (otherUCS2[mid] > ch) {
+                    hi = mid;
+                } else {
+                    gsCh = otherGS[mid];
                     break;
                 }
             }
-            if (i == (ESCAPE_CHAR_MASK & 0x7F))
-                mapped = false;
         }
         
-        if (mapped) {
+        if (gsCh != 0) {
             if (outputLength < bufSize)
-                *outPtr++ = ch;
+                *outPtr++ = gsCh;
             outputLength++;
         } else {
             // Generate escape sequence for an unmapped UTF-16 code unit
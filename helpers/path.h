@@ -20,6 +20,7 @@
 #include <stdint.h>
 #include "gsos/gsosdata.h"
 
+void InitPathTables(void);
 unsigned GSOSDPPathToSMB(
     struct GSOSDP *gsosdp, int num, uint8_t *smbpath, unsigned bufsize);
 unsigned GSPathToSMB(GSString *gspath, uint8_t *smbpath, unsigned bufsize);
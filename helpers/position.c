@@ -20,6 +20,7 @@
 #include "smb2/fileinfo.h"
 #include "helpers/position.h"
 #include "helpers/errors.h"
+#include "helpers/writebehind.h"
 
 /*
  * Get the file's current EOF.
@@ -30,6 +31,11 @@ Word GetEndOfFile(FCR* fcr, DIB* dib, uint64_t *eof) {
     Word result;
     FILE_STANDARD_INFORMATION *info;
 
+    // Make sure the server's EOF reflects any buffered writes
+    result = FlushWriteBehind(fcr, dib);
+    if (result != 0)
+        return result;
+
     /*
      * Get current EOF
      */
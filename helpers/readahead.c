@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <gsos.h>
+#include <memory.h>
+#include <orca.h>
+#include <string.h>
+#include "smb2/smb2.h"
+#include "gsos/gsosdata.h"
+#include "driver/driver.h"
+#include "helpers/readahead.h"
+#include "helpers/errors.h"
+#include "utils/buffersize.h"
+
+/*
+ * Copy data from the read-ahead buffer, starting at fcr->mark.
+ * Up to count bytes are copied to buf.  If the file is in newline mode,
+ * copying stops after a newline character, and *newlineFound is set.
+ *
+ * Returns the number of bytes copied, which is 0 if the read-ahead buffer
+ * does not contain data at fcr->mark.
+ */
+uint16_t ReadFromReadAhead(FCR *fcr, unsigned char *buf, uint32_t count,
+    bool *newlineFound) {
+    unsigned char *data;
+    unsigned char *newlineList;
+    VirtualPointer vp;
+    uint16_t start, length, k;
+    unsigned j, ch;
+
+    *newlineFound = false;
+
+    if (fcr->readAheadLength == 0
+        || fcr->mark < fcr->readAheadOffset
+        || fcr->mark >= fcr->readAheadOffset + fcr->readAheadLength)
+        return 0;
+    
+    start = fcr->mark - fcr->readAheadOffset;
+    length = min(count, fcr->readAheadLength - start);
+    data = (unsigned char *)*fcr->readAheadHandle + start;
+
+    if (fcr->newlineLen != 0) {
+        vp = fcr->newline;
+        DerefVP(newlineList, vp);
+        for (k = 0; k < length; k++) {
+            ch = data[k] & fcr->mask;
+            for (j = 0; j < fcr->newlineLen; j++) {
+                if (ch == newlineList[j]) {
+                    length = k + 1;
+                    *newlineFound = true;
+                    goto newline_done;
+                }
+            }
+        }
+    }
+newline_done:
+
+    memcpy(buf, data, length);
+    return length;
+}
+
+/*
+ * Fill the read-ahead buffer with data starting at fcr->mark.
+ *
+ * Returns a GS/OS error code.  If there is not enough memory to do
+ * read-ahead, this returns 0 but leaves the buffer empty.
+ */
+Word FillReadAhead(FCR *fcr, DIB *dib) {
+    ReadStatus result;
+    
+    fcr->readAheadLength = 0;
+
+    if (GetBufferSize(READ_AHEAD_SIZE) < READ_AHEAD_SIZE)
+        return 0;
+
+    if (fcr->readAheadHandle == NULL) {
+        fcr->readAheadHandle = NewHandle(READ_AHEAD_SIZE, userid(),
+            attrLocked | attrFixed | attrNoCross | attrNoSpec, 0);
+        if (toolerror()) {
+            fcr->readAheadHandle = NULL;
+            return 0;
+        }
+    }
+
+    readRequest.Padding =
+        sizeof(SMB2Header) + offsetof(SMB2_READ_Response, Buffer);
+    readRequest.Flags = 0;
+    readRequest.Length = READ_AHEAD_SIZE;
+    readRequest.Offset = fcr->mark;
+    readRequest.FileId = fcr->fileID;
+    readRequest.MinimumCount = 1;
+    readRequest.Channel = 0;
+    readRequest.RemainingBytes = 0;
+    readRequest.ReadChannelInfoOffset = 0;
+    readRequest.ReadChannelInfoLength = 0;
+
+    readDataBuffer = (unsigned char *)*fcr->readAheadHandle;
+    readDataBufferSize = READ_AHEAD_SIZE;
+    result = SendRequestAndGetResponse(dib, SMB2_READ, sizeof(readRequest));
+    readDataBuffer = NULL;
+    if (result != rsDone)
+        return ConvertError(result);
+
+    if (readResponse.DataLength == 0
+        || readResponse.DataLength > READ_AHEAD_SIZE)
+        return networkError;
+
+    if (readResponse.DataOffset != 0) {
+        if (!VerifyBuffer(readResponse.DataOffset, readResponse.DataLength))
+            return networkError;
+        memcpy(*fcr->readAheadHandle,
+            (unsigned char *)&msg.smb2Header + readResponse.DataOffset,
+            readResponse.DataLength);
+    }
+
+    // Don't keep the data if read caching was lost while reading it.
+    if (!(fcr->cacheFlags & CACHE_READ))
+        return 0;
+
+    fcr->readAheadOffset = fcr->mark;
+    fcr->readAheadLength = readResponse.DataLength;
+    return 0;
+}
+
+/*
+ * Discard any data in the read-ahead buffer.  This must be called whenever
+ * the file's contents may have changed.
+ */
+void InvalidateReadAhead(FCR *fcr) {
+    fcr->readAheadLength = 0;
+}
+
+/*
+ * Free the read-ahead buffer (when closing the file).
+ */
+void FreeReadAhead(FCR *fcr) {
+    if (fcr->readAheadHandle != NULL) {
+        DisposeHandle(fcr->readAheadHandle);
+        fcr->readAheadHandle = NULL;
+    }
+    fcr->readAheadLength = 0;
+}
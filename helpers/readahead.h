@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <types.h>
+#include "gsos/gsosdata.h"
+#include "driver/driver.h"
+
+/*
+ * Amount of data to read ahead.  Small reads (e.g. 512-byte blocks or
+ * lines of text) are satisfied from a buffer of this size, so that each
+ * one does not require a round trip to the server.
+ */
+#define READ_AHEAD_SIZE 8192u
+
+// Reads smaller than this are done through the read-ahead buffer
+#define READ_AHEAD_THRESHOLD 2048u
+
+uint16_t ReadFromReadAhead(FCR *fcr, unsigned char *buf, uint32_t count,
+    bool *newlineFound);
+Word FillReadAhead(FCR *fcr, DIB *dib);
+void InvalidateReadAhead(FCR *fcr);
+void FreeReadAhead(FCR *fcr);
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <gsos.h>
+#include <memory.h>
+#include <orca.h>
+#include <string.h>
+#include "smb2/smb2.h"
+#include "gsos/gsosdata.h"
+#include "gsos/gsosutils.h"
+#include "driver/driver.h"
+#include "fst/fstspecific.h"
+#include "helpers/writebehind.h"
+#include "helpers/errors.h"
+#include "helpers/infocache.h"
+#include "utils/buffersize.h"
+#include "utils/memcasecmp.h"
+
+/*
+ * Size of the write-behind buffer.  Adjacent small writes are combined in
+ * this buffer and sent to the server together, rather than each requiring
+ * a separate round trip.
+ */
+#define WRITE_BEHIND_SIZE 8192u
+
+// Number of open files with data in their write-behind buffers
+static unsigned writeBehindCount = 0;
+
+/*
+ * Buffer a write of count bytes from buf at fcr->mark, if possible.
+ * Any previously-buffered data is flushed first if the new data cannot
+ * be combined with it.
+ *
+ * Returns a GS/OS error code.  *buffered is set to indicate whether the
+ * data was buffered; if not (e.g. due to low memory), the caller should
+ * write it directly.
+ */
+Word BufferWrite(FCR *fcr, DIB *dib, const unsigned char *buf, uint16_t count,
+    bool *buffered) {
+    Word retval;
+
+    *buffered = false;
+
+    if (fcr->writeBehindLength != 0
+        && (fcr->mark != fcr->writeBehindOffset + fcr->writeBehindLength
+            || fcr->writeBehindLength + count > WRITE_BEHIND_SIZE)) {
+        retval = FlushWriteBehind(fcr, dib);
+        if (retval != 0)
+            return retval;
+    }
+
+    if (fcr->writeBehindHandle == NULL) {
+        if (GetBufferSize(WRITE_BEHIND_SIZE) < WRITE_BEHIND_SIZE)
+            return 0;
+        fcr->writeBehindHandle = NewHandle(WRITE_BEHIND_SIZE, userid(),
+            attrLocked | attrFixed | attrNoCross | attrNoSpec, 0);
+        if (toolerror()) {
+            fcr->writeBehindHandle = NULL;
+            return 0;
+        }
+    }
+    
+    if (fcr->writeBehindLength == 0) {
+        fcr->writeBehindOffset = fcr->mark;
+        writeBehindCount++;
+    }
+    memcpy((unsigned char *)*fcr->writeBehindHandle + fcr->writeBehindLength,
+        buf, count);
+    fcr->writeBehindLength += count;
+    
+    *buffered = true;
+    return 0;
+}
+
+/*
+ * Write any data in the write-behind buffer to the server.
+ *
+ * Returns a GS/OS error code.  On error, the data remains buffered.
+ */
+Word FlushWriteBehind(FCR *fcr, DIB *dib) {
+    ReadStatus result;
+    uint16_t done = 0;
+
+    if (fcr->writeBehindLength != 0)
+        InvalidateInfoCache(dib);
+
+    while (done < fcr->writeBehindLength) {
+        writeRequest.DataOffset =
+            sizeof(SMB2Header) + offsetof(SMB2_WRITE_Request, Buffer);
+        writeRequest.Length = fcr->writeBehindLength - done;
+        writeRequest.Offset = fcr->writeBehindOffset + done;
+        writeRequest.FileId = fcr->fileID;
+        writeRequest.Channel = 0;
+        writeRequest.RemainingBytes = 0;
+        writeRequest.WriteChannelInfoOffset = 0;
+        writeRequest.WriteChannelInfoLength = 0;
+        writeRequest.Flags = 0;
+
+        result = SendRequestWithDataAndGetResponse(dib, SMB2_WRITE,
+            sizeof(writeRequest),
+            (unsigned char *)*fcr->writeBehindHandle + done,
+            writeRequest.Length);
+        if (result != rsDone)
+            goto error;
+        
+        if (writeResponse.Count == 0
+            || writeResponse.Count > fcr->writeBehindLength - done) {
+            result = rsBadMsg;
+            goto error;
+        }
+        
+        done += writeResponse.Count;
+    }
+
+    if (fcr->writeBehindLength != 0) {
+        fcr->writeBehindLength = 0;
+        writeBehindCount--;
+    }
+    fcr->smbFlags &= ~SMB_FLAG_DIRTY;
+    return 0;
+
+error:
+    // Keep the part that was not written, so it can be retried later.
+    if (done != 0) {
+        memmove(*fcr->writeBehindHandle,
+            (unsigned char *)*fcr->writeBehindHandle + done,
+            fcr->writeBehindLength - done);
+        fcr->writeBehindOffset += done;
+        fcr->writeBehindLength -= done;
+    }
+    if (result == rsBadMsg)
+        return networkError;
+    return ConvertError(result);
+}
+
+/*
+ * Flush the write-behind buffer if it contains data in the range of file
+ * positions from start up to (but not including) end.
+ */
+Word FlushWriteBehindRange(FCR *fcr, DIB *dib, uint64_t start, uint64_t end) {
+    if (fcr->writeBehindLength == 0
+        || fcr->writeBehindOffset >= end
+        || fcr->writeBehindOffset + fcr->writeBehindLength <= start)
+        return 0;
+    
+    return FlushWriteBehind(fcr, dib);
+}
+
+/*
+ * Get the part of a GS/OS path after the volume name (if it has one).
+ */
+static const char *VolumeRelativePath(GSString *path, unsigned *len) {
+    const char *sep;
+
+    if (path->length != 0 && path->text[0] == ':') {
+        sep = memchr(path->text + 1, ':', path->length - 1);
+        if (sep == NULL) {
+            *len = 0;
+            return path->text + path->length;
+        }
+        sep++;
+        *len = path->length - (sep - path->text);
+        return sep;
+    }
+
+    *len = path->length;
+    return path->text;
+}
+
+/*
+ * Flush the write-behind buffers for open files on dib's volume, so that
+ * information about them from the server is up to date.  If path is
+ * non-NULL, only files opened with that GS/OS path are flushed.
+ *
+ * Returns a GS/OS error code (the first one encountered, if any).
+ */
+Word FlushVolumeWriteBehind(DIB *dib, GSString *path) {
+    VirtualPointer vp;
+    GSString *fcrPath;
+    VCR *vcr;
+    FCR *fcr;
+    const char *name, *fcrName;
+    unsigned nameLen, fcrNameLen;
+    Word result, retval = 0;
+    unsigned i;
+
+    if (writeBehindCount == 0)
+        return 0;
+    if (GetVCR(dib, &vcr) != 0 || vcr->openCount == 0)
+        return 0;
+
+    if (path != NULL)
+        name = VolumeRelativePath(path, &nameLen);
+
+    for (i = 1; (fcr = GetFCR(i)) != NULL; i++) {
+        if (fcr->volID != vcr->id || fcr->fstID != smbFSID
+            || fcr->writeBehindLength == 0)
+            continue;
+        
+        if (path != NULL) {
+            vp = fcr->pathName;
+            DerefVP(fcrPath, vp);
+            fcrName = VolumeRelativePath(fcrPath, &fcrNameLen);
+            if (fcrNameLen != nameLen
+                || memcasecmp(fcrName, name, nameLen) != 0)
+                continue;
+        }
+        
+        result = FlushWriteBehind(fcr, dib);
+        if (result != 0 && retval == 0)
+            retval = result;
+    }
+    
+    return retval;
+}
+
+/*
+ * Flush the write-behind buffers for all open files on SMB volumes.
+ *
+ * Returns a GS/OS error code (the first one encountered, if any).
+ */
+Word FlushAllWriteBehind(void) {
+    Word result, retval = 0;
+    unsigned j;
+
+    for (j = 0; j < NDIBS && writeBehindCount != 0; j++) {
+        if (dibs[j].extendedDIBPtr == 0)
+            continue;
+        
+        result = FlushVolumeWriteBehind(&dibs[j], NULL);
+        if (result != 0 && retval == 0)
+            retval = result;
+    }
+    
+    return retval;
+}
+
+/*
+ * Free the write-behind buffer (when closing the file).
+ * Any data in it should already have been flushed.
+ */
+void FreeWriteBehind(FCR *fcr) {
+    if (fcr->writeBehindHandle != NULL) {
+        DisposeHandle(fcr->writeBehindHandle);
+        fcr->writeBehindHandle = NULL;
+    }
+    if (fcr->writeBehindLength != 0) {
+        fcr->writeBehindLength = 0;
+        writeBehindCount--;
+    }
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef WRITEBEHIND_H
+#define WRITEBEHIND_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <types.h>
+#include "gsos/gsosdata.h"
+#include "driver/driver.h"
+
+// Writes smaller than this are buffered in the write-behind buffer
+#define WRITE_BEHIND_THRESHOLD 2048u
+
+Word BufferWrite(FCR *fcr, DIB *dib, const unsigned char *buf, uint16_t count,
+    bool *buffered);
+Word FlushWriteBehind(FCR *fcr, DIB *dib);
+Word FlushWriteBehindRange(FCR *fcr, DIB *dib, uint64_t start, uint64_t end);
+Word FlushVolumeWriteBehind(DIB *dib, GSString *path);
+Word FlushAllWriteBehind(void);
+void FreeWriteBehind(FCR *fcr);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <stddef.h>
+#include <misctool.h>
+#include "smb2/smb2.h"
+#include "smb2/changenotify.h"
+#include "driver/driver.h"
+#include "fst/fstdata.h"
+#include "helpers/closerequest.h"
+#include "helpers/infocache.h"
+
+/*
+ * Change notifications (see [MS-SMB2] sections 3.2.4.14 and 3.3.5.19) tell
+ * us when files on a volume are changed, whether by us or by other clients.
+ * For each mounted volume, we keep a CHANGE_NOTIFY request outstanding on
+ * the root directory of the share, watching the whole tree.  When it
+ * completes, the cached information about files on the volume is
+ * invalidated, GS/OS is notified that the volume has changed, and the
+ * request is sent again.  While a volume is watched, the caches keep
+ * information for longer than they otherwise would, except while responses
+ * to other requests are outstanding on its connection (e.g. a prefetched
+ * directory page), since notifications are not polled for then.
+ *
+ * The requests are sent out of band, and their completions may arrive while
+ * we are waiting for any response, so they are handled from ReceiveResponse
+ * (like oplock breaks).  Completions that arrive while the FST is not being
+ * called are picked up by PollChangeNotifications at the start of the next
+ * call.  We do not use the details of what changed, so no output buffer is
+ * requested, and the server reports STATUS_NOTIFY_ENUM_DIR.
+ */
+
+#define WATCH_FILTER (FILE_NOTIFY_CHANGE_FILE_NAME          \
+                      | FILE_NOTIFY_CHANGE_DIR_NAME         \
+                      | FILE_NOTIFY_CHANGE_ATTRIBUTES       \
+                      | FILE_NOTIFY_CHANGE_SIZE             \
+                      | FILE_NOTIFY_CHANGE_LAST_WRITE       \
+                      | FILE_NOTIFY_CHANGE_CREATION         \
+                      | FILE_NOTIFY_CHANGE_STREAM_NAME      \
+                      | FILE_NOTIFY_CHANGE_STREAM_SIZE      \
+                      | FILE_NOTIFY_CHANGE_STREAM_WRITE)
+
+// Min interval between polls by PollChangeNotifications
+#define CHANGE_POLL_INTERVAL 30 /* ticks */
+
+// Number of volumes with watching set
+unsigned watchCount = 0;
+
+// Time of the last poll by PollChangeNotifications
+static LongWord lastPollTime;
+
+/*
+ * Send a CHANGE_NOTIFY request on the watch handle for dib.
+ */
+static bool SendChangeNotify(DIB *dib) {
+    static SMB2_CHANGE_NOTIFY_Request notifyReq;
+
+    notifyReq.StructureSize = sizeof(notifyReq);
+    notifyReq.Flags = SMB2_WATCH_TREE;
+    notifyReq.OutputBufferLength = 0;
+    notifyReq.FileId = dib->watchFileID;
+    notifyReq.CompletionFilter = WATCH_FILTER;
+    notifyReq.Reserved = 0;
+    
+    return SendOutOfBandRequest(dib, SMB2_CHANGE_NOTIFY, &notifyReq,
+        sizeof(notifyReq), &dib->watchMessageId);
+}
+
+/*
+ * Start watching for changes on the volume for dib (after it is mounted
+ * or reconnected).  If this fails, the volume is just not watched.
+ */
+void StartChangeNotify(DIB *dib) {
+    StopChangeNotify(dib);
+
+    /*
+     * Changes may have been missed while the volume was not watched,
+     * so don't keep any information cached from before.
+     */
+    InvalidateInfoCache(dib);
+
+    if (dib->flags & FLAG_PIPE_SHARE)
+        return;
+
+    /*
+     * Open root directory
+     */
+    createRequest.SecurityFlags = 0;
+    createRequest.RequestedOplockLevel = SMB2_OPLOCK_LEVEL_NONE;
+    createRequest.ImpersonationLevel = Impersonation;
+    createRequest.SmbCreateFlags = 0;
+    createRequest.Reserved = 0;
+    createRequest.DesiredAccess = FILE_LIST_DIRECTORY | SYNCHRONIZE;
+    createRequest.FileAttributes = 0;
+    createRequest.ShareAccess =
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+    createRequest.CreateDisposition = FILE_OPEN;
+    createRequest.CreateOptions = FILE_DIRECTORY_FILE;
+    createRequest.NameOffset =
+        sizeof(SMB2Header) + offsetof(SMB2_CREATE_Request, Buffer);
+    createRequest.NameLength = 0;
+    createRequest.CreateContextsOffset = 0;
+    createRequest.CreateContextsLength = 0;
+
+    if (SendRequestAndGetResponse(dib, SMB2_CREATE, sizeof(createRequest))
+        != rsDone)
+        return;
+
+    dib->watchFileID = createResponse.FileId;
+    if (!SendChangeNotify(dib)) {
+        SendCloseRequestAndGetResponse(dib, &dib->watchFileID);
+        return;
+    }
+
+    dib->watching = true;
+    watchCount++;
+}
+
+/*
+ * Stop treating the volume for dib as watched.  This does not close the
+ * watch handle (it is closed by a tree disconnect, or was lost if the
+ * connection was re-established).
+ */
+void StopChangeNotify(DIB *dib) {
+    if (dib->watching) {
+        dib->watching = false;
+        watchCount--;
+    }
+}
+
+/*
+ * Check if the volume for dib is watched and change notifications for it
+ * are being processed, so the caches can use their longer TTLs for it.
+ */
+bool ChangesWatched(DIB *dib) {
+    return dib->watching && !HaveOutstanding(dib->session->connection);
+}
+
+/*
+ * Handle a response (in msg) to one of our CHANGE_NOTIFY requests.
+ */
+void HandleChangeNotifyResponse(Connection *connection) {
+    DIB *dib;
+    unsigned i;
+
+    // Interim response: the request is still outstanding
+    if (msg.smb2Header.Status == STATUS_PENDING
+        && (msg.smb2Header.Flags & SMB2_FLAGS_ASYNC_COMMAND))
+        return;
+
+    for (i = 0; i < NDIBS; i++) {
+        dib = &dibs[i];
+        if (dib->watching
+            && dib->session->connection == connection
+            && dib->watchMessageId == msg.smb2Header.MessageId)
+            break;
+    }
+    if (i == NDIBS)
+        return;
+
+    if (msg.smb2Header.Status == STATUS_SUCCESS
+        || msg.smb2Header.Status == STATUS_NOTIFY_ENUM_DIR) {
+        InvalidateInfoCache(dib);
+        volChangedDevNum = dib->DIBDevNum;
+        if (SendChangeNotify(dib))
+            return;
+    }
+
+    /*
+     * The request failed (e.g. because the server does not support it),
+     * or could not be re-sent, so give up on watching this volume.
+     */
+    SendOutOfBandCloseRequest(dib, &dib->watchFileID);
+    StopChangeNotify(dib);
+}
+
+/*
+ * Process change notifications for watched volumes that arrived while
+ * the FST was not being called.  This is called at the start of each
+ * GS/OS call if any volumes are being watched, but only polls if it has
+ * not done so within CHANGE_POLL_INTERVAL, so that calls that do not go
+ * to the server (e.g. reads from the read-ahead buffer) stay fast.  Each
+ * connection is polled once, even if several watched volumes use it.
+ */
+void PollChangeNotifications(void) {
+    Connection *connection;
+    unsigned i, j;
+
+    if (GetTick() - lastPollTime < CHANGE_POLL_INTERVAL)
+        return;
+    lastPollTime = GetTick();
+
+    for (i = 0; i < NDIBS; i++) {
+        if (!dibs[i].watching)
+            continue;
+        
+        connection = dibs[i].session->connection;
+        for (j = 0; j < i; j++) {
+            if (dibs[j].watching && dibs[j].session->connection == connection)
+                break;
+        }
+        if (j == i)
+            PollConnection(&dibs[i]);
+    }
+}
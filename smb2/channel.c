@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <string.h>
+#include <tcpip.h>
+#include <misctool.h>
+#include "smb2/smb2.h"
+#include "smb2/connection.h"
+#include "smb2/session.h"
+#include "smb2/channel.h"
+#include "driver/driver.h"
+#include "utils/alloc.h"
+
+/*
+ * With SMB 3.x multichannel (see [MS-SMB2] sections 3.2.4.2.3 and
+ * 3.2.5.3.1), a session may be bound to several connections to the same
+ * server, and requests for it may be sent on any of them.  Marinetti's TCP
+ * window limits how much data can be in flight on one connection, so for
+ * sessions on connections made with CONNECT_FLAG_MULTICHANNEL, we open one
+ * additional connection and bind the session to it.  Pipelined reads then
+ * spread their READ requests across both connections.
+ *
+ * The channel is only used for READs, and only while a read is in progress.
+ * Other requests, break notifications, and acknowledgments all use the main
+ * connection.  If the channel fails, it is dropped and the main connection
+ * is used alone; it is not reconnected by itself, but a new channel is
+ * added when the session is reconnected.
+ *
+ * Binding requires the session to be signed.  Each channel has its own
+ * signing key, derived from the authentication done when binding it.
+ */
+
+/*
+ * Try to bind an additional channel to session.  Failures are ignored,
+ * since the session works without it.
+ */
+void AddChannel(Session *session) {
+    Connection *connection = session->connection;
+    Channel *channel;
+
+    if (session->channel != NULL || !connection->multiChannel
+        || !session->signingRequired)
+        return;
+
+    channel = smb_malloc(sizeof(Channel));
+    if (channel == NULL)
+        return;
+    memset(channel, 0, sizeof(Channel));
+
+    channel->connection.serverIP = connection->serverIP;
+    channel->connection.serverPort = connection->serverPort;
+    channel->connection.reconnectTime = GetTick();
+    if (Connect(&channel->connection) != 0) {
+        smb_free(channel);
+        return;
+    }
+    channel->connection.primary = connection;
+    channel->connection.refCount = 1;
+
+    if (channel->connection.dialect != connection->dialect
+        || !channel->connection.multiChannel)
+        goto fail;
+
+    channel->session = *session;
+    channel->session.connection = &channel->connection;
+    channel->session.channel = NULL;
+    channel->session.refCount = 0;
+    if (BindSession(&channel->session) != 0)
+        goto fail;
+
+    session->channel = channel;
+    return;
+
+fail:
+    // Don't free the session's own signing context.
+    if (channel->session.signingContext != session->signingContext)
+        smb_free(channel->session.signingContext);
+    TCPIPAbortTCP(channel->connection.ipid);
+    TCPIPLogout(channel->connection.ipid);
+    smb_free(channel);
+}
+
+/*
+ * Close and forget the additional channel of session, if it has one.
+ */
+void DropChannel(Session *session) {
+    Channel *channel = session->channel;
+
+    if (channel == NULL)
+        return;
+    session->channel = NULL;
+
+    ClearOutstanding(&channel->connection);
+    smb_free(channel->session.signingContext);
+    TCPIPAbortTCP(channel->connection.ipid);
+    TCPIPLogout(channel->connection.ipid);
+    smb_free(channel);
+}
+
+/*
+ * Get a DIB that can be used to send requests for the volume of dib on its
+ * session's additional channel, or NULL if there is no channel.  The DIB
+ * is only valid until the next call.
+ */
+DIB *ChannelDIB(DIB *dib) {
+    static DIB channelDIB;
+
+    if (dib->session->channel == NULL)
+        return NULL;
+
+    channelDIB = *dib;
+    channelDIB.session = &dib->session->channel->session;
+    return &channelDIB;
+}
@@ -89,14 +89,25 @@ Word Connect(Connection *connection) {
 
     // assume lowest version until we have negotiated
     connection->dialect = SMB_202;
+    connection->largeMTU = false;
+    connection->leasing = false;
+    connection->dirLeasing = false;
+    connection->multiChannel = false;
 
     connection->nextMessageId = 0;
     connection->remainingCompoundSize = 0;
-    connection->requestedCredits = false;
+    connection->rcvBufStart = connection->rcvBufEnd = 0;
+    connection->credits = 1;
+    connection->creditsInFlight = 0;
+    connection->creditTarget = INITIAL_CREDIT_TARGET;
+    connection->srtt = 0;
+    connection->rate = 0;
 
     negotiateRequest.SecurityMode = SMB2_NEGOTIATE_SIGNING_ENABLED;
     negotiateRequest.Reserved = 0;
-    negotiateRequest.Capabilities = 0;
+    negotiateRequest.Capabilities =
+        SMB2_GLOBAL_CAP_LARGE_MTU | SMB2_GLOBAL_CAP_LEASING
+        | SMB2_GLOBAL_CAP_DIRECTORY_LEASING | SMB2_GLOBAL_CAP_MULTI_CHANNEL;
 
     if (clientGUID.time_high_and_version == 0)
         GenerateGUID(&clientGUID);
@@ -172,6 +183,33 @@ Word Connect(Connection *connection) {
     }
     connection->dialect = negotiateResponse.DialectRevision;
     
+    /*
+     * Without multi-credit support, requests are limited to 64K.
+     * (SMB 2.0.2 does not support it, even if the server claims to.)
+     */
+    connection->largeMTU = connection->dialect != SMB_202
+        && (negotiateResponse.Capabilities & SMB2_GLOBAL_CAP_LARGE_MTU);
+    connection->maxReadSize = negotiateResponse.MaxReadSize;
+    connection->maxWriteSize = negotiateResponse.MaxWriteSize;
+    if (!connection->largeMTU) {
+        connection->maxReadSize = min(connection->maxReadSize, 0x10000);
+        connection->maxWriteSize = min(connection->maxWriteSize, 0x10000);
+    }
+    
+    // Leases were introduced in SMB 2.1; before that, only oplocks exist.
+    connection->leasing = connection->dialect != SMB_202
+        && (negotiateResponse.Capabilities & SMB2_GLOBAL_CAP_LEASING);
+    
+    // Directory leases were introduced in SMB 3.0.
+    connection->dirLeasing = connection->leasing
+        && connection->dialect >= SMB_30
+        && (negotiateResponse.Capabilities
+            & SMB2_GLOBAL_CAP_DIRECTORY_LEASING);
+
+    // Multichannel was introduced in SMB 3.0.
+    connection->multiChannel = connection->dialect >= SMB_30
+        && (negotiateResponse.Capabilities & SMB2_GLOBAL_CAP_MULTI_CHANNEL);
+    
     if (negotiateResponse.SecurityMode & SMB2_NEGOTIATE_SIGNING_REQUIRED) {
         connection->wantSigning = true;
     }
@@ -24,13 +24,29 @@
 
 struct hmac_sha256_context;
 
-typedef struct {
+// size of the buffer for data received on a connection (see utils/readtcp.c)
+#define RCV_BUF_SIZE 2048u
+
+typedef struct Connection {
     Word ipid;
     
     uint64_t nextMessageId;
     
     uint16_t dialect;
     
+    bool largeMTU;          // multi-credit requests are supported
+    uint32_t maxReadSize;   // max size for a READ, as reported by server
+    uint32_t maxWriteSize;  // max size for a WRITE, as reported by server
+    
+    bool leasing;           // leases are supported (else we use oplocks)
+    bool dirLeasing;        // leases on directories are supported
+    bool multiChannel;      // sessions may be bound to more connections
+
+    // Bind an additional channel to sessions (see smb2/channel.c)
+    bool wantChannel;
+    // For an additional channel, the main connection of its session
+    struct Connection *primary;
+    
     bool wantSigning; // flag set in Negotiate, but not necessarily in effect yet
     
     Word refCount;
@@ -43,11 +59,34 @@ typedef struct {
     
     LongWord reconnectTime;
     LongWord lastActivityTime;
+
+    bool keepalive;         // send ECHOs while idle (see smb2/keepalive.c)
+    LongWord keepaliveTime; // time the last keepalive ECHO was sent
     
     // size of not-yet processed portion of a compound message
     uint32_t remainingCompoundSize;
+
+    // data received from Marinetti but not yet consumed (from rcvBufStart
+    // up to rcvBufEnd)
+    uint16_t rcvBufStart;
+    uint16_t rcvBufEnd;
+    unsigned char rcvBuf[RCV_BUF_SIZE];
     
-    bool requestedCredits;
+    /*
+     * Credit accounting (see [MS-SMB2] section 3.2.4.1.5).  The credit window
+     * is credits + creditsInFlight; we ask the server for enough credits to
+     * keep it at creditTarget.
+     */
+    uint16_t credits;           // credits granted and not yet consumed
+    uint16_t creditsInFlight;   // credits charged for requests not answered
+    uint16_t creditTarget;      // number of credits we want to have
+
+    /*
+     * Transfer tuning (see smb2/tuning.c).  These are smoothed estimates,
+     * or 0 if no measurements have been made yet.
+     */
+    uint32_t srtt;              // round-trip time, in 1/8 ticks
+    uint32_t rate;              // data transfer rate, in bytes per tick
 } Connection;
 
 extern DIB fakeDIB;
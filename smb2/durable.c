@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <string.h>
+#include "smb2/smb2.h"
+#include "smb2/session.h"
+#include "smb2/oplock.h"
+#include "smb2/durable.h"
+#include "gsos/gsosdata.h"
+#include "driver/driver.h"
+#include "helpers/createcontext.h"
+#include "utils/guidutils.h"
+
+/*
+ * Durable handles (see [MS-SMB2] sections 3.2.4.3.4 and 3.2.4.4) are kept
+ * open by the server for a while after the connection is lost, so that we
+ * can reclaim them after reconnecting.  Unlike reopening the file by path,
+ * this keeps its byte-range locks, share mode, and oplock or lease, and it
+ * cannot end up opening a different file.
+ *
+ * The server only grants a durable handle along with a batch oplock or a
+ * lease with handle caching, so we only ask for one when RequestCaching has
+ * requested those.  Version 2 requests (identified by a CreateGuid) are
+ * used with SMB 3.x; version 1 requests are used with SMB 2.x.  If a handle
+ * cannot be reclaimed, TreeConnect_Reconnect falls back to reopening the
+ * file by path.
+ */
+
+// CreateGuid in the most recent version 2 durable handle request
+static GUID requestedCreateGuid;
+
+/*
+ * Request a durable handle in an otherwise-assembled CREATE request to open
+ * a file, after RequestCaching has been called for it.  *msgLen is the
+ * length of the request, which is updated.
+ */
+void RequestDurableHandle(DIB *dib, uint16_t *msgLen) {
+    static SMB2_CREATE_DURABLE_HANDLE_REQUEST_Data durableRequest;
+    static SMB2_CREATE_DURABLE_HANDLE_REQUEST_V2_Data durableRequestV2;
+
+    requestedCreateGuid.time_high_and_version = 0;
+
+    if (!handleCachingRequested)
+        return;
+
+    if (dib->session->connection->dialect >= SMB_30) {
+        GenerateGUID(&requestedCreateGuid);
+        durableRequestV2.Timeout = 0; // use server's default timeout
+        durableRequestV2.Flags = 0;
+        durableRequestV2.Reserved = 0;
+        durableRequestV2.CreateGuid = requestedCreateGuid;
+        if (!AddCreateContext(SMB2_CREATE_DURABLE_HANDLE_REQUEST_V2,
+            &durableRequestV2, sizeof(durableRequestV2), msgLen))
+            requestedCreateGuid.time_high_and_version = 0;
+    } else {
+        memset(&durableRequest, 0, sizeof(durableRequest));
+        AddCreateContext(SMB2_CREATE_DURABLE_HANDLE_REQUEST,
+            &durableRequest, sizeof(durableRequest), msgLen);
+    }
+}
+
+/*
+ * Record whether a newly-opened file got a durable handle, based on
+ * createResponse (for a request made with RequestDurableHandle).
+ */
+void SetGrantedDurability(FCR *fcr) {
+    uint16_t dataLen;
+
+    fcr->smbFlags &= ~SMB_FLAG_DURABLE;
+    fcr->createGuid = requestedCreateGuid;
+
+    if (requestedCreateGuid.time_high_and_version != 0) {
+        if (GetCreateContext(SMB2_CREATE_DURABLE_HANDLE_REQUEST_V2, &dataLen)
+            != NULL
+            && dataLen >= sizeof(SMB2_CREATE_DURABLE_HANDLE_RESPONSE_V2_Data))
+            fcr->smbFlags |= SMB_FLAG_DURABLE;
+    } else {
+        if (GetCreateContext(SMB2_CREATE_DURABLE_HANDLE_REQUEST, &dataLen)
+            != NULL)
+            fcr->smbFlags |= SMB_FLAG_DURABLE;
+    }
+}
+
+/*
+ * Add the contexts to reclaim the durable handle for fcr to an otherwise-
+ * assembled CREATE request (with the same name it was originally opened
+ * with).  *msgLen is the length of the request, which is updated.
+ * Returns false if the contexts could not be added.
+ */
+bool RequestDurableReconnect(FCR *fcr, uint16_t *msgLen) {
+    static SMB2_CREATE_DURABLE_HANDLE_RECONNECT_Data reconnectRequest;
+    static SMB2_CREATE_DURABLE_HANDLE_RECONNECT_V2_Data reconnectRequestV2;
+
+    RequestReclaimCaching(fcr, msgLen);
+    if (createRequest.RequestedOplockLevel == SMB2_OPLOCK_LEVEL_NONE)
+        return false;
+
+    if (fcr->createGuid.time_high_and_version != 0) {
+        reconnectRequestV2.FileId = fcr->fileID;
+        reconnectRequestV2.CreateGuid = fcr->createGuid;
+        reconnectRequestV2.Flags = 0;
+        return AddCreateContext(SMB2_CREATE_DURABLE_HANDLE_RECONNECT_V2,
+            &reconnectRequestV2, sizeof(reconnectRequestV2), msgLen);
+    } else {
+        reconnectRequest.FileId = fcr->fileID;
+        return AddCreateContext(SMB2_CREATE_DURABLE_HANDLE_RECONNECT,
+            &reconnectRequest, sizeof(reconnectRequest), msgLen);
+    }
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <types.h>
+#include <desk.h>
+#include <misctool.h>
+#include "smb2/smb2.h"
+#include "smb2/keepalive.h"
+#include "smb2/channel.h"
+#include "smb2/oplock.h"
+#include "driver/driver.h"
+#include "helpers/dirlist.h"
+#include "systemops/Startup.h"
+
+/*
+ * Windows drops SMB connections after a period of inactivity, and with its
+ * default firewall configuration the GS is not told about it, so the next
+ * request has to time out before a reconnection attempt can start (see
+ * utils/readtcp.c).  To avoid this, connections made with
+ * CONNECT_FLAG_KEEPALIVE are kept active by sending an SMB2_ECHO request
+ * on them when they have been idle for a while.
+ *
+ * This is done from a run queue task, so it runs while the current
+ * application is calling SystemTask (as desktop programs do when idle).
+ * The ECHO is sent out of band, and its response is read on the next run
+ * (or discarded by ReceiveResponse, if a request is sent before then).
+ * Break notifications and change notifications that have arrived are
+ * handled at the same time, and any breaks that were waiting for deferred
+ * writes to be flushed are acknowledged.  Directory handles that have been
+ * held open for too long are also closed (see helpers/dirlist.c).
+ *
+ * The task only does this when no GS/OS call is in progress, and it sets
+ * the GS/OS busy flag while doing it, so GS/OS will not be called (e.g. by
+ * an interrupt handler) while we are using system services and changing
+ * FCRs and our caches.
+ */
+
+// Send an ECHO when nothing has been received for this long
+#define KEEPALIVE_PERIOD (60*60) /* ticks */
+
+/*
+ * Interval between runs of the keepalive task.  This is short so that break
+ * notifications are acknowledged well within the server's timeout for them.
+ */
+#define KEEPALIVE_TASK_PERIOD 60 /* ticks */
+
+/*
+ * Breaks are considered to be handled in the background if the task has
+ * processed connections within this time.
+ */
+#define BACKGROUND_POLL_TIMEOUT (4*KEEPALIVE_TASK_PERIOD) /* ticks */
+
+// GS/OS busy flag (non-zero while a GS/OS call is in progress)
+#define busyFlag (*(Byte*)0xe100ff)
+
+// Vectors to increment and decrement the GS/OS busy flag
+#define INCBUSYFLG 0xe10064
+#define DECBUSYFLG 0xe10068
+
+#define JML 0x5c
+
+static void KeepaliveTask(void);
+static void KeepAlive(DIB *dib);
+
+static struct {
+    Long reserved1;
+    Word period;
+    Word signature;
+    Long reserved2;
+    Byte jml;
+    void (*proc)(void);
+} runQRec = {0, KEEPALIVE_TASK_PERIOD, 0xA55A, 0, JML, KeepaliveTask};
+
+// Has the task processed connections, and if so, when did it last do so?
+static bool taskPolled = false;
+static LongWord lastPollTime;
+
+/*
+ * Install the keepalive task in the run queue.  This is called when a
+ * connection with keepalives is made.  The run queue is reset when the
+ * Desk Manager is restarted (e.g. by a new application), so the task is
+ * removed first in case it is still installed.
+ */
+void StartKeepalive(void) {
+    RemoveFromRunQ((Pointer)&runQRec);
+    AddToRunQ((Pointer)&runQRec);
+}
+
+/*
+ * Run queue task: process anything received on idle connections with
+ * keepalives (and their additional channels), and send an ECHO on ones
+ * that have been idle too long.
+ */
+#pragma databank 1
+static void KeepaliveTask(void) {
+    DIB *channelDIB;
+    unsigned i;
+
+    runQRec.period = KEEPALIVE_TASK_PERIOD;
+
+    if (busyFlag != 0 || marinettiStatus != tcpipLoaded)
+        return;
+
+    asm {
+        jsl INCBUSYFLG
+    }
+    
+    taskPolled = true;
+    lastPollTime = GetTick();
+
+    for (i = 0; i < NDIBS; i++) {
+        if (dibs[i].extendedDIBPtr == 0
+            || !dibs[i].session->connection->keepalive)
+            continue;
+
+        KeepAlive(&dibs[i]);
+        channelDIB = ChannelDIB(&dibs[i]);
+        if (channelDIB != NULL)
+            KeepAlive(channelDIB);
+    }
+    
+    if (pendingBreakCount != 0)
+        ProcessPendingBreaks();
+    ExpireDirListings();
+
+    asm {
+        jsl DECBUSYFLG
+    }
+}
+#pragma databank 0
+
+/*
+ * Process anything received on the connection used by dib, and send an
+ * ECHO on it if it has been idle too long.
+ */
+static void KeepAlive(DIB *dib) {
+    static SMB2_ECHO_Request echoRequest = {sizeof(SMB2_ECHO_Request), 0};
+    Connection *connection = dib->session->connection;
+    LongWord now;
+
+    PollConnection(dib);
+
+    now = GetTick();
+    if (now - connection->lastActivityTime > KEEPALIVE_PERIOD
+        && now - connection->keepaliveTime > KEEPALIVE_PERIOD) {
+        connection->keepaliveTime = now;
+        SendOutOfBandRequest(dib, SMB2_ECHO, &echoRequest,
+            sizeof(echoRequest), NULL);
+    }
+}
+
+/*
+ * Check if messages received on connection are being processed in the
+ * background by the keepalive task, so that break notifications will be
+ * handled promptly even while the FST is not being called.
+ */
+bool BreaksHandledInBackground(Connection *connection) {
+    return connection->keepalive && taskPolled
+        && GetTick() - lastPollTime <= BACKGROUND_POLL_TIMEOUT;
+}
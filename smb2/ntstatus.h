@@ -20,6 +20,8 @@
 #define STATUS_SUCCESS 0x00000000
 
 #define STATUS_PENDING 0x00000103
+#define STATUS_NOTIFY_CLEANUP 0x0000010B
+#define STATUS_NOTIFY_ENUM_DIR 0x0000010C
 
 #define STATUS_BUFFER_OVERFLOW 0x80000005
 #define STATUS_NO_MORE_FILES 0x80000006
@@ -44,6 +46,7 @@
 #define STATUS_ILLEGAL_CHARACTER 0xC0000161
 #define STATUS_INSUFF_SERVER_RESOURCES 0xC0000205
 #define STATUS_INSUFFICIENT_RESOURCES 0xC000009A
+#define STATUS_INVALID_DEVICE_REQUEST 0xC0000010
 #define STATUS_INVALID_DEVICE_STATE 0xC0000184
 #define STATUS_INVALID_PARAMETER 0xC000000D
 #define STATUS_IO_TIMEOUT 0xC00000B5
@@ -55,6 +58,7 @@
 #define STATUS_NO_SUCH_FILE 0xC000000F
 #define STATUS_NOT_FOUND 0xC0000225
 #define STATUS_NOT_SAME_DEVICE 0xC00000D4
+#define STATUS_NOT_SUPPORTED 0xC00000BB
 #define STATUS_OBJECT_NAME_COLLISION 0xC0000035
 #define STATUS_OBJECT_NAME_INVALID 0xC0000033
 #define STATUS_OBJECT_NAME_NOT_FOUND 0xC0000034
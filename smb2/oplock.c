@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <gsos.h>
+#include <misctool.h>
+#include <string.h>
+#include "smb2/smb2.h"
+#include "smb2/session.h"
+#include "smb2/oplock.h"
+#include "smb2/keepalive.h"
+#include "gsos/gsosdata.h"
+#include "gsos/gsosutils.h"
+#include "driver/driver.h"
+#include "fst/fstspecific.h"
+#include "helpers/createcontext.h"
+#include "helpers/readahead.h"
+#include "helpers/writebehind.h"
+#include "helpers/dirlist.h"
+
+/*
+ * Oplocks and leases (see [MS-SMB2] sections 3.2.5.19 and 3.3.4.7) tell us
+ * when it is safe to cache data from a file (CACHE_READ) or to defer writes
+ * to it (CACHE_WRITE).  These are used to control read-ahead and
+ * write-behind.
+ *
+ * When another client opens the file, the server breaks the oplock or lease,
+ * and we must acknowledge the break (after flushing any deferred writes, if
+ * write caching is being lost).  Break notifications may arrive while we are
+ * waiting for any response, so they are handled from ReceiveResponse.
+ * The other client's open waits until we acknowledge the break (or the
+ * server times out, which takes about 35 seconds), so we can only hold
+ * write or handle caching if breaks will be handled promptly even while the
+ * FST is not being called, i.e. if the keepalive task is processing them in
+ * the background (see smb2/keepalive.c).  In that case, we request a lease
+ * with read, write, and handle caching if the server supports leases, or a
+ * batch oplock otherwise.  (Handle caching or a batch oplock is required for
+ * the handle to be durable.)  Otherwise, we request only read caching, whose
+ * breaks do not need to be acknowledged.
+ *
+ * Directories can only have leases with read and handle caching, and only
+ * if they are requested with the version 2 lease context, which we use
+ * whenever the server supports directory leasing.  These let us keep
+ * cached directory listings (see helpers/dirlist.c).  The type of a file
+ * is not known before it is opened, so we only ask for a directory lease
+ * when the caller knows it is opening a directory.
+ */
+
+// Number of files with CACHE_BREAK_PENDING set
+unsigned pendingBreakCount = 0;
+
+// Lease key for the next lease requested (incremented for each request)
+static smb_u128 nextLeaseKey = {0, 0};
+
+// Lease key in the most recent lease request
+static smb_u128 requestedLeaseKey;
+
+// Did the last call to RequestCaching request handle caching (or batch)?
+bool handleCachingRequested = false;
+
+/*
+ * Fill in a lease request, using the version 2 context if version2 is true.
+ * Returns the size of the context data.  (The version 1 context data is the
+ * start of the version 2 data.)
+ */
+static uint16_t SetUpLeaseRequest(bool version2,
+    SMB2_CREATE_REQUEST_LEASE_V2_Data *leaseRequest, const smb_u128 *leaseKey,
+    uint32_t leaseState, uint16_t epoch) {
+    leaseRequest->LeaseKey = requestedLeaseKey = *leaseKey;
+    leaseRequest->LeaseState = leaseState;
+    leaseRequest->LeaseFlags = 0;
+    leaseRequest->LeaseDuration = 0;
+    
+    if (!version2)
+        return sizeof(SMB2_CREATE_REQUEST_LEASE_Data);
+    
+    leaseRequest->ParentLeaseKey.hi = 0;
+    leaseRequest->ParentLeaseKey.lo = 0;
+    leaseRequest->Epoch = epoch;
+    leaseRequest->Reserved = 0;
+    return sizeof(SMB2_CREATE_REQUEST_LEASE_V2_Data);
+}
+
+/*
+ * Request an oplock or lease in an otherwise-assembled CREATE request to
+ * open a file.  *msgLen is the length of the request, which is updated.
+ * isDirectory indicates that the file is known to be a directory.
+ */
+void RequestCaching(DIB *dib, uint16_t *msgLen, bool isDirectory) {
+    static SMB2_CREATE_REQUEST_LEASE_V2_Data leaseRequest;
+    uint32_t leaseState;
+    uint16_t leaseSize;
+    bool fullCaching;
+
+    createRequest.RequestedOplockLevel = SMB2_OPLOCK_LEVEL_NONE;
+    handleCachingRequested = false;
+
+    if (dib->flags & FLAG_PIPE_SHARE)
+        return;
+
+    fullCaching = BreaksHandledInBackground(dib->session->connection);
+
+    if (dib->session->connection->leasing) {
+        if (isDirectory && !dib->session->connection->dirLeasing)
+            return;
+
+        if (nextLeaseKey.hi == 0)
+            nextLeaseKey.hi = GetTick() | 0x100000000;
+        nextLeaseKey.lo++;
+        
+        leaseState = SMB2_LEASE_READ_CACHING;
+        if (fullCaching) {
+            leaseState |= SMB2_LEASE_HANDLE_CACHING;
+            if (!isDirectory)
+                leaseState |= SMB2_LEASE_WRITE_CACHING;
+        }
+        leaseSize = SetUpLeaseRequest(dib->session->connection->dirLeasing,
+            &leaseRequest, &nextLeaseKey, leaseState, 0);
+        
+        /*
+         * Durable handles are only requested for files, since reclaiming
+         * one asks for write caching (see RequestReclaimCaching).
+         */
+        if (AddCreateContext(SMB2_CREATE_REQUEST_LEASE, &leaseRequest,
+            leaseSize, msgLen)) {
+            createRequest.RequestedOplockLevel = SMB2_OPLOCK_LEVEL_LEASE;
+            handleCachingRequested = fullCaching && !isDirectory;
+        }
+    } else if (isDirectory) {
+        return;
+    } else if (fullCaching) {
+        createRequest.RequestedOplockLevel = SMB2_OPLOCK_LEVEL_BATCH;
+        handleCachingRequested = true;
+    } else {
+        createRequest.RequestedOplockLevel = SMB2_OPLOCK_LEVEL_II;
+    }
+}
+
+/*
+ * Request the oplock or lease previously held on fcr in an otherwise-
+ * assembled CREATE request to reclaim a durable handle for it.  *msgLen is
+ * the length of the request, which is updated.
+ */
+void RequestReclaimCaching(FCR *fcr, uint16_t *msgLen) {
+    static SMB2_CREATE_REQUEST_LEASE_V2_Data leaseRequest;
+    uint16_t leaseSize;
+
+    if (fcr->cacheFlags & CACHE_LEASE) {
+        leaseSize = SetUpLeaseRequest(fcr->cacheFlags & CACHE_LEASE_V2,
+            &leaseRequest, &fcr->leaseKey,
+            SMB2_LEASE_READ_CACHING | SMB2_LEASE_WRITE_CACHING
+            | SMB2_LEASE_HANDLE_CACHING, fcr->leaseEpoch);
+        
+        createRequest.RequestedOplockLevel = SMB2_OPLOCK_LEVEL_NONE;
+        if (AddCreateContext(SMB2_CREATE_REQUEST_LEASE, &leaseRequest,
+            leaseSize, msgLen)) {
+            createRequest.RequestedOplockLevel = SMB2_OPLOCK_LEVEL_LEASE;
+        }
+    } else {
+        createRequest.RequestedOplockLevel = SMB2_OPLOCK_LEVEL_BATCH;
+    }
+}
+
+/*
+ * Convert a lease state to the corresponding CACHE_* flags.
+ */
+static uint16_t LeaseStateToFlags(uint32_t leaseState) {
+    uint16_t flags = CACHE_LEASE;
+    
+    if (leaseState & SMB2_LEASE_READ_CACHING) {
+        flags |= CACHE_READ;
+        if (leaseState & SMB2_LEASE_WRITE_CACHING)
+            flags |= CACHE_WRITE;
+        if (leaseState & SMB2_LEASE_HANDLE_CACHING)
+            flags |= CACHE_HANDLE;
+    }
+    return flags;
+}
+
+/*
+ * Convert an oplock level to the corresponding CACHE_* flags.
+ */
+static uint16_t OplockLevelToFlags(uint8_t oplockLevel) {
+    switch (oplockLevel) {
+    case SMB2_OPLOCK_LEVEL_BATCH:
+    case SMB2_OPLOCK_LEVEL_EXCLUSIVE:
+        return CACHE_READ | CACHE_WRITE;
+    case SMB2_OPLOCK_LEVEL_II:
+        return CACHE_READ;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Set the caching state of a newly-opened file, based on the oplock or
+ * lease granted in createResponse (for a request made with RequestCaching).
+ */
+void SetGrantedCaching(FCR *fcr) {
+    SMB2_CREATE_REQUEST_LEASE_V2_Data *leaseResponse;
+    uint16_t dataLen;
+
+    fcr->cacheFlags = 0;
+
+    if (createResponse.OplockLevel == SMB2_OPLOCK_LEVEL_LEASE) {
+        leaseResponse = GetCreateContext(SMB2_CREATE_REQUEST_LEASE, &dataLen);
+        if (leaseResponse == NULL
+            || dataLen < sizeof(SMB2_CREATE_REQUEST_LEASE_Data))
+            return;
+        if (memcmp(&leaseResponse->LeaseKey, &requestedLeaseKey,
+            sizeof(smb_u128)) != 0)
+            return;
+        fcr->leaseKey = leaseResponse->LeaseKey;
+        fcr->cacheFlags = LeaseStateToFlags(leaseResponse->LeaseState);
+        
+        // A version 2 response has the epoch to use if it is reclaimed.
+        if (dataLen >= sizeof(SMB2_CREATE_REQUEST_LEASE_V2_Data)) {
+            fcr->cacheFlags |= CACHE_LEASE_V2;
+            fcr->leaseEpoch = leaseResponse->Epoch;
+        }
+    } else {
+        fcr->cacheFlags = OplockLevelToFlags(createResponse.OplockLevel);
+    }
+}
+
+/*
+ * Send an acknowledgment for a break to the state in fcr->breakToState.
+ */
+static void SendBreakAck(FCR *fcr, DIB *dib) {
+    static union {
+        SMB2_OPLOCK_BREAK_Acknowledgment oplock;
+        SMB2_LEASE_BREAK_Acknowledgment lease;
+    } ack;
+
+    if (fcr->cacheFlags & CACHE_LEASE) {
+        ack.lease.StructureSize = sizeof(ack.lease);
+        ack.lease.Reserved = 0;
+        ack.lease.Flags = 0;
+        ack.lease.LeaseKey = fcr->leaseKey;
+        ack.lease.LeaseState = fcr->breakToState;
+        ack.lease.LeaseDuration = 0;
+        SendOutOfBandRequest(dib, SMB2_OPLOCK_BREAK, &ack, sizeof(ack.lease),
+            NULL);
+    } else {
+        ack.oplock.StructureSize = sizeof(ack.oplock);
+        ack.oplock.OplockLevel = fcr->breakToState;
+        ack.oplock.Reserved = 0;
+        ack.oplock.Reserved2 = 0;
+        ack.oplock.FileId = fcr->fileID;
+        SendOutOfBandRequest(dib, SMB2_OPLOCK_BREAK, &ack, sizeof(ack.oplock),
+            NULL);
+    }
+}
+
+/*
+ * Find the open file (and its DIB) that a break notification in msg is for.
+ * Returns false if there is no such file.
+ */
+static bool FindBreakFCR(Connection *connection, FCR **fcrPtr, DIB **dibPtr) {
+    VCR *vcr;
+    FCR *fcr;
+    unsigned i, j;
+    bool isLease =
+        msgBodyHeader.StructureSize == sizeof(SMB2_LEASE_BREAK_Notification);
+
+    for (j = 0; j < NDIBS; j++) {
+        if (dibs[j].extendedDIBPtr == 0
+            || dibs[j].session->connection != connection)
+            continue;
+        if (GetVCR(&dibs[j], &vcr) != 0 || vcr->openCount == 0)
+            continue;
+        
+        for (i = 1; (fcr = GetFCR(i)) != NULL; i++) {
+            if (fcr->volID != vcr->id || fcr->fstID != smbFSID)
+                continue;
+            
+            if (isLease) {
+                if (!(fcr->cacheFlags & CACHE_LEASE))
+                    continue;
+                if (memcmp(&fcr->leaseKey,
+                    &((SMB2_LEASE_BREAK_Notification*)msg.body)->LeaseKey,
+                    sizeof(smb_u128)) != 0)
+                    continue;
+            } else {
+                if (fcr->cacheFlags & CACHE_LEASE)
+                    continue;
+                if (memcmp(&fcr->fileID,
+                    &((SMB2_OPLOCK_BREAK_Notification*)msg.body)->FileId,
+                    sizeof(SMB2_FILEID)) != 0)
+                    continue;
+            }
+            
+            *fcrPtr = fcr;
+            *dibPtr = &dibs[j];
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/*
+ * Handle an oplock or lease break notification, which is in msg.
+ *
+ * If write caching is being lost and the file has deferred writes, the
+ * acknowledgment is deferred until they have been flushed, which is done
+ * by ProcessPendingBreaks at the end of the current GS/OS call (or run of
+ * the keepalive task).  Otherwise, it is sent right away.
+ */
+void HandleBreakNotification(Connection *connection) {
+    SMB2_LEASE_BREAK_Notification *leaseBreak;
+    FCR *fcr;
+    DIB *dib;
+    uint16_t newFlags;
+    bool ackRequired;
+
+    if (msgBodyHeader.StructureSize == sizeof(SMB2_LEASE_BREAK_Notification)) {
+        if (bodySize < sizeof(SMB2_LEASE_BREAK_Notification))
+            return;
+    } else if (msgBodyHeader.StructureSize
+        == sizeof(SMB2_OPLOCK_BREAK_Notification)) {
+        if (bodySize < sizeof(SMB2_OPLOCK_BREAK_Notification))
+            return;
+    } else {
+        return;
+    }
+
+    // Breaks may be sent on an additional channel of the session.
+    if (connection->primary != NULL)
+        connection = connection->primary;
+
+    if (msgBodyHeader.StructureSize == sizeof(SMB2_LEASE_BREAK_Notification)
+        && HandleDirListingBreak(connection))
+        return;
+
+    if (!FindBreakFCR(connection, &fcr, &dib))
+        return;
+    
+    if (fcr->cacheFlags & CACHE_LEASE) {
+        leaseBreak = (SMB2_LEASE_BREAK_Notification*)msg.body;
+        newFlags = LeaseStateToFlags(leaseBreak->NewLeaseState)
+            | (fcr->cacheFlags & CACHE_LEASE_V2);
+        if (fcr->cacheFlags & CACHE_LEASE_V2)
+            fcr->leaseEpoch = leaseBreak->NewEpoch;
+        fcr->breakToState = leaseBreak->NewLeaseState;
+        ackRequired =
+            leaseBreak->Flags & SMB2_NOTIFY_BREAK_LEASE_FLAG_ACK_REQUIRED;
+    } else {
+        fcr->breakToState =
+            ((SMB2_OPLOCK_BREAK_Notification*)msg.body)->OplockLevel;
+        newFlags = OplockLevelToFlags(fcr->breakToState);
+        // Breaks from level II oplocks are not acknowledged.
+        ackRequired = fcr->cacheFlags & CACHE_WRITE;
+    }
+    
+    if (!(newFlags & CACHE_READ))
+        InvalidateReadAhead(fcr);
+
+    if (ackRequired && fcr->writeBehindLength != 0
+        && !(newFlags & CACHE_WRITE)) {
+        if (!(fcr->cacheFlags & CACHE_BREAK_PENDING))
+            pendingBreakCount++;
+        fcr->cacheFlags = newFlags | CACHE_BREAK_PENDING;
+        return;
+    }
+    
+    if (fcr->cacheFlags & CACHE_BREAK_PENDING)
+        pendingBreakCount--;
+    fcr->cacheFlags = newFlags;
+    if (ackRequired)
+        SendBreakAck(fcr, dib);
+}
+
+/*
+ * Flush deferred writes for files with pending breaks, and then acknowledge
+ * the breaks.  This is called at the end of each GS/OS call if there are
+ * any pending breaks, and by the keepalive task (see smb2/keepalive.c).
+ */
+void ProcessPendingBreaks(void) {
+    VCR *vcr;
+    FCR *fcr;
+    unsigned i, j;
+
+    for (j = 0; j < NDIBS && pendingBreakCount != 0; j++) {
+        if (dibs[j].extendedDIBPtr == 0)
+            continue;
+        if (GetVCR(&dibs[j], &vcr) != 0 || vcr->openCount == 0)
+            continue;
+        
+        for (i = 1; (fcr = GetFCR(i)) != NULL; i++) {
+            if (fcr->volID != vcr->id || fcr->fstID != smbFSID
+                || !(fcr->cacheFlags & CACHE_BREAK_PENDING))
+                continue;
+            
+            /*
+             * If the flush fails, the data stays buffered, but we still
+             * acknowledge the break (the server would otherwise time out
+             * and revoke the oplock or lease anyway).
+             */
+            FlushWriteBehind(fcr, &dibs[j]);
+            
+            fcr->cacheFlags &= ~CACHE_BREAK_PENDING;
+            pendingBreakCount--;
+            SendBreakAck(fcr, &dibs[j]);
+        }
+    }
+}
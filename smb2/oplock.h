@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OPLOCK_H
+#define OPLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <types.h>
+#include "smb2/connection.h"
+#include "gsos/gsosdata.h"
+#include "driver/driver.h"
+
+extern unsigned pendingBreakCount;
+extern bool handleCachingRequested;
+
+void RequestCaching(DIB *dib, uint16_t *msgLen, bool isDirectory);
+void RequestReclaimCaching(FCR *fcr, uint16_t *msgLen);
+void SetGrantedCaching(FCR *fcr);
+void HandleBreakNotification(Connection *connection);
+void ProcessPendingBreaks(void);
+
+#endif
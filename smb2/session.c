@@ -24,6 +24,7 @@
 #include "smb2/session.h"
 #include "smb2/connection.h"
 #include "smb2/treeconnect.h"
+#include "smb2/channel.h"
 #include "utils/alloc.h"
 #include "smb2/smb2.h"
 #include "auth/auth.h"
@@ -44,6 +45,8 @@ void Session_Release(Session *sess) {
         SendRequestAndGetResponse(&fakeDIB, SMB2_LOGOFF, sizeof(logoffRequest));
         // ignore errors from logoff
 
+        DropChannel(sess);
+
         smb_free(sess->signingContext);
 
         Connection_Release(sess->connection);
@@ -70,8 +73,13 @@ Session *Session_Alloc(void) {
  * Perform the SMB2 SESSION_SETUP negotiation with the server.
  * session->connection and session->authInfo should be initialized before
  * calling this function.  Returns an error code, or 0 for success.
+ *
+ * If binding is true, session is a copy of an established signed session,
+ * with connection set to an additional channel (see smb2/channel.c).  The
+ * session is bound to that channel, and signingContext is replaced with
+ * one for the channel.
  */
-Word SessionSetup(Session *session) {
+static Word DoSessionSetup(Session *session, bool binding) {
     static ReadStatus result;
     static AuthState authState;
     static size_t authSize;
@@ -80,27 +88,33 @@ Word SessionSetup(Session *session) {
     static unsigned char cmac_key[16];
     static uint64_t previousSessionId;
     
-    previousSessionId = session->sessionId;
-    session->sessionId = 0;
+    if (binding) {
+        // Binding requests are signed with the existing session's key.
+        previousSessionId = 0;
+    } else {
+        previousSessionId = session->sessionId;
+        session->sessionId = 0;
+
+        smb_free(session->signingContext);
+        session->signingContext = NULL;
+    }
 
     InitAuth(&authState, &session->authInfo);
     previousAuthMsg = NULL;
     previousAuthSize = 0;
 
-    smb_free(session->signingContext);
-    session->signingContext = NULL;
-
     while (1) {
         authSize = DoAuthStep(&authState, previousAuthMsg,
             previousAuthSize, sessionSetupRequest.Buffer,
             sizeof(msg.body) - sizeof(sessionSetupRequest));
         if (authSize == (size_t)-1) {
             // TODO handle errors
-            session->sessionId = previousSessionId;
+            if (!binding)
+                session->sessionId = previousSessionId;
             return networkError;
         }
 
-        sessionSetupRequest.Flags = 0;
+        sessionSetupRequest.Flags = binding ? SMB2_SESSION_FLAG_BINDING : 0;
         sessionSetupRequest.SecurityMode = SMB2_NEGOTIATE_SIGNING_ENABLED;
         sessionSetupRequest.Capabilities = 0;
         sessionSetupRequest.Channel = 0;
@@ -114,7 +128,7 @@ Word SessionSetup(Session *session) {
             sizeof(sessionSetupRequest) + authSize);
         
         if (result == rsDone) {
-            if (session->connection->wantSigning &&
+            if ((binding || session->connection->wantSigning) &&
                 (sessionSetupResponse.SessionFlags &
                     (SMB2_SESSION_FLAG_IS_GUEST|SMB2_SESSION_FLAG_IS_NULL)) == 0)
             {
@@ -123,7 +137,8 @@ Word SessionSetup(Session *session) {
                     sizeof(struct hmac_sha256_context) :
                     sizeof(struct aes_cmac_context));
                 if (session->signingContext == NULL) {
-                    session->sessionId = previousSessionId;
+                    if (!binding)
+                        session->sessionId = previousSessionId;
                     return outOfMem;
                 }
                 
@@ -161,7 +176,8 @@ Word SessionSetup(Session *session) {
                 sessionSetupResponse.SecurityBufferOffset,
                 sessionSetupResponse.SecurityBufferLength)) {
                 // TODO clean up on errors?
-                session->sessionId = previousSessionId;
+                if (!binding)
+                    session->sessionId = previousSessionId;
                 return networkError;
             }
             
@@ -172,12 +188,24 @@ Word SessionSetup(Session *session) {
             previousAuthSize = sessionSetupResponse.SecurityBufferLength;
         } else {
             // TODO clean up on errors?
-            session->sessionId = previousSessionId;
+            if (!binding)
+                session->sessionId = previousSessionId;
             return invalidAccess;
         }
     };
 }
 
+Word SessionSetup(Session *session) {
+    return DoSessionSetup(session, false);
+}
+
+/*
+ * Bind an additional channel to a session.  See DoSessionSetup.
+ */
+Word BindSession(Session *session) {
+    return DoSessionSetup(session, true);
+}
+
 Word Session_Reconnect(Session *session) {
     Word result, result2;
     unsigned i;
@@ -185,12 +213,18 @@ Word Session_Reconnect(Session *session) {
     if (!session->established)
         return false;
 
+    // The additional channel (if any) was bound to the old session.
+    DropChannel(session);
+
     session->signingRequired = false;
     
     result = SessionSetup(session);
     if (result != 0)
         return result;
 
+    if (session->connection->wantChannel)
+        AddChannel(session);
+
     for (i = 0; i < NDIBS; i++) {
         if (dibs[i].extendedDIBPtr != NULL && dibs[i].session == session) {
             result2 = TreeConnect_Reconnect(&dibs[i]);
@@ -42,6 +42,9 @@ typedef struct {
     AuthInfo authInfo;
     
     bool established;
+
+    // Additional channel bound to the session, or NULL (see smb2/channel.c)
+    struct Channel *channel;
 } Session;
 
 extern Session sessions[NDIBS];
@@ -50,6 +53,7 @@ void Session_Retain(Session *sess);
 void Session_Release(Session *sess);
 Session *Session_Alloc(void);
 Word SessionSetup(Session *session);
+Word BindSession(Session *session);
 Word Session_Reconnect(Session *session);
 
 #endif
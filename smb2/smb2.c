@@ -27,6 +27,9 @@
 #include "smb2/connection.h"
 #include "smb2/session.h"
 #include "smb2/treeconnect.h"
+#include "smb2/oplock.h"
+#include "smb2/changenotify.h"
+#include "smb2/tuning.h"
 #include "utils/endian.h"
 #include "smb2/smb2proto.h"
 #include "smb2/smb2.h"
@@ -104,6 +107,9 @@ static uint8_t fileIdOffsets[SMB2_OPLOCK_BREAK + 1];
 
 #define SMB2_ERROR_RESPONSE_STRUCTURE_SIZE 9u
 
+// Max body size for messages sent by SendOutOfBandRequest
+#define OOB_BODY_SIZE 48
+
 // Position for next message to be enqueued
 SMB2Message *nextMsg = (SMB2Message *)&msg.smb2Header;
 
@@ -113,12 +119,17 @@ static SMB2Message *lastMsg = NULL;
 // Total length of data enqueued to send
 static uint16_t sendLength = 0;
 
-// Maximum number of messages that we allow to be compounded
-#define MAX_COMPOUND_SIZE 3
-
 // Message number to use for next message enqueued
 static uint16_t nextMessageNum = 0;
 
+/*
+ * Data to be sent following the last message enqueued, if sendDataLength
+ * is non-zero.  This allows the data for a WRITE to be sent directly from
+ * the caller's buffer, and to be larger than the space available in msg.
+ */
+static const unsigned char *sendDataBuffer = NULL;
+static uint32_t sendDataLength = 0;
+
 // Message IDs and commands for last set of messages enqueued/sent
 static uint64_t msgIDs[MAX_COMPOUND_SIZE];
 static uint16_t msgCommands[MAX_COMPOUND_SIZE];
@@ -126,9 +137,34 @@ static uint16_t msgCommands[MAX_COMPOUND_SIZE];
 // Block from retrying a send (because message has been overwritten)?
 bool blockRetry = false;
 
+/*
+ * Count of break notifications and change notifications handled while
+ * waiting for responses (used to discard round-trip time samples that
+ * include the time spent handling them).
+ */
+static uint16_t notificationsHandled = 0;
+
+/*
+ * Requests that have been sent, but whose responses have not yet been
+ * returned to the caller.  The server may complete requests in a different
+ * order than they were sent, so a response may arrive while we are waiting
+ * for another one.  In that case, it is held here until it is asked for.
+ */
+typedef struct {
+    Connection *connection;     // NULL if entry is unused
+    uint64_t messageId;
+    unsigned char *response;    // response received (header + body), or NULL
+    uint16_t responseSize;
+} OutstandingRequest;
+
+#define MAX_OUTSTANDING_REQUESTS (MAX_COMPOUND_SIZE + 8)
+
+static OutstandingRequest outstanding[MAX_OUTSTANDING_REQUESTS];
+
 #define MIN_RECONNECT_TIME 5 /* seconds */
 
 static bool Reconnect(DIB *dib);
+static void InitHeader(DIB *dib, SMB2Message *message, uint16_t command);
 
 GUID clientGUID = {0};
 
@@ -147,6 +183,140 @@ ReconnectInfo reconnectInfo;
 static uint16_t sentCommand;
 static uint16_t sentNextCommand;
 
+/*
+ * If readDataBuffer is non-null, the data from a successful response to the
+ * next READ request enqueued is read directly into it, rather than into msg.
+ * This allows for reads larger than IO_BUFFER_SIZE, and avoids copying the
+ * data into place afterward.  readDataBufferSize is the size of the buffer.
+ * The response is identified by the connection and MessageId of the request
+ * (readDataConnection and readDataMessageId), so responses to other READ
+ * requests are never put in the buffer.
+ *
+ * Alternatively, readDataTargets may point to an array of readDataTargetCount
+ * entries, giving the buffer to use for each of several outstanding READ
+ * requests, identified by connection and MessageId.
+ *
+ * When the data is read into one of these buffers, readResponse.DataLength
+ * gives its length, and readResponse.DataOffset is set to 0.
+ */
+unsigned char *readDataBuffer = NULL;
+uint32_t readDataBufferSize;
+static Connection *readDataConnection = NULL;
+static uint64_t readDataMessageId;
+ReadDataTarget *readDataTargets = NULL;
+unsigned readDataTargetCount;
+
+/*
+ * Read the remainder of a READ response, putting the data in dataBuffer
+ * (which has space for dataBufferSize bytes).  On entry, the SMB2 header
+ * has been read and msgSize is the message size.
+ *
+ * If dataBuffer is NULL, the data is read and discarded, and
+ * readResponse.DataLength is set to 0 so the response will not be used.
+ */
+static ReadStatus ReadDataResponse(Connection *connection, uint32_t msgSize,
+    unsigned char *dataBuffer, uint32_t dataBufferSize) {
+    ReadStatus result;
+    uint16_t size;
+    uint32_t dataEnd;
+    uint32_t remainingSize;
+    unsigned char *dataPtr;
+
+    size = offsetof(SMB2_READ_Response, Buffer);
+    if (msgSize < sizeof(SMB2Header) + size)
+        return rsBadMsg;
+    result = ReadTCP(connection, size, &msg.body);
+    if (result != rsDone)
+        return rsBadMsg;
+    bodySize = size;
+
+    if (readResponse.StructureSize != 17
+        || readResponse.DataLength > dataBufferSize)
+        return rsBadMsg;
+    
+    // Read any padding before the data
+    if (readResponse.DataLength != 0) {
+        if (readResponse.DataOffset < sizeof(SMB2Header) + bodySize)
+            return rsBadMsg;
+        size = readResponse.DataOffset - sizeof(SMB2Header) - bodySize;
+        dataEnd = readResponse.DataOffset + readResponse.DataLength;
+    } else {
+        size = 0;
+        dataEnd = sizeof(SMB2Header) + bodySize;
+    }
+    if (dataEnd > msgSize)
+        return rsBadMsg;
+    if (size != 0) {
+        result = ReadTCP(connection, size, msg.body + bodySize);
+        if (result != rsDone)
+            return rsBadMsg;
+        bodySize += size;
+    }
+
+    // Read the data itself, in pieces of up to 32K
+    dataPtr = dataBuffer;
+    remainingSize = readResponse.DataLength;
+    while (remainingSize != 0) {
+        size = min(remainingSize, 0x8000);
+        if (dataBuffer == NULL) {
+            size = min(size, sizeof(msg.body) - bodySize);
+            if (size == 0)
+                return rsBadMsg;
+            result = ReadTCP(connection, size, msg.body + bodySize);
+        } else {
+            result = ReadTCP(connection, size, dataPtr);
+            dataPtr += size;
+        }
+        if (result != rsDone)
+            return rsBadMsg;
+        remainingSize -= size;
+    }
+    if (dataBuffer == NULL)
+        readResponse.DataLength = 0;
+    
+    // Read anything after the data (not normally present)
+    remainingSize = msgSize - dataEnd;
+    if (remainingSize > sizeof(msg.body) - bodySize)
+        return rsBadMsg;
+    if (remainingSize != 0) {
+        result = ReadTCP(connection, remainingSize, msg.body + bodySize);
+        if (result != rsDone)
+            return rsBadMsg;
+    }
+    
+    readResponse.DataOffset = 0;
+    return rsDone;
+}
+
+/*
+ * Update credit accounting based on the header of a message received.
+ */
+static void UpdateCredits(Connection *connection) {
+    uint16_t charge;
+
+    connection->credits += msg.smb2Header.CreditResponse;
+    
+    /*
+     * The credits charged for a request are released when its final response
+     * is received.  Interim responses and oplock/lease break notifications
+     * do not complete a request.
+     */
+    if (msg.smb2Header.MessageId == 0xFFFFFFFFFFFFFFFF)
+        return;
+    if (msg.smb2Header.Status == STATUS_PENDING
+        && (msg.smb2Header.Flags & SMB2_FLAGS_ASYNC_COMMAND))
+        return;
+    
+    charge = msg.smb2Header.CreditCharge;
+    if (charge == 0 || connection->dialect == SMB_202)
+        charge = 1;
+    if (connection->creditsInFlight >= charge) {
+        connection->creditsInFlight -= charge;
+    } else {
+        connection->creditsInFlight = 0;
+    }
+}
+
 /*
  * Read an SMB2 protocol message from the connection.
  * On success, the message is left in msg.smb2Header and msg.body.
@@ -154,6 +324,7 @@ static uint16_t sentNextCommand;
 static ReadStatus ReadMessage(Connection *connection) {
     ReadStatus result;
     uint32_t msgSize;
+    unsigned i;
     
     if (connection->remainingCompoundSize == 0) {
         result =
@@ -195,8 +366,7 @@ static ReadStatus ReadMessage(Connection *connection) {
     if (msg.smb2Header.StructureSize != 64)
         return rsBadMsg;
 
-    if (msgSize > sizeof(SMB2Header) + sizeof(msg.body))
-        return rsBadMsg;
+    UpdateCredits(connection);
 
     // Consider a deleted/expired session to be a protocol-level failure
     if (msg.smb2Header.Status != 0) {
@@ -205,6 +375,39 @@ static ReadStatus ReadMessage(Connection *connection) {
             return rsBadMsg;
     }
 
+    if (msg.smb2Header.Command == SMB2_READ
+        && msg.smb2Header.Status == STATUS_SUCCESS
+        && (msg.smb2Header.Flags & SMB2_FLAGS_SERVER_TO_REDIR)) {
+        if (readDataBuffer != NULL
+            && readDataMessageId == msg.smb2Header.MessageId
+            && readDataConnection == connection) {
+            blockRetry = true;
+            return ReadDataResponse(connection, msgSize,
+                readDataBuffer, readDataBufferSize);
+        }
+        for (i = 0; i < readDataTargetCount && readDataTargets != NULL; i++) {
+            if (readDataTargets[i].messageId == msg.smb2Header.MessageId
+                && readDataTargets[i].connection == connection) {
+                blockRetry = true;
+                return ReadDataResponse(connection, msgSize,
+                    readDataTargets[i].buffer, readDataTargets[i].size);
+            }
+        }
+
+        /*
+         * A response that is too big for msg and has no buffer set up for it
+         * (e.g. one to an abandoned pipelined request) is read and discarded,
+         * so that the following messages can still be received.
+         */
+        if (msgSize > sizeof(SMB2Header) + sizeof(msg.body)) {
+            blockRetry = true;
+            return ReadDataResponse(connection, msgSize, NULL, 0xFFFFFFFF);
+        }
+    }
+
+    if (msgSize > sizeof(SMB2Header) + sizeof(msg.body))
+        return rsBadMsg;
+
     blockRetry = true;
 
     result = ReadTCP(connection, msgSize - sizeof(SMB2Header), &msg.body);
@@ -216,6 +419,135 @@ static ReadStatus ReadMessage(Connection *connection) {
     return rsDone;
 }
 
+/*
+ * Free an entry in the outstanding request table.
+ */
+static void RemoveOutstanding(OutstandingRequest *request) {
+    if (request->response != NULL) {
+        smb_free(request->response);
+        request->response = NULL;
+    }
+    request->connection = NULL;
+}
+
+/*
+ * Find the outstanding request with the specified MessageId, if any.
+ */
+static OutstandingRequest *FindOutstanding(Connection *connection,
+    uint64_t messageId) {
+    unsigned i;
+    
+    for (i = 0; i < MAX_OUTSTANDING_REQUESTS; i++) {
+        if (outstanding[i].connection == connection
+            && outstanding[i].messageId == messageId)
+            return &outstanding[i];
+    }
+    return NULL;
+}
+
+/*
+ * Record a request as outstanding.  If the table is full, the request with
+ * the lowest MessageId is dropped from it (its response will be discarded
+ * if it arrives later).  This only happens if a caller has not received
+ * all the responses for the requests it sent.
+ */
+static void AddOutstanding(Connection *connection, uint64_t messageId) {
+    OutstandingRequest *request = NULL;
+    unsigned i;
+    
+    for (i = 0; i < MAX_OUTSTANDING_REQUESTS; i++) {
+        if (outstanding[i].connection == NULL) {
+            request = &outstanding[i];
+            break;
+        }
+        if (request == NULL || outstanding[i].messageId < request->messageId)
+            request = &outstanding[i];
+    }
+    
+    RemoveOutstanding(request);
+    request->connection = connection;
+    request->messageId = messageId;
+}
+
+/*
+ * Check if any requests sent on a connection are still awaiting responses.
+ * While this is true, PollConnection does not process messages on it.
+ */
+bool HaveOutstanding(Connection *connection) {
+    unsigned i;
+    
+    for (i = 0; i < MAX_OUTSTANDING_REQUESTS; i++) {
+        if (outstanding[i].connection == connection
+            && outstanding[i].response == NULL)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Forget all outstanding requests on a connection (when reconnecting or
+ * dropping it).
+ */
+void ClearOutstanding(Connection *connection) {
+    unsigned i;
+    
+    for (i = 0; i < MAX_OUTSTANDING_REQUESTS; i++) {
+        if (outstanding[i].connection == connection)
+            RemoveOutstanding(&outstanding[i]);
+    }
+}
+
+/*
+ * Deal with a response in msg that is not the one currently being waited
+ * for.  If it is the final response to another outstanding request, it is
+ * held until that response is asked for.  Interim responses and responses
+ * to requests that are no longer outstanding are discarded.
+ *
+ * Returns false if the message cannot be a response to any request we sent,
+ * or if there is not enough memory to hold it.
+ */
+static bool HoldResponse(Connection *connection) {
+    OutstandingRequest *request;
+    uint16_t size;
+    
+    request = FindOutstanding(connection, msg.smb2Header.MessageId);
+    if (request == NULL)
+        return msg.smb2Header.MessageId < connection->nextMessageId;
+
+    if (msg.smb2Header.Status == STATUS_PENDING
+        && (msg.smb2Header.Flags & SMB2_FLAGS_ASYNC_COMMAND))
+        return true;
+    
+    if (request->response != NULL)
+        return false;
+    
+    size = sizeof(SMB2Header) + bodySize;
+    request->response = smb_malloc(size);
+    if (request->response == NULL)
+        return false;
+    memcpy(request->response, &msg.smb2Header, size);
+    request->responseSize = size;
+    return true;
+}
+
+/*
+ * If a response for the specified request has already been received and
+ * held, put it back in msg and return true.  Otherwise, return false.
+ */
+static bool TakeHeldResponse(Connection *connection, uint64_t messageId) {
+    OutstandingRequest *request;
+
+    request = FindOutstanding(connection, messageId);
+    if (request == NULL || request->response == NULL)
+        return false;
+    
+    memcpy(&msg.smb2Header, request->response, request->responseSize);
+    bodySize = request->responseSize - sizeof(SMB2Header);
+    blockRetry = true;
+    RemoveOutstanding(request);
+    return true;
+}
+
 /*
  * Check if there is space available in the buffer for another message with
  * the specified body length.  If there is not, any already-buffered messages
@@ -223,21 +555,66 @@ static ReadStatus ReadMessage(Connection *connection) {
  */
 bool SpaceAvailable(uint16_t bodyLength) {
     if (msg.body + sizeof(msg.body) - (unsigned char *)nextMsg
-        < sizeof(SMB2Header) + bodyLength) {
+        < sizeof(SMB2Header) + bodyLength
+        || nextMessageNum >= MAX_COMPOUND_SIZE) {
         ResetSendStatus();
         return false;
     }
     return true;
 }
 
+/*
+ * Check if count more messages, with bodies totaling bodyLength bytes, can
+ * be added to the compound chain being assembled without running out of
+ * buffer space or exceeding the credits available.  Unlike SpaceAvailable,
+ * this does not clear the buffered messages, so it can be used to decide
+ * whether to add optional requests to a chain.
+ */
+bool CanAddToCompound(DIB *dib, uint16_t count, uint16_t bodyLength) {
+    uint16_t creditsNeeded;
+
+    if (msg.body + sizeof(msg.body) - (unsigned char *)nextMsg
+        < (int32_t)(count * (sizeof(SMB2Header) + 7) + bodyLength))
+        return false;
+    if (nextMessageNum + count > MAX_COMPOUND_SIZE)
+        return false;
+    
+    /*
+     * Earlier messages in the chain have already consumed their credits.
+     * The first message is always allowed, as for non-compounded requests.
+     */
+    creditsNeeded = nextMessageNum == 0 ? count - 1 : count;
+    if (dib->session->connection->credits < creditsNeeded)
+        return false;
+    return true;
+}
+
+/*
+ * Compute the number of credits consumed by a request.  This depends on
+ * the amount of data that it transfers: one credit per 64K or part thereof.
+ */
+static uint16_t CreditCharge(uint16_t command, unsigned char *body) {
+    uint32_t payloadSize;
+    
+    if (command == SMB2_READ) {
+        payloadSize = ((SMB2_READ_Request*)body)->Length;
+    } else if (command == SMB2_WRITE) {
+        payloadSize = ((SMB2_WRITE_Request*)body)->Length;
+    } else {
+        return 1;
+    }
+    
+    if (payloadSize == 0)
+        return 1;
+    return (payloadSize - 1) / 0x10000 + 1;
+}
+
 /*
  * Enqueue a SMB2 request message to be sent later.
  * If multiple messages are enqueued, they are compounded as related requests.
  * Returns a message number that can be used to get the response.
  */
 unsigned EnqueueRequest(DIB *dib, uint16_t command, uint16_t bodyLength) {
-    Session *session = dib->session;
-    Connection *connection = session->connection;
     SMB2Header *header = &nextMsg->Header;
 
     if (lastMsg != NULL) {
@@ -250,14 +627,53 @@ unsigned EnqueueRequest(DIB *dib, uint16_t command, uint16_t bodyLength) {
         header->Flags = 0;
     }
     
+    InitHeader(dib, nextMsg, command);
+    
+    ((SMB2_Common_Header*)nextMsg->Body)->StructureSize =
+        requestStructureSizes[command];
+
+    /*
+     * Pad body to at least equal structure size (required by Windows).
+     * If separate data will follow the message, it serves as the padding.
+     */
+    if (bodyLength < requestStructureSizes[command] && sendDataLength == 0)
+        nextMsg->Body[bodyLength++] = 0;
+
+    sendLength = ((sendLength + 7) & 0xfff8) + sizeof(SMB2Header) + bodyLength;
+    lastMsg = nextMsg;
+    
+    nextMsg = (void*)((char*)&msg.smb2Header + ((sendLength + 7) & 0xfff8));
+    
+    msgIDs[nextMessageNum] = header->MessageId;
+    msgCommands[nextMessageNum] = command;
+    
+    // Note which request the data in readDataBuffer should come from.
+    if (command == SMB2_READ && readDataBuffer != NULL) {
+        readDataConnection = dib->session->connection;
+        readDataMessageId = header->MessageId;
+    }
+    return nextMessageNum++;
+}
+
+/*
+ * Fill in the header of a request message (other than the Flags field),
+ * and do credit accounting for it.  The body must already be filled in.
+ */
+static void InitHeader(DIB *dib, SMB2Message *message, uint16_t command) {
+    Session *session = dib->session;
+    Connection *connection = session->connection;
+    SMB2Header *header = &message->Header;
+    uint16_t charge;
+    uint16_t window;
+
     header->ProtocolId = 0x424D53FE;
     header->StructureSize = 64;
 
+    charge = CreditCharge(command, message->Body);
     if (connection->dialect == SMB_202) {
         header->CreditCharge = 0;
     } else {
-        // Our messages are always < 64K, so CreditCharge is just 1.
-        header->CreditCharge = 1;
+        header->CreditCharge = charge;
     }
     
     // Note: In SMB 3.x, this is actually ChannelSequence + Reserved.
@@ -265,12 +681,22 @@ unsigned EnqueueRequest(DIB *dib, uint16_t command, uint16_t bodyLength) {
     
     header->Command = command;
     
-    if (command == SMB2_TREE_CONNECT && !connection->requestedCredits) {
-        header->CreditRequest = MAX_COMPOUND_SIZE;
-        connection->requestedCredits = true;
+    /*
+     * Ask for credits to replace the ones this request consumes, plus enough
+     * more to bring the credit window up to our target.
+     */
+    window = connection->credits + connection->creditsInFlight;
+    if (window < connection->creditTarget) {
+        header->CreditRequest = charge + (connection->creditTarget - window);
     } else {
-        header->CreditRequest = 1;
+        header->CreditRequest = charge;
     }
+    if (connection->credits >= charge) {
+        connection->credits -= charge;
+    } else {
+        connection->credits = 0;
+    }
+    connection->creditsInFlight += charge;
 
     header->NextCommand = 0;
     header->MessageId = connection->nextMessageId++;
@@ -278,22 +704,45 @@ unsigned EnqueueRequest(DIB *dib, uint16_t command, uint16_t bodyLength) {
     header->TreeId = dib->treeId;
     header->SessionId = session->sessionId;
     header->Signature = u128_zero;
-    
-    ((SMB2_Common_Header*)nextMsg->Body)->StructureSize =
-        requestStructureSizes[command];
-
-    // Pad body to at least equal structure size (required by Windows).
-    if (bodyLength < requestStructureSizes[command])
-        nextMsg->Body[bodyLength++] = 0;
+}
 
-    sendLength = ((sendLength + 7) & 0xfff8) + sizeof(SMB2Header) + bodyLength;
-    lastMsg = nextMsg;
-    
-    nextMsg = (void*)((char*)&msg.smb2Header + ((sendLength + 7) & 0xfff8));
+/*
+ * Sign a message.  msgLen is its length, not including any separate data
+ * that follows it.  If dataLength is non-zero, the signature also covers
+ * that many bytes of data from dataBuffer, which will be sent right after
+ * the message.  signingBuf is scratch space for the signing context.
+ */
+static void SignMessage(Session *session, SMB2Message *message,
+    uint16_t msgLen, const unsigned char *dataBuffer, uint32_t dataLength,
+    void *signingBuf) {
     
-    msgIDs[nextMessageNum] = header->MessageId;
-    msgCommands[nextMessageNum] = command;
-    return nextMessageNum++;
+    message->Header.Flags |= SMB2_FLAGS_SIGNED;
+
+    if (session->connection->dialect <= SMB_21) {
+        memcpy(signingBuf, session->signingContext,
+            sizeof(struct hmac_sha256_context));
+        hmac_sha256_update((struct hmac_sha256_context*)signingBuf,
+            (void*)message, msgLen);
+        if (dataLength != 0) {
+            hmac_sha256_update((struct hmac_sha256_context*)signingBuf,
+                (void*)dataBuffer, dataLength);
+        }
+        hmac_sha256_finalize((struct hmac_sha256_context*)signingBuf);
+        memcpy(&message->Header.Signature,
+            hmac_sha256_result((struct hmac_sha256_context*)signingBuf), 16);
+    } else {
+        memcpy(signingBuf, session->signingContext,
+            sizeof(struct aes_cmac_context));
+        aes_cmac_update((struct aes_cmac_context*)signingBuf,
+            (void*)message, msgLen);
+        if (dataLength != 0) {
+            aes_cmac_update((struct aes_cmac_context*)signingBuf,
+                (void*)dataBuffer, dataLength);
+        }
+        aes_cmac_finalize((struct aes_cmac_context*)signingBuf);
+        memcpy(&message->Header.Signature,
+            ((struct aes_cmac_context*)signingBuf)->ctx.data, 16);
+    }
 }
 
 /*
@@ -306,6 +755,7 @@ bool SendMessages(DIB *dib) {
     uint16_t msgLen;
     uint16_t remainingLen;
     Word tcperr;
+    unsigned i;
 
     if (session->signingRequired) {
         message = (SMB2Message *)&msg.smb2Header;
@@ -318,22 +768,15 @@ bool SendMessages(DIB *dib) {
                 msgLen = remainingLen;
             }
 
-            message->Header.Flags |= SMB2_FLAGS_SIGNED;
-            
-            if (connection->dialect <= SMB_21) {
-                memcpy(gbuf, session->signingContext,
-                    sizeof(struct hmac_sha256_context));
-                hmac_sha256_compute((struct hmac_sha256_context*)gbuf,
-                    (void*)message, msgLen);
-                memcpy(&message->Header.Signature,
-                    hmac_sha256_result((struct hmac_sha256_context*)gbuf), 16);
+            /*
+             * The signature covers the message in msg and any separate data
+             * sent after it (which belongs to the last message).
+             */
+            if (msgLen == remainingLen) {
+                SignMessage(session, message, msgLen,
+                    sendDataBuffer, sendDataLength, gbuf);
             } else {
-                memcpy(gbuf, session->signingContext,
-                    sizeof(struct aes_cmac_context));
-                aes_cmac_compute((struct aes_cmac_context*)gbuf,
-                    (void*)message, msgLen);
-                memcpy(&message->Header.Signature,
-                    ((struct aes_cmac_context*)gbuf)->ctx.data, 16);
+                SignMessage(session, message, msgLen, NULL, 0, gbuf);
             }
             
             message = (SMB2Message *)((char*)message + msgLen);
@@ -342,10 +785,18 @@ bool SendMessages(DIB *dib) {
     }
     
     msg.directTCPHeader.StreamProtocolLength =
-        hton32(sendLength);
+        hton32(sendLength + sendDataLength);
 
     tcperr = TCPIPWriteTCP(connection->ipid, (void*)&msg, 4 + sendLength,
-        TRUE, FALSE);
+        sendDataLength == 0, FALSE);
+    if (sendDataLength != 0 && !tcperr && !toolerror()) {
+        tcperr = TCPIPWriteTCP(connection->ipid, (void*)sendDataBuffer,
+            sendDataLength, TRUE, FALSE);
+    }
+
+    for (i = 0; i < nextMessageNum; i++) {
+        AddOutstanding(connection, msgIDs[i]);
+    }
 
     // save off header fields that are needed for reconnect
     sentCommand = msg.smb2Header.Command;
@@ -363,20 +814,31 @@ void ResetSendStatus(void) {
     lastMsg = NULL;
     sendLength = 0;
     nextMessageNum = 0;
+    sendDataBuffer = NULL;
+    sendDataLength = 0;
 }
 
 /*
- * Get a response to a message from the last batch sent.
- * messageNum is the number returned from EnqueueRequest for it.
- * Responses must be received in the order that the messages were enqueued.
+ * Receive a response for a command that was sent.
+ * If messageId is non-null, the response must have that MessageId; responses
+ * to other requests received while waiting for it are held for later.
+ * Otherwise, a response to any outstanding request for the specified command
+ * is accepted (the caller must check the MessageId).
  */
-ReadStatus GetResponse(DIB *dib, uint16_t messageNum) {
+static ReadStatus ReceiveResponse(DIB *dib, uint16_t command,
+    const uint64_t *messageId) {
+    Connection *connection = dib->session->connection;
+    OutstandingRequest *request;
     ReadStatus status;
-    uint16_t command = msgCommands[messageNum];
 
     do {
 retry:
-        status = ReadMessage(dib->session->connection);
+        if (messageId != NULL && TakeHeldResponse(connection, *messageId)) {
+            ResetSendStatus();
+            goto check_response;
+        }
+    
+        status = ReadMessage(connection);
         if (status != rsDone) {
             if (!blockRetry && Reconnect(dib)) {
                 SendMessages(dib);
@@ -388,13 +850,49 @@ retry:
             }
         }
         
+        /*
+         * Oplock/lease break notifications and responses to break
+         * acknowledgments may arrive in between other responses.
+         */
+        if (msg.smb2Header.Command == SMB2_OPLOCK_BREAK
+            && command != SMB2_OPLOCK_BREAK
+            && (msg.smb2Header.Flags & SMB2_FLAGS_SERVER_TO_REDIR)) {
+            if (msg.smb2Header.MessageId == 0xFFFFFFFFFFFFFFFF)
+                HandleBreakNotification(connection);
+            notificationsHandled++;
+            goto retry;
+        }
+
+        // Likewise for completions of our CHANGE_NOTIFY requests.
+        if (msg.smb2Header.Command == SMB2_CHANGE_NOTIFY
+            && command != SMB2_CHANGE_NOTIFY
+            && (msg.smb2Header.Flags & SMB2_FLAGS_SERVER_TO_REDIR)) {
+            HandleChangeNotifyResponse(connection);
+            notificationsHandled++;
+            goto retry;
+        }
+        
         ResetSendStatus();
         
-        // Check that the message received is a response to the one sent.
         if (!(msg.smb2Header.Flags & SMB2_FLAGS_SERVER_TO_REDIR))
             return rsError;
-        if (msg.smb2Header.MessageId != msgIDs[messageNum])
-            return rsError;
+
+        // Hold or discard responses to other requests.
+        request = FindOutstanding(connection, msg.smb2Header.MessageId);
+        if (messageId != NULL ? msg.smb2Header.MessageId != *messageId
+            : request == NULL || msg.smb2Header.Command != command) {
+            if (!HoldResponse(connection))
+                return rsError;
+            goto retry;
+        }
+        
+        if (request != NULL
+            && !(msg.smb2Header.Status == STATUS_PENDING
+                && (msg.smb2Header.Flags & SMB2_FLAGS_ASYNC_COMMAND)))
+            RemoveOutstanding(request);
+
+check_response:
+        // Check that the message received is a response to the one sent.
         if (msg.smb2Header.Command != command)
             return rsError;
         
@@ -415,6 +913,15 @@ retry:
             return rsDone;
         } else if (msg.smb2Header.Status == STATUS_MORE_PROCESSING_REQUIRED) {
             return rsMoreProcessingRequired;
+        } else if (msg.smb2Header.Command == SMB2_IOCTL
+            && msg.smb2Header.Status != STATUS_PENDING) {
+            /*
+             * Some IOCTL failures are reported in a regular IOCTL response,
+             * which gives additional information.  E.g., a copychunk request
+             * that exceeds the server's limits gets STATUS_INVALID_PARAMETER
+             * with the limits.  See [MS-SMB2] section 3.3.4.4.
+             */
+            return rsFailed;
         }
     } while (msg.smb2Header.Status == STATUS_PENDING &&
         (msg.smb2Header.Flags & SMB2_FLAGS_ASYNC_COMMAND));
@@ -428,19 +935,233 @@ retry:
     }
 }
 
+/*
+ * Get a response to a message from the last batch sent.
+ * messageNum is the number returned from EnqueueRequest for it.
+ * Responses may be asked for in any order, regardless of the order in which
+ * the server sends them.
+ */
+ReadStatus GetResponse(DIB *dib, uint16_t messageNum) {
+    return ReceiveResponse(dib, msgCommands[messageNum], &msgIDs[messageNum]);
+}
+
+/*
+ * Send a single message without waiting for its response.  The send buffer
+ * is cleared afterward, so further messages can be sent while this one is
+ * still outstanding.  *messageId is set to the MessageId of the message.
+ *
+ * Responses to pipelined requests are received with GetPipelinedResponse.
+ */
+bool SendPipelinedRequest(DIB *dib, uint16_t command, uint16_t bodyLength,
+    uint64_t *messageId) {
+    bool result;
+
+    EnqueueRequest(dib, command, bodyLength);
+    *messageId = msg.smb2Header.MessageId;
+    result = SendMessages(dib);
+    ResetSendStatus();
+    
+    return result;
+}
+
+/*
+ * Get the next response to one of the outstanding pipelined requests, which
+ * must all be for the specified command.  Responses may arrive in any order;
+ * the caller should use msg.smb2Header.MessageId to determine which request
+ * the response is for.  If rsError is returned, the MessageId is not valid.
+ *
+ * Requests are not retried if the connection is dropped, since the send
+ * buffer does not hold all the requests that are outstanding.
+ */
+ReadStatus GetPipelinedResponse(DIB *dib, uint16_t command) {
+    blockRetry = true;
+    return ReceiveResponse(dib, command, NULL);
+}
+
+/*
+ * Get the response to a specific pipelined request.  Unlike with
+ * GetPipelinedResponse, other pipelined requests may have been sent and
+ * responded to since this one was sent; its response may have been held
+ * while waiting for them.  Returns rsError if the request is no longer
+ * outstanding (e.g. because the connection was re-established).
+ */
+ReadStatus GetPipelinedResponseById(DIB *dib, uint16_t command,
+    uint64_t messageId) {
+    if (FindOutstanding(dib->session->connection, messageId) == NULL)
+        return rsError;
+
+    blockRetry = true;
+    return ReceiveResponse(dib, command, &messageId);
+}
+
+/*
+ * Give up on a pipelined request whose response is no longer wanted.
+ * The response is discarded if it has been or is later received.
+ */
+void AbandonPipelinedRequest(DIB *dib, uint64_t messageId) {
+    OutstandingRequest *request;
+
+    request = FindOutstanding(dib->session->connection, messageId);
+    if (request != NULL)
+        RemoveOutstanding(request);
+}
+
+/*
+ * Process messages that arrived on the connection used by dib while we were
+ * not waiting for a response, such as change notifications and oplock/lease
+ * break notifications.  Responses to requests that are no longer wanted are
+ * discarded.
+ *
+ * This does nothing if responses to outstanding requests are still expected
+ * (e.g. a prefetched directory page), since reading one of them now might
+ * mean waiting for all of it to arrive.
+ */
+void PollConnection(DIB *dib) {
+    Connection *connection = dib->session->connection;
+
+    if (HaveOutstanding(connection))
+        return;
+
+    while (connection->remainingCompoundSize != 0
+        || TCPDataAvailable(connection)) {
+        if (ReadMessage(connection) != rsDone)
+            break;
+        if (!(msg.smb2Header.Flags & SMB2_FLAGS_SERVER_TO_REDIR))
+            break;
+
+        if (msg.smb2Header.Command == SMB2_OPLOCK_BREAK) {
+            if (msg.smb2Header.MessageId == 0xFFFFFFFFFFFFFFFF)
+                HandleBreakNotification(connection);
+        } else if (msg.smb2Header.Command == SMB2_CHANGE_NOTIFY) {
+            HandleChangeNotifyResponse(connection);
+        }
+    }
+
+    ResetSendStatus();
+}
+
+/*
+ * Get the number of credits currently available for sending requests on
+ * the connection used by dib.
+ */
+uint16_t AvailableCredits(DIB *dib) {
+    return dib->session->connection->credits;
+}
+
+/*
+ * Ask for the credit window of the connection used by dib to be at least
+ * the specified number of credits.  Additional credits will be requested
+ * from the server with subsequent requests, but the server may not grant
+ * them.
+ */
+void RequestCredits(DIB *dib, uint16_t target) {
+    Connection *connection = dib->session->connection;
+
+    if (target > MAX_CREDIT_TARGET)
+        target = MAX_CREDIT_TARGET;
+    if (connection->creditTarget < target)
+        connection->creditTarget = target;
+}
+
 /*
  * Send a single message and get a response for it.
  */
 ReadStatus SendRequestAndGetResponse(DIB *dib, uint16_t command,
                                      uint16_t bodyLength) {
+    Connection *connection = dib->session->connection;
+    uint16_t messageNum;
+    LongWord startTime;
+    LongWord reconnectTime;
+    uint16_t notificationCount;
+    ReadStatus result;
+    
+    messageNum = EnqueueRequest(dib, command, bodyLength);
+
+    startTime = GetTick();
+    reconnectTime = connection->reconnectTime;
+    notificationCount = notificationsHandled;
+    SendMessages(dib);
+    result = GetResponse(dib, messageNum);
+
+    /*
+     * Use the time for small requests that the server normally handles
+     * quickly as a round-trip time sample, unless we had to reconnect or
+     * handle notifications while waiting for the response.
+     */
+    if (result == rsDone && connection->reconnectTime == reconnectTime
+        && notificationsHandled == notificationCount
+        && (command == SMB2_CLOSE || command == SMB2_QUERY_INFO))
+        NoteRoundTrip(connection, GetTick() - startTime);
+    
+    return result;
+}
+
+/*
+ * Send a single message followed by separate data, and get a response.
+ * The data is sent directly from the specified buffer, and is treated as
+ * part of the message body following its first bodyLength bytes.
+ */
+ReadStatus SendRequestWithDataAndGetResponse(DIB *dib, uint16_t command,
+    uint16_t bodyLength, const void *data, uint32_t dataLength) {
     uint16_t messageNum;
     
+    sendDataBuffer = data;
+    sendDataLength = dataLength;
     messageNum = EnqueueRequest(dib, command, bodyLength);
 
     SendMessages(dib);
     return GetResponse(dib, messageNum);
 }
 
+/*
+ * Send a small message "out of band", without disturbing msg or any messages
+ * that have been enqueued or sent but not yet responded to.  The body is
+ * copied from the specified buffer.  This is used for acknowledging oplock
+ * and lease breaks, which may arrive while receiving other responses.
+ * If messageId is non-null, *messageId is set to the MessageId of the
+ * request.
+ *
+ * The response is discarded when it is received (see ReceiveResponse),
+ * except for CHANGE_NOTIFY responses (see smb2/changenotify.c).
+ */
+bool SendOutOfBandRequest(DIB *dib, uint16_t command, const void *body,
+    uint16_t bodyLength, uint64_t *messageId) {
+    static struct {
+        DirectTCPHeader directTCPHeader;
+        SMB2Header smb2Header;
+        unsigned char body[OOB_BODY_SIZE];
+    } oobMsg;
+    static union {
+        struct hmac_sha256_context hmac;
+        struct aes_cmac_context cmac;
+    } oobSigningContext;
+    Session *session = dib->session;
+    SMB2Message *message = (SMB2Message *)&oobMsg.smb2Header;
+    Word tcperr;
+
+    if (bodyLength > sizeof(oobMsg.body))
+        return false;
+
+    memcpy(oobMsg.body, body, bodyLength);
+    oobMsg.smb2Header.Flags = 0;
+    InitHeader(dib, message, command);
+    if (messageId != NULL)
+        *messageId = oobMsg.smb2Header.MessageId;
+
+    if (session->signingRequired) {
+        SignMessage(session, message, sizeof(SMB2Header) + bodyLength,
+            NULL, 0, &oobSigningContext);
+    }
+
+    oobMsg.directTCPHeader.StreamProtocolLength =
+        hton32(sizeof(SMB2Header) + bodyLength);
+
+    tcperr = TCPIPWriteTCP(session->connection->ipid, (void*)&oobMsg,
+        4 + sizeof(SMB2Header) + bodyLength, TRUE, FALSE);
+    
+    return !(tcperr || toolerror());
+}
+
 /*
  * Reconnect after the connection has been dropped.
  * This tries to reconnect the connection and all its sessions, tree connects,
@@ -451,12 +1172,18 @@ static bool Reconnect(DIB *dib) {
     bool result;
     unsigned char *savedMsg;
     uint16_t savedLength;
+    const unsigned char *savedDataBuffer;
+    uint32_t savedDataLength;
     uint16_t msgLen;
     static bool inReconnect = false;
     
     if (blockRetry || inReconnect)
         return false;
 
+    // Additional channels are not reconnected by themselves.
+    if (connection->primary != NULL)
+        return false;
+
     // Don't retry an failed negotiate, and don't reconnect just to disconnect
     if (sentCommand == SMB2_NEGOTIATE
         || sentCommand == SMB2_LOGOFF
@@ -475,6 +1202,8 @@ static bool Reconnect(DIB *dib) {
     memcpy(savedMsg, &msg.smb2Header, savedLength);
     ((SMB2Header*)savedMsg)->Command = sentCommand;
     ((SMB2Header*)savedMsg)->NextCommand = sentNextCommand;
+    savedDataBuffer = sendDataBuffer;
+    savedDataLength = sendDataLength;
     
     /*
      * Save info about the file being accessed (if any), so that the fileId
@@ -492,11 +1221,16 @@ static bool Reconnect(DIB *dib) {
 
     inReconnect = true;
 
+    // Message IDs start over on the new connection.
+    ClearOutstanding(connection);
+
     ResetSendStatus();
     result = Connection_Reconnect(connection) == 0;
 
     memcpy(&msg.smb2Header, savedMsg, savedLength);
     smb_free(savedMsg);
+    sendDataBuffer = savedDataBuffer;
+    sendDataLength = savedDataLength;
     
     // Re-enqueue messages to rebuild their headers as necessary
     do {
@@ -533,12 +1267,13 @@ void InitSMB(void) {
     fileIdOffsets[SMB2_READ] = offsetof(SMB2_READ_Request, FileId);
     fileIdOffsets[SMB2_WRITE] = offsetof(SMB2_WRITE_Request, FileId);
     //fileIdOffsets[SMB2_LOCK] = offsetof(SMB2_LOCK_Request, FileId);
-    //fileIdOffsets[SMB2_IOCTL] = offsetof(SMB2_IOCTL_Request, FileId);
+    fileIdOffsets[SMB2_IOCTL] = offsetof(SMB2_IOCTL_Request, FileId);
     fileIdOffsets[SMB2_CANCEL] = 0;
     fileIdOffsets[SMB2_ECHO] = 0;
     fileIdOffsets[SMB2_QUERY_DIRECTORY] = offsetof(SMB2_QUERY_DIRECTORY_Request, FileId);
     //fileIdOffsets[SMB2_CHANGE_NOTIFY] = offsetof(SMB2_CHANGE_NOTIFY_Request, FileId);
     fileIdOffsets[SMB2_QUERY_INFO] = offsetof(SMB2_QUERY_INFO_Request, FileId);
     fileIdOffsets[SMB2_SET_INFO] = offsetof(SMB2_SET_INFO_Request, FileId);
-    //fileIdOffsets[SMB2_OPLOCK_BREAK] = offsetof(SMB2_OPLOCK_BREAK_Request, FileId);
+    fileIdOffsets[SMB2_OPLOCK_BREAK] =
+        offsetof(SMB2_OPLOCK_BREAK_Acknowledgment, FileId);
 }
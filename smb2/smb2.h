@@ -54,6 +54,8 @@
 #define flushResponse          (*(SMB2_FLUSH_Response*)msg.body)
 #define writeRequest           (*(SMB2_WRITE_Request*)msg.body)
 #define writeResponse          (*(SMB2_WRITE_Response*)msg.body)
+#define ioctlRequest           (*(SMB2_IOCTL_Request*)msg.body)
+#define ioctlResponse          (*(SMB2_IOCTL_Response*)msg.body)
 
 /*
  * Verify that a offset/length pair specifying a buffer within the last
@@ -64,6 +66,22 @@
 #define VerifyBuffer(offset,length) \
     ((uint32_t)(offset) + (length) <= bodySize + sizeof(SMB2Header))
 
+// max number of credits we will try to keep available on a connection
+#define MAX_CREDIT_TARGET 64
+
+// initial credit target for a connection
+#define INITIAL_CREDIT_TARGET 24
+
+/*
+ * Max number of messages that can be compounded together.  Compound chains
+ * are limited by the space in msg and the available credits (see
+ * SpaceAvailable and CanAddToCompound).  Each message after the first
+ * consumes a credit, so this sizes the tables for a chain to allow as many
+ * messages as the largest credit window we ask for.  It is only reached if
+ * the server grants more credits than that.
+ */
+#define MAX_COMPOUND_SIZE (MAX_CREDIT_TARGET + 1)
+
 // max read/write size that MsgRec is sized to support
 #define IO_BUFFER_SIZE 32768u
 
@@ -85,6 +103,18 @@ extern SMB2Message *nextMsg;
 
 extern uint16_t bodySize;   // size of last message received
 
+typedef struct {
+    Connection *connection;
+    uint64_t messageId;
+    unsigned char *buffer;
+    uint32_t size;
+} ReadDataTarget;
+
+extern unsigned char *readDataBuffer;
+extern uint32_t readDataBufferSize;
+extern ReadDataTarget *readDataTargets;
+extern unsigned readDataTargetCount;
+
 extern const SMB2_FILEID fileIDFromPrevious;
 
 typedef struct {
@@ -97,12 +127,28 @@ extern ReconnectInfo reconnectInfo;
 extern GUID clientGUID;
 
 bool SpaceAvailable(uint16_t bodyLength);
+bool CanAddToCompound(DIB *dib, uint16_t count, uint16_t bodyLength);
 unsigned EnqueueRequest(DIB *dib, uint16_t command, uint16_t bodyLength);
 bool SendMessages(DIB *dib);
 void ResetSendStatus(void);
 ReadStatus GetResponse(DIB *dib, uint16_t messageNum);
+bool SendPipelinedRequest(DIB *dib, uint16_t command, uint16_t bodyLength,
+    uint64_t *messageId);
+ReadStatus GetPipelinedResponse(DIB *dib, uint16_t command);
+ReadStatus GetPipelinedResponseById(DIB *dib, uint16_t command,
+    uint64_t messageId);
+void AbandonPipelinedRequest(DIB *dib, uint64_t messageId);
+bool HaveOutstanding(Connection *connection);
+uint16_t AvailableCredits(DIB *dib);
+void RequestCredits(DIB *dib, uint16_t target);
 ReadStatus SendRequestAndGetResponse(DIB *dib, uint16_t command,
                                      uint16_t bodyLength);
+bool SendOutOfBandRequest(DIB *dib, uint16_t command, const void *body,
+    uint16_t bodyLength, uint64_t *messageId);
+void PollConnection(DIB *dib);
+void ClearOutstanding(Connection *connection);
+ReadStatus SendRequestWithDataAndGetResponse(DIB *dib, uint16_t command,
+    uint16_t bodyLength, const void *data, uint32_t dataLength);
 void InitSMB(void);
 
 #endif
@@ -202,6 +202,9 @@ typedef struct {
 } SMB2_SESSION_SETUP_Request;
 SMB2_ASSERT_SIZE(SMB2_SESSION_SETUP_Request,24)
 
+/* Session Setup request flags */
+#define SMB2_SESSION_FLAG_BINDING 0x01
+
 typedef struct {
     uint16_t StructureSize;
     uint16_t SessionFlags;
@@ -420,11 +423,70 @@ typedef struct {
 #define SMB2_CREATE_QUERY_MAXIMAL_ACCESS_REQUEST 0x4d784163
 #define SMB2_CREATE_TIMEWARP_TOKEN               0x54577270
 #define SMB2_CREATE_QUERY_ON_DISK_ID             0x51466964
-#define SMB2_CREATE_REQUEST LEASE                0x52714c73
+#define SMB2_CREATE_REQUEST_LEASE                0x52714c73
 #define SMB2_CREATE_REQUEST_LEASE_V2             0x52714c73
 #define SMB2_CREATE_DURABLE_HANDLE_REQUEST_V2    0x44483251
 #define SMB2_CREATE_DURABLE_HANDLE_RECONNECT_V2  0x44483243
 
+/* Durable handle request create context data (version 1) */
+typedef struct {
+    uint8_t  Reserved[16];
+} SMB2_CREATE_DURABLE_HANDLE_REQUEST_Data;
+
+/* Durable handle reconnect create context data (version 1) */
+typedef struct {
+    SMB2_FILEID FileId;
+} SMB2_CREATE_DURABLE_HANDLE_RECONNECT_Data;
+
+/* Durable handle request create context data (version 2) */
+typedef struct {
+    uint32_t Timeout;
+    uint32_t Flags;
+    uint64_t Reserved;
+    GUID     CreateGuid;
+} SMB2_CREATE_DURABLE_HANDLE_REQUEST_V2_Data;
+
+/* Durable handle response create context data (version 2) */
+typedef struct {
+    uint32_t Timeout;
+    uint32_t Flags;
+} SMB2_CREATE_DURABLE_HANDLE_RESPONSE_V2_Data;
+
+/* Durable handle reconnect create context data (version 2) */
+typedef struct {
+    SMB2_FILEID FileId;
+    GUID     CreateGuid;
+    uint32_t Flags;
+} SMB2_CREATE_DURABLE_HANDLE_RECONNECT_V2_Data;
+
+/* Durable handle v2 flags */
+#define SMB2_DHANDLE_FLAG_PERSISTENT 0x00000002
+
+/* Lease request/response create context data (version 1) */
+typedef struct {
+    smb_u128 LeaseKey;
+    uint32_t LeaseState;
+    uint32_t LeaseFlags;
+    uint64_t LeaseDuration;
+} SMB2_CREATE_REQUEST_LEASE_Data;
+
+/* Lease request/response create context data (version 2) */
+typedef struct {
+    smb_u128 LeaseKey;
+    uint32_t LeaseState;
+    uint32_t LeaseFlags;
+    uint64_t LeaseDuration;
+    smb_u128 ParentLeaseKey;
+    uint16_t Epoch;
+    uint16_t Reserved;
+} SMB2_CREATE_REQUEST_LEASE_V2_Data;
+
+/* LeaseState flags */
+#define SMB2_LEASE_NONE           0x00
+#define SMB2_LEASE_READ_CACHING   0x01
+#define SMB2_LEASE_HANDLE_CACHING 0x02
+#define SMB2_LEASE_WRITE_CACHING  0x04
+
 typedef struct {
     uint16_t StructureSize;
     uint8_t  OplockLevel;
@@ -527,6 +589,39 @@ typedef struct {
     uint8_t  Buffer[];
 } SMB2_QUERY_DIRECTORY_Response;
 
+typedef struct {
+    uint16_t StructureSize;
+    uint16_t Flags;
+    uint32_t OutputBufferLength;
+    SMB2_FILEID FileId;
+    uint32_t CompletionFilter;
+    uint32_t Reserved;
+} SMB2_CHANGE_NOTIFY_Request;
+
+/* Change Notify request flags */
+#define SMB2_WATCH_TREE 0x0001
+
+/* CompletionFilter flags */
+#define FILE_NOTIFY_CHANGE_FILE_NAME    0x00000001
+#define FILE_NOTIFY_CHANGE_DIR_NAME     0x00000002
+#define FILE_NOTIFY_CHANGE_ATTRIBUTES   0x00000004
+#define FILE_NOTIFY_CHANGE_SIZE         0x00000008
+#define FILE_NOTIFY_CHANGE_LAST_WRITE   0x00000010
+#define FILE_NOTIFY_CHANGE_LAST_ACCESS  0x00000020
+#define FILE_NOTIFY_CHANGE_CREATION     0x00000040
+#define FILE_NOTIFY_CHANGE_EA           0x00000080
+#define FILE_NOTIFY_CHANGE_SECURITY     0x00000100
+#define FILE_NOTIFY_CHANGE_STREAM_NAME  0x00000200
+#define FILE_NOTIFY_CHANGE_STREAM_SIZE  0x00000400
+#define FILE_NOTIFY_CHANGE_STREAM_WRITE 0x00000800
+
+typedef struct {
+    uint16_t StructureSize;
+    uint16_t OutputBufferOffset;
+    uint32_t OutputBufferLength;
+    uint8_t  Buffer[];
+} SMB2_CHANGE_NOTIFY_Response;
+
 typedef struct {
     uint16_t StructureSize;
     uint8_t  InfoType;
@@ -583,6 +678,16 @@ typedef struct {
     uint16_t Reserved;
 } SMB2_FLUSH_Response;
 
+typedef struct {
+    uint16_t StructureSize;
+    uint16_t Reserved;
+} SMB2_ECHO_Request;
+
+typedef struct {
+    uint16_t StructureSize;
+    uint16_t Reserved;
+} SMB2_ECHO_Response;
+
 typedef struct {
     uint16_t StructureSize;
     uint16_t DataOffset;
@@ -610,4 +715,108 @@ typedef struct {
     uint16_t WriteChannelInfoLength;
 } SMB2_WRITE_Response;
 
+typedef struct {
+    uint16_t StructureSize;
+    uint16_t Reserved;
+    uint32_t CtlCode;
+    SMB2_FILEID FileId;
+    uint32_t InputOffset;
+    uint32_t InputCount;
+    uint32_t MaxInputResponse;
+    uint32_t OutputOffset;
+    uint32_t OutputCount;
+    uint32_t MaxOutputResponse;
+    uint32_t Flags;
+    uint32_t Reserved2;
+    uint8_t  Buffer[];
+} SMB2_IOCTL_Request;
+
+/* IOCTL request flags */
+#define SMB2_0_IOCTL_IS_FSCTL 0x00000001
+
+/* CtlCode values */
+#define FSCTL_SRV_COPYCHUNK          0x001440F2
+#define FSCTL_SRV_COPYCHUNK_WRITE    0x001480F2
+#define FSCTL_SRV_REQUEST_RESUME_KEY 0x00140078
+
+typedef struct {
+    uint16_t StructureSize;
+    uint16_t Reserved;
+    uint32_t CtlCode;
+    SMB2_FILEID FileId;
+    uint32_t InputOffset;
+    uint32_t InputCount;
+    uint32_t OutputOffset;
+    uint32_t OutputCount;
+    uint32_t Flags;
+    uint32_t Reserved2;
+    uint8_t  Buffer[];
+} SMB2_IOCTL_Response;
+
+/* FSCTL_SRV_REQUEST_RESUME_KEY output */
+typedef struct {
+    uint8_t  ResumeKey[24];
+    uint32_t ContextLength;
+    uint8_t  Context[];
+} SRV_REQUEST_RESUME_KEY;
+
+/* FSCTL_SRV_COPYCHUNK input */
+typedef struct {
+    uint64_t SourceOffset;
+    uint64_t TargetOffset;
+    uint32_t Length;
+    uint32_t Reserved;
+} SRV_COPYCHUNK;
+
+typedef struct {
+    uint8_t  SourceKey[24];
+    uint32_t ChunkCount;
+    uint32_t Reserved;
+    SRV_COPYCHUNK Chunks[];
+} SRV_COPYCHUNK_COPY;
+
+/*
+ * FSCTL_SRV_COPYCHUNK output.  If the request exceeded the server's limits,
+ * this instead gives the limits (max chunk count, max chunk size, and max
+ * total size), with status STATUS_INVALID_PARAMETER.
+ */
+typedef struct {
+    uint32_t ChunksWritten;
+    uint32_t ChunkBytesWritten;
+    uint32_t TotalBytesWritten;
+} SRV_COPYCHUNK_RESPONSE;
+
+/* Oplock break notification, acknowledgment, and response */
+typedef struct {
+    uint16_t StructureSize;
+    uint8_t  OplockLevel;
+    uint8_t  Reserved;
+    uint32_t Reserved2;
+    SMB2_FILEID FileId;
+} SMB2_OPLOCK_BREAK_Notification, SMB2_OPLOCK_BREAK_Acknowledgment;
+
+typedef struct {
+    uint16_t StructureSize;
+    uint16_t NewEpoch;
+    uint32_t Flags;
+    smb_u128 LeaseKey;
+    uint32_t CurrentLeaseState;
+    uint32_t NewLeaseState;
+    uint32_t BreakReason;
+    uint32_t AccessMaskHint;
+    uint32_t ShareMaskHint;
+} SMB2_LEASE_BREAK_Notification;
+
+/* Lease break notification flags */
+#define SMB2_NOTIFY_BREAK_LEASE_FLAG_ACK_REQUIRED 0x01
+
+typedef struct {
+    uint16_t StructureSize;
+    uint16_t Reserved;
+    uint32_t Flags;
+    smb_u128 LeaseKey;
+    uint32_t LeaseState;
+    uint64_t LeaseDuration;
+} SMB2_LEASE_BREAK_Acknowledgment;
+
 #endif
@@ -21,12 +21,17 @@
 #include "smb2/smb2.h"
 #include "smb2/aapl.h"
 #include "smb2/treeconnect.h"
+#include "smb2/oplock.h"
+#include "smb2/durable.h"
+#include "smb2/changenotify.h"
 #include "helpers/createcontext.h"
 #include "driver/driver.h"
 #include "gsos/gsosutils.h"
 #include "helpers/path.h"
 #include "helpers/afpinfo.h"
 #include "helpers/closerequest.h"
+#include "helpers/readahead.h"
+#include "helpers/dirlist.h"
 #include "fstops/Open.h"
 
 Word TreeConnect(DIB *dib) {
@@ -157,13 +162,14 @@ finish:
     return 0;
 }
 
-static void ReconnectFile(DIB *dib, FCR *fcr) {
+/*
+ * Assemble a CREATE request to reopen fcr's file (without contexts).
+ * *msgLen is set to the length of the request.  Returns false on error.
+ */
+static bool BuildReopenRequest(FCR *fcr, uint16_t *msgLen) {
     VirtualPointer vp;
     GSString *path;
 
-    /*
-     * Re-open file
-     */
     createRequest.SecurityFlags = 0;
     createRequest.RequestedOplockLevel = SMB2_OPLOCK_LEVEL_NONE;
     createRequest.ImpersonationLevel = Impersonation;
@@ -188,13 +194,13 @@ static void ReconnectFile(DIB *dib, FCR *fcr) {
     createRequest.NameLength = GSPathToSMB(path, createRequest.Buffer,
         sizeof(msg.body) - offsetof(SMB2_CREATE_Request, Buffer));
     if (createRequest.NameLength == 0xFFFF)
-        return;
+        return false;
 
     if (fcr->access & ACCESS_FLAG_RFORK) {
         if (createRequest.NameLength >
             sizeof(msg.body) - offsetof(SMB2_CREATE_Request, Buffer)
             - sizeof(resourceForkSuffix))
-            return;
+            return false;
         memcpy(createRequest.Buffer + createRequest.NameLength,
             resourceForkSuffix, sizeof(resourceForkSuffix));
         createRequest.NameLength += sizeof(resourceForkSuffix);
@@ -202,23 +208,53 @@ static void ReconnectFile(DIB *dib, FCR *fcr) {
 
     SetOpenAccess(fcr->access & (readEnable | writeEnable),
         (bool)(fcr->smbFlags & SMB_FLAG_P16SHARING));
-    
-    if (SendRequestAndGetResponse(dib, SMB2_CREATE,
-        sizeof(createRequest) + createRequest.NameLength) != rsDone)
-        return;
+
+    *msgLen = sizeof(createRequest) + createRequest.NameLength;
+    return true;
+}
+
+static void ReconnectFile(DIB *dib, FCR *fcr) {
+    uint16_t msgLen;
+    bool reclaimed = false;
 
     /*
-     * Check if the creation time matches as a heuristic to determine if this
-     * is the same file that was open previously.  This heuristic can have
-     * false positives and false negatives, but it should work in most cases.
+     * Reclaim the durable handle for the file, if it has one.  This keeps
+     * its locks, share mode, and oplock or lease.
      */
-    if (createResponse.CreationTime != fcr->createTime) {
+    if (fcr->smbFlags & SMB_FLAG_DURABLE) {
+        if (BuildReopenRequest(fcr, &msgLen)
+            && RequestDurableReconnect(fcr, &msgLen)
+            && SendRequestAndGetResponse(dib, SMB2_CREATE, msgLen) == rsDone) {
+            reclaimed = true;
+        } else {
+            fcr->smbFlags &= ~SMB_FLAG_DURABLE;
+        }
+    }
+
+    if (!reclaimed) {
         /*
-         * Close file if it seems to be a different file
+         * Re-open file
          */
-        SendCloseRequestAndGetResponse(dib, &createResponse.FileId);
+        if (!BuildReopenRequest(fcr, &msgLen))
+            return;
         
-        return;
+        if (SendRequestAndGetResponse(dib, SMB2_CREATE, msgLen) != rsDone)
+            return;
+
+        /*
+         * Check if the creation time matches as a heuristic to determine if
+         * this is the same file that was open previously.  This heuristic can
+         * have false positives and false negatives, but it should work in
+         * most cases.
+         */
+        if (createResponse.CreationTime != fcr->createTime) {
+            /*
+             * Close file if it seems to be a different file
+             */
+            SendCloseRequestAndGetResponse(dib, &createResponse.FileId);
+            
+            return;
+        }
     }
 
     /*
@@ -233,44 +269,56 @@ static void ReconnectFile(DIB *dib, FCR *fcr) {
     
     fcr->fileID = createResponse.FileId;
     fcr->eof = createResponse.EndofFile;
+    if (fcr->writeBehindLength != 0
+        && fcr->writeBehindOffset + fcr->writeBehindLength > fcr->eof)
+        fcr->eof = fcr->writeBehindOffset + fcr->writeBehindLength;
     fcr->nextServerEntryNum = -1;
+
+    if (reclaimed) {
+        /*
+         * The oplock or lease was kept, possibly at a reduced level.  A
+         * pending break is still acknowledged once deferred writes are
+         * flushed (with the new file ID, for an oplock).
+         */
+        if (!(fcr->cacheFlags & CACHE_BREAK_PENDING))
+            SetGrantedCaching(fcr);
+        if (!(fcr->cacheFlags & CACHE_READ))
+            InvalidateReadAhead(fcr);
+    } else {
+        /*
+         * The oplock or lease was lost with the old handle, so any pending
+         * break for it no longer needs to be acknowledged.  Deferred writes
+         * are kept and will be flushed later.
+         */
+        InvalidateReadAhead(fcr);
+        if (fcr->cacheFlags & CACHE_BREAK_PENDING)
+            pendingBreakCount--;
+        fcr->cacheFlags = 0;
+    }
 }
 
 Word TreeConnect_Reconnect(DIB *dib) {
-    VirtualPointer vp;
     VCR *vcr;
     FCR *fcr;
     Word result;
     unsigned i;
-    bool done;
     
     result = TreeConnect(dib);
     if (result != 0)
         return result;
+
+    // Handles held by cached directory listings were lost.
+    DiscardDirListings(dib);
+
+    // The watch for changes was also lost, so start a new one.
+    StartChangeNotify(dib);
     
     result = GetVCR(dib, &vcr);
     if (result != 0)
         return result;
 
     if (vcr->openCount != 0) {
-        for (i = 1, done = false; ; i++) {
-            asm {
-                ldx i
-                phd
-                lda gsosDP
-                tcd
-                txa
-                jsl GET_FCR
-                pld
-                rol done
-                stx vp
-                sty vp+2
-            }
-            
-            if (done)
-                break;
-            
-            DerefVP(fcr, vp);
+        for (i = 1; (fcr = GetFCR(i)) != NULL; i++) {
             if (fcr->volID == vcr->id && fcr->fstID == smbFSID) {
                 ReconnectFile(dib, fcr);
             }
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <types.h>
+#include "smb2/smb2.h"
+#include "smb2/connection.h"
+#include "smb2/tuning.h"
+#include "utils/buffersize.h"
+
+/*
+ * Marinetti does not let us set the TCP receive window for a connection
+ * (TCPIPLogin only takes the TOS and TTL), so the amount of data in flight
+ * is controlled by how much we ask the server for at once.  To keep a
+ * connection busy, that should be at least its bandwidth-delay product,
+ * which we estimate from the round-trip times of small requests and the
+ * rate at which data is received in large reads.  Like TCP's estimators,
+ * these are exponentially smoothed, with gains of 1/8 (RTT) and 1/4 (rate).
+ *
+ * The GS tick counter only has 1/60 second resolution, so round trips on
+ * a LAN usually measure as 0 or 1 ticks; at least 1 tick is assumed.  We
+ * never use less than IO_BUFFER_SIZE (which works well on a LAN), and only
+ * go beyond it if enough memory is free.
+ */
+
+// Max amount of data to have in flight on one connection
+#define MAX_TRANSFER_WINDOW 0x40000ul
+
+// Transfers shorter than this do not give a useful rate measurement
+#define MIN_RATE_SAMPLE_TICKS 2
+
+/*
+ * Record the time taken for a round trip of a small request and response.
+ */
+void NoteRoundTrip(Connection *connection, LongWord ticks) {
+    if (connection->srtt == 0) {
+        connection->srtt = ticks * 8 + 1;
+    } else {
+        connection->srtt += ticks - connection->srtt / 8;
+        if (connection->srtt == 0)
+            connection->srtt = 1;
+    }
+}
+
+/*
+ * Record that a transfer of the specified number of bytes took the
+ * specified number of ticks.
+ */
+void NoteTransfer(Connection *connection, uint32_t bytes, LongWord ticks) {
+    uint32_t sample;
+
+    if (ticks < MIN_RATE_SAMPLE_TICKS || bytes < IO_BUFFER_SIZE)
+        return;
+    
+    sample = bytes / ticks;
+    if (connection->rate == 0) {
+        connection->rate = sample;
+    } else {
+        connection->rate = connection->rate - connection->rate / 4
+            + sample / 4;
+    }
+}
+
+/*
+ * Get the amount of data that should be kept in flight at once on the
+ * connection.  This is at least IO_BUFFER_SIZE; the caller should check
+ * that that much memory is available (with GetBufferSize).
+ */
+uint32_t TransferWindow(Connection *connection) {
+    uint32_t rtt;
+    uint32_t window;
+
+    if (connection->srtt == 0 || connection->rate == 0)
+        return IO_BUFFER_SIZE;
+
+    rtt = connection->srtt / 8;
+    if (rtt == 0)
+        rtt = 1;
+    
+    // Allow for twice the estimated bandwidth-delay product.
+    if (connection->rate > MAX_TRANSFER_WINDOW / 2 / rtt) {
+        window = MAX_TRANSFER_WINDOW;
+    } else {
+        window = connection->rate * rtt * 2;
+    }
+    if (window < IO_BUFFER_SIZE)
+        window = IO_BUFFER_SIZE;
+
+    return TransferMemoryLimit(window);
+}
+
+/*
+ * Limit a transfer size above IO_BUFFER_SIZE based on the free memory.
+ * The result is not less than IO_BUFFER_SIZE (or size, if smaller).
+ */
+uint32_t TransferMemoryLimit(uint32_t size) {
+    uint32_t memory;
+
+    if (size <= IO_BUFFER_SIZE)
+        return size;
+    
+    memory = GetTransferMemory();
+    if (size > memory)
+        size = memory;
+    if (size < IO_BUFFER_SIZE)
+        size = IO_BUFFER_SIZE;
+    return size;
+}
@@ -28,6 +28,7 @@
 #include "auth/ntlm.h"
 #include "utils/alloc.h"
 #include "smb2/connection.h"
+#include "smb2/channel.h"
 
 /*
  * Authenticate with the server, creating an SMB session.
@@ -96,6 +97,8 @@ Word SMB_Authenticate(SMBAuthenticateRec *pblock, struct GSOSDP *gsosdp,
         || (pblock->userNameSize == 0 && pblock->passwordSize == 0);
 
     result = SessionSetup(session);
+    if (result == 0 && connection->wantChannel)
+        AddChannel(session);
 
 finish:
     if (result == 0) {
@@ -23,6 +23,7 @@
 #include <misctool.h>
 #include "fst/fstspecific.h"
 #include "smb2/smb2.h"
+#include "smb2/keepalive.h"
 #include "utils/alloc.h"
 #include "systemops/Startup.h"
 
@@ -54,6 +55,13 @@ Word SMB_Connect(SMBConnectRec *pblock, struct GSOSDP *gsosdp, Word pcount) {
         return result;
     }
     
+    connection->wantChannel = pblock->flags & CONNECT_FLAG_MULTICHANNEL;
+    
+    if (pblock->flags & CONNECT_FLAG_KEEPALIVE) {
+        connection->keepalive = true;
+        StartKeepalive();
+    }
+    
     connection->refCount = 1;
     pblock->connectionID = (LongWord)connection;
     return 0;
@@ -0,0 +1,525 @@
+/*
+ * Copyright (c) 2024 Stephen Heumann
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "defs.h"
+#include <stddef.h>
+#include <string.h>
+#include <gsos.h>
+#include "smb2/smb2.h"
+#include "smb2/fileinfo.h"
+#include "fst/fstspecific.h"
+#include "fst/fstdata.h"
+#include "driver/driver.h"
+#include "gsos/gsosutils.h"
+#include "helpers/path.h"
+#include "helpers/afpinfo.h"
+#include "helpers/errors.h"
+#include "helpers/closerequest.h"
+#include "helpers/infocache.h"
+#include "helpers/writebehind.h"
+
+/*
+ * Initial limits for copychunk requests.  These are within the limits used
+ * by Windows (256 chunks of up to 1 MiB, 16 MiB total), and Samba.  If a
+ * server has lower limits, it reports them and we switch to those.
+ */
+#define COPY_MAX_CHUNKS     16
+#define COPY_MAX_CHUNK_SIZE 0x100000ul
+#define COPY_MAX_TOTAL_SIZE 0x1000000ul
+
+#define SOURCE_ACCESS (FILE_READ_DATA | FILE_READ_ATTRIBUTES)
+#define DEST_ACCESS \
+    (FILE_READ_DATA | FILE_WRITE_DATA | FILE_APPEND_DATA | FILE_WRITE_ATTRIBUTES)
+
+// Copychunk limits in use for the current copy
+static uint16_t maxChunks;
+static uint32_t maxChunkSize;
+static uint32_t maxTotalSize;
+
+// Resume key identifying the source of a copy to the server
+static uint8_t resumeKey[24];
+
+/*
+ * Open or create a stream of the file at path (the unnamed data stream if
+ * suffix is NULL).  On success, *fileID is set, and the CREATE response is
+ * left in msg.
+ *
+ * Returns a GS/OS error code.
+ */
+static Word OpenStream(DIB *dib, GSString *path, const char16_t *suffix,
+    uint16_t suffixSize, uint32_t access, uint32_t disposition,
+    uint32_t attributes, SMB2_FILEID *fileID) {
+    ReadStatus result;
+    uint16_t nameSpace;
+
+    createRequest.SecurityFlags = 0;
+    createRequest.RequestedOplockLevel = SMB2_OPLOCK_LEVEL_NONE;
+    createRequest.ImpersonationLevel = Impersonation;
+    createRequest.SmbCreateFlags = 0;
+    createRequest.Reserved = 0;
+    createRequest.DesiredAccess = access;
+    createRequest.FileAttributes = attributes;
+    createRequest.ShareAccess =
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+    createRequest.CreateDisposition = disposition;
+    createRequest.CreateOptions = FILE_NON_DIRECTORY_FILE;
+    createRequest.NameOffset =
+        sizeof(SMB2Header) + offsetof(SMB2_CREATE_Request, Buffer);
+    createRequest.CreateContextsOffset = 0;
+    createRequest.CreateContextsLength = 0;
+
+    // translate filename to SMB format
+    nameSpace = sizeof(msg.body) - offsetof(SMB2_CREATE_Request, Buffer);
+    createRequest.NameLength =
+        GSPathToSMB(path, createRequest.Buffer, nameSpace);
+    if (createRequest.NameLength == 0xFFFF)
+        return badPathSyntax;
+
+    // add stream suffix
+    if (suffix != NULL) {
+        if (createRequest.NameLength > nameSpace - suffixSize)
+            return badPathSyntax;
+        memcpy(createRequest.Buffer + createRequest.NameLength,
+            suffix, suffixSize);
+        createRequest.NameLength += suffixSize;
+    }
+
+    result = SendRequestAndGetResponse(dib, SMB2_CREATE,
+        sizeof(createRequest) + createRequest.NameLength);
+    if (result != rsDone)
+        return ConvertError(result);
+
+    *fileID = createResponse.FileId;
+    return 0;
+}
+
+/*
+ * Convert an error from an IOCTL request.  Errors indicating that the
+ * server does not support the operation give invalidFSTop, so that the
+ * caller can fall back to copying the file itself.
+ */
+static Word ConvertIOCTLError(ReadStatus result) {
+    if (result == rsFailed
+        && (msg.smb2Header.Status == STATUS_NOT_SUPPORTED
+            || msg.smb2Header.Status == STATUS_INVALID_DEVICE_REQUEST))
+        return invalidFSTop;
+    return ConvertError(result);
+}
+
+/*
+ * Get the resume key for the open source file, into resumeKey.
+ *
+ * Returns a GS/OS error code.
+ */
+static Word GetResumeKey(DIB *dib, const SMB2_FILEID *fileID) {
+    ReadStatus result;
+    SRV_REQUEST_RESUME_KEY *keyResponse;
+
+    ioctlRequest.Reserved = 0;
+    ioctlRequest.CtlCode = FSCTL_SRV_REQUEST_RESUME_KEY;
+    ioctlRequest.FileId = *fileID;
+    ioctlRequest.InputOffset = 0;
+    ioctlRequest.InputCount = 0;
+    ioctlRequest.MaxInputResponse = 0;
+    ioctlRequest.OutputOffset = 0;
+    ioctlRequest.OutputCount = 0;
+    ioctlRequest.MaxOutputResponse = sizeof(SRV_REQUEST_RESUME_KEY);
+    ioctlRequest.Flags = SMB2_0_IOCTL_IS_FSCTL;
+    ioctlRequest.Reserved2 = 0;
+
+    result = SendRequestAndGetResponse(dib, SMB2_IOCTL, sizeof(ioctlRequest));
+    if (result != rsDone)
+        return ConvertIOCTLError(result);
+
+    if (ioctlResponse.OutputCount < sizeof(SRV_REQUEST_RESUME_KEY)
+        || ioctlResponse.OutputCount > 0xFFFF
+        || !VerifyBuffer(ioctlResponse.OutputOffset, ioctlResponse.OutputCount))
+        return networkError;
+
+    keyResponse = (SRV_REQUEST_RESUME_KEY *)((unsigned char *)&msg.smb2Header
+        + ioctlResponse.OutputOffset);
+    memcpy(resumeKey, keyResponse->ResumeKey, sizeof(resumeKey));
+    return 0;
+}
+
+/*
+ * Copy length bytes from the stream open as sourceFileID to the start of
+ * the stream open as destFileID, using copychunk requests.  The server
+ * copies the data itself, so it is not sent over the network.
+ *
+ * Returns a GS/OS error code.
+ */
+static Word CopyStreamData(DIB *sourceDIB, const SMB2_FILEID *sourceFileID,
+    DIB *destDIB, const SMB2_FILEID *destFileID, uint64_t length) {
+    ReadStatus result;
+    Word retval;
+    SRV_COPYCHUNK_COPY *copy;
+    SRV_COPYCHUNK_RESPONSE *copyResponse;
+    uint64_t offset, pos;
+    uint32_t total, chunkLength;
+    uint16_t count;
+    bool gotLimits = false;
+
+    if (length == 0)
+        return 0;
+
+    retval = GetResumeKey(sourceDIB, sourceFileID);
+    if (retval)
+        return retval;
+
+    offset = 0;
+    while (offset < length) {
+        copy = (SRV_COPYCHUNK_COPY *)ioctlRequest.Buffer;
+        memcpy(copy->SourceKey, resumeKey, sizeof(resumeKey));
+        copy->Reserved = 0;
+
+        pos = offset;
+        total = 0;
+        for (count = 0;
+            count < maxChunks && total < maxTotalSize && pos < length;
+            count++) {
+            chunkLength = maxChunkSize;
+            if (chunkLength > maxTotalSize - total)
+                chunkLength = maxTotalSize - total;
+            if (chunkLength > length - pos)
+                chunkLength = length - pos;
+            copy->Chunks[count].SourceOffset = pos;
+            copy->Chunks[count].TargetOffset = pos;
+            copy->Chunks[count].Length = chunkLength;
+            copy->Chunks[count].Reserved = 0;
+            pos += chunkLength;
+            total += chunkLength;
+        }
+        copy->ChunkCount = count;
+
+        ioctlRequest.Reserved = 0;
+        ioctlRequest.CtlCode = FSCTL_SRV_COPYCHUNK;
+        ioctlRequest.FileId = *destFileID;
+        ioctlRequest.InputOffset =
+            sizeof(SMB2Header) + offsetof(SMB2_IOCTL_Request, Buffer);
+        ioctlRequest.InputCount =
+            sizeof(SRV_COPYCHUNK_COPY) + count * sizeof(SRV_COPYCHUNK);
+        ioctlRequest.MaxInputResponse = 0;
+        ioctlRequest.OutputOffset = 0;
+        ioctlRequest.OutputCount = 0;
+        ioctlRequest.MaxOutputResponse = sizeof(SRV_COPYCHUNK_RESPONSE);
+        ioctlRequest.Flags = SMB2_0_IOCTL_IS_FSCTL;
+        ioctlRequest.Reserved2 = 0;
+
+        result = SendRequestAndGetResponse(destDIB, SMB2_IOCTL,
+            sizeof(ioctlRequest) + ioctlRequest.InputCount);
+
+        /*
+         * If the request exceeded the server's limits, the response gives
+         * them.  Switch to those limits and try again (only once, to ensure
+         * we do not keep retrying if the server gives bogus limits).
+         */
+        if (result == rsFailed
+            && msg.smb2Header.Status == STATUS_INVALID_PARAMETER
+            && ioctlResponse.CtlCode == FSCTL_SRV_COPYCHUNK
+            && ioctlResponse.OutputCount == sizeof(SRV_COPYCHUNK_RESPONSE)
+            && VerifyBuffer(ioctlResponse.OutputOffset,
+                sizeof(SRV_COPYCHUNK_RESPONSE))
+            && !gotLimits) {
+            copyResponse = (SRV_COPYCHUNK_RESPONSE *)
+                ((unsigned char *)&msg.smb2Header + ioctlResponse.OutputOffset);
+            if (copyResponse->ChunksWritten == 0
+                || copyResponse->ChunkBytesWritten == 0
+                || copyResponse->TotalBytesWritten == 0)
+                return drvrIOError;
+            if (copyResponse->ChunksWritten < maxChunks)
+                maxChunks = copyResponse->ChunksWritten;
+            maxChunkSize = copyResponse->ChunkBytesWritten;
+            maxTotalSize = copyResponse->TotalBytesWritten;
+            gotLimits = true;
+            continue;
+        }
+        
+        if (result != rsDone)
+            return ConvertIOCTLError(result);
+
+        if (ioctlResponse.OutputCount != sizeof(SRV_COPYCHUNK_RESPONSE)
+            || !VerifyBuffer(ioctlResponse.OutputOffset,
+                sizeof(SRV_COPYCHUNK_RESPONSE)))
+            return networkError;
+
+        copyResponse = (SRV_COPYCHUNK_RESPONSE *)
+            ((unsigned char *)&msg.smb2Header + ioctlResponse.OutputOffset);
+
+        /*
+         * The server may copy less than was requested.  Continue from the
+         * point it got to, but give up if it made no progress.
+         */
+        if (copyResponse->TotalBytesWritten == 0
+            || copyResponse->TotalBytesWritten > total)
+            return drvrIOError;
+        offset += copyResponse->TotalBytesWritten;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the resource fork of the source file, if it has one.
+ *
+ * Returns a GS/OS error code.
+ */
+static Word CopyResourceFork(DIB *sourceDIB, GSString *sourcePath,
+    DIB *destDIB, GSString *destPath) {
+    Word retval;
+    SMB2_FILEID sourceFileID, destFileID;
+    uint64_t length;
+
+    retval = OpenStream(sourceDIB, sourcePath,
+        resourceForkSuffix, sizeof(resourceForkSuffix),
+        SOURCE_ACCESS, FILE_OPEN, 0, &sourceFileID);
+    if (retval == fileNotFound)
+        return 0;
+    if (retval)
+        return retval;
+    length = createResponse.EndofFile;
+
+    if (length != 0) {
+        retval = OpenStream(destDIB, destPath,
+            resourceForkSuffix, sizeof(resourceForkSuffix),
+            DEST_ACCESS, FILE_OVERWRITE_IF, 0, &destFileID);
+        if (retval == 0) {
+            retval = CopyStreamData(sourceDIB, &sourceFileID,
+                destDIB, &destFileID, length);
+            SendCloseRequestAndGetResponse(destDIB, &destFileID);
+        }
+    }
+
+    SendCloseRequestAndGetResponse(sourceDIB, &sourceFileID);
+    return retval;
+}
+
+/*
+ * Copy the AFP Info (Finder info and ProDOS file type) of the source file,
+ * if it has it.  This is small, so it is just read and written back, which
+ * also works on servers that do not store it as a regular stream.
+ *
+ * Returns a GS/OS error code.
+ */
+static Word CopyAFPInfo(DIB *sourceDIB, GSString *sourcePath,
+    DIB *destDIB, GSString *destPath) {
+    ReadStatus result;
+    Word retval;
+    SMB2_FILEID fileID;
+
+    /*
+     * Read AFP Info from the source
+     */
+    retval = OpenStream(sourceDIB, sourcePath,
+        afpInfoSuffix, sizeof(afpInfoSuffix),
+        SOURCE_ACCESS, FILE_OPEN, 0, &fileID);
+    if (retval == fileNotFound)
+        return 0;
+    if (retval)
+        return retval;
+
+    readRequest.Padding =
+        sizeof(SMB2Header) + offsetof(SMB2_READ_Response, Buffer);
+    readRequest.Flags = 0;
+    readRequest.Length = sizeof(AFPInfo);
+    readRequest.Offset = 0;
+    readRequest.FileId = fileID;
+    readRequest.MinimumCount = sizeof(AFPInfo);
+    readRequest.Channel = 0;
+    readRequest.RemainingBytes = 0;
+    readRequest.ReadChannelInfoOffset = 0;
+    readRequest.ReadChannelInfoLength = 0;
+
+    result = SendRequestAndGetResponse(sourceDIB, SMB2_READ,
+        sizeof(readRequest));
+    if (result == rsDone) {
+        if (readResponse.DataLength == sizeof(AFPInfo)
+            && VerifyBuffer(readResponse.DataOffset, sizeof(AFPInfo))) {
+            memcpy(&afpInfo,
+                (uint8_t*)&msg.smb2Header + readResponse.DataOffset,
+                sizeof(AFPInfo));
+        } else {
+            retval = networkError;
+        }
+    } else if (result == rsFailed
+        && msg.smb2Header.Status == STATUS_END_OF_FILE) {
+        // empty AFP Info -- nothing to copy
+        retval = fileNotFound;
+    } else {
+        retval = ConvertError(result);
+    }
+
+    SendCloseRequestAndGetResponse(sourceDIB, &fileID);
+    if (retval == fileNotFound)
+        return 0;
+    if (retval)
+        return retval;
+
+    /*
+     * Write it to the destination
+     */
+    retval = OpenStream(destDIB, destPath,
+        afpInfoSuffix, sizeof(afpInfoSuffix),
+        DEST_ACCESS, FILE_OVERWRITE_IF, 0, &fileID);
+    if (retval)
+        return retval;
+
+    writeRequest.DataOffset =
+        sizeof(SMB2Header) + offsetof(SMB2_WRITE_Request, Buffer);
+    writeRequest.Length = sizeof(AFPInfo);
+    writeRequest.Offset = 0;
+    writeRequest.FileId = fileID;
+    writeRequest.Channel = 0;
+    writeRequest.RemainingBytes = 0;
+    writeRequest.WriteChannelInfoOffset = 0;
+    writeRequest.WriteChannelInfoLength = 0;
+    writeRequest.Flags = 0;
+
+    memcpy(writeRequest.Buffer, &afpInfo, sizeof(AFPInfo));
+
+    result = SendRequestAndGetResponse(destDIB, SMB2_WRITE,
+        sizeof(writeRequest) + sizeof(AFPInfo));
+    if (result != rsDone)
+        retval = ConvertError(result);
+
+    SendCloseRequestAndGetResponse(destDIB, &fileID);
+    return retval;
+}
+
+Word SMB_CopyFile(SMBCopyFileRec *pblock, struct GSOSDP *gsosdp, Word pcount) {
+    ReadStatus result;
+    Word retval;
+    DIB *sourceDIB, *destDIB;
+    SMB2_FILEID sourceFileID, destFileID;
+    uint64_t length;
+    uint64_t creationTime, lastWriteTime, changeTime;
+    uint32_t attributes, initialAttributes;
+
+    if (pblock->pCount != 4)
+        return invalidPcount;
+
+    sourceDIB = GetDIBForPath(pblock->sourcePath);
+    destDIB = GetDIBForPath(pblock->destPath);
+    if (sourceDIB == NULL || destDIB == NULL)
+        return volNotFound;
+
+    // The resume key is only usable within the same session.
+    if (sourceDIB->session != destDIB->session)
+        return badPathNames;
+
+    maxChunks = COPY_MAX_CHUNKS;
+    maxChunkSize = COPY_MAX_CHUNK_SIZE;
+    maxTotalSize = COPY_MAX_TOTAL_SIZE;
+
+    // Make sure the server has any data we are holding for the source.
+    retval = FlushAllWriteBehind();
+    if (retval)
+        return retval;
+
+    /*
+     * Open source file
+     */
+    retval = OpenStream(sourceDIB, pblock->sourcePath, NULL, 0,
+        SOURCE_ACCESS, FILE_OPEN, 0, &sourceFileID);
+    if (retval) {
+        if (retval == dupPathname)
+            retval = badStoreType;
+        return retval;
+    }
+
+    length = createResponse.EndofFile;
+    creationTime = createResponse.CreationTime;
+    lastWriteTime = createResponse.LastWriteTime;
+    changeTime = createResponse.ChangeTime;
+    attributes = createResponse.FileAttributes;
+
+    // Ensure we have write access until the copy is complete.
+    initialAttributes = attributes & ~(uint32_t)FILE_ATTRIBUTE_READONLY;
+    if (initialAttributes == 0)
+        initialAttributes = FILE_ATTRIBUTE_NORMAL;
+
+    /*
+     * Create destination file
+     */
+    InvalidateInfoCache(destDIB);
+
+    retval = OpenStream(destDIB, pblock->destPath, NULL, 0,
+        DEST_ACCESS | DELETE, FILE_CREATE, initialAttributes, &destFileID);
+    if (retval) {
+        SendCloseRequestAndGetResponse(sourceDIB, &sourceFileID);
+        if (retval == fileNotFound)
+            retval = pathNotFound;
+        return retval;
+    }
+
+    volChangedDevNum = destDIB->DIBDevNum;
+
+    /*
+     * Copy data fork, then Finder info and resource fork
+     */
+    retval = CopyStreamData(sourceDIB, &sourceFileID,
+        destDIB, &destFileID, length);
+    SendCloseRequestAndGetResponse(sourceDIB, &sourceFileID);
+
+    if (!retval)
+        retval = CopyAFPInfo(sourceDIB, pblock->sourcePath,
+            destDIB, pblock->destPath);
+    if (!retval)
+        retval = CopyResourceFork(sourceDIB, pblock->sourcePath,
+            destDIB, pblock->destPath);
+
+    /*
+     * Set dates and attributes to match the source, or delete the partial
+     * copy if there was an error.
+     */
+    setInfoRequest.InfoType = SMB2_0_INFO_FILE;
+    setInfoRequest.BufferOffset =
+        sizeof(SMB2Header) + offsetof(SMB2_SET_INFO_Request, Buffer);
+    setInfoRequest.Reserved = 0;
+    setInfoRequest.AdditionalInformation = 0;
+    setInfoRequest.FileId = destFileID;
+    if (retval == 0) {
+        setInfoRequest.FileInfoClass = FileBasicInformation;
+        setInfoRequest.BufferLength = sizeof(FILE_BASIC_INFORMATION);
+#define info ((FILE_BASIC_INFORMATION *)setInfoRequest.Buffer)
+        info->CreationTime = creationTime;
+        info->LastAccessTime = 0;
+        info->LastWriteTime = lastWriteTime;
+        info->ChangeTime = changeTime;
+        info->FileAttributes = attributes;
+        info->Reserved = 0;
+#undef info
+    } else {
+        setInfoRequest.FileInfoClass = FileDispositionInformation;
+        setInfoRequest.BufferLength = sizeof(FILE_DISPOSITION_INFORMATION);
+#define info ((FILE_DISPOSITION_INFORMATION *)setInfoRequest.Buffer)
+        info->DeletePending = 1;
+#undef info
+    }
+
+    result = SendRequestAndGetResponse(destDIB, SMB2_SET_INFO,
+        sizeof(setInfoRequest) + setInfoRequest.BufferLength);
+    if (result != rsDone && retval == 0)
+        retval = ConvertError(result);
+
+    /*
+     * Close destination file
+     */
+    SendCloseRequestAndGetResponse(destDIB, &destFileID);
+    // ignore errors here
+
+    return retval;
+}
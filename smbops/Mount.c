@@ -22,6 +22,7 @@
 #include "smb2/smb2.h"
 #include "smb2/aapl.h"
 #include "smb2/treeconnect.h"
+#include "smb2/changenotify.h"
 #include "fst/fstspecific.h"
 #include "driver/driver.h"
 #include "gsos/gsosutils.h"
@@ -86,6 +87,8 @@ Word SMB_Mount(SMBMountRec *pblock, struct GSOSDP *gsosdp, Word pcount) {
     dibs[dibIndex].switched = true;
     dibs[dibIndex].extendedDIBPtr = &dibs[dibIndex].treeId;
 
+    StartChangeNotify(&dibs[dibIndex]);
+
     pblock->devNum = dibs[dibIndex].DIBDevNum;
     
     Session_Retain(session);
@@ -17,12 +17,20 @@
 #include "defs.h"
 #include <gsos.h>
 #include <prodos.h>
+#include "helpers/writebehind.h"
+#include "smb2/oplock.h"
 
 /*
  * This is called to flush the data at the end of a write-deferral session.
  *
- * We do not actually defer the writes, so there is nothing to do here.
+ * We flush any writes held in the write-behind buffers of open files, and
+ * then acknowledge any oplock/lease breaks that were waiting for that.
  */
 int DeferredFlush(void) {
-    return 0;
+    Word result;
+
+    result = FlushAllWriteBehind();
+    if (pendingBreakCount != 0)
+        ProcessPendingBreaks();
+    return result;
 }
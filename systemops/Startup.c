@@ -29,6 +29,7 @@
 #include "utils/finderstate.h"
 #include "utils/buffersize.h"
 #include "smb2/smb2.h"
+#include "helpers/path.h"
 
 extern pascal void SystemUserID (unsigned, char *);
 
@@ -91,6 +92,7 @@ int Startup(void) {
     SystemUserID(GetNewID(0x3300), NULL);
 
     InitDIBs();
+    InitPathTables();
     result = InstallDIBs();
     
     if (result == 0) {
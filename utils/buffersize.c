@@ -70,6 +70,17 @@ uint16_t GetBufferSize(size_t desiredSize) {
     return min(desiredSize, allowedSize);
 }
 
+/*
+ * Determine how much data it should be OK to have in flight in TCP/IP
+ * operations at once, based on the largest free block of memory.  This
+ * uses the same heuristic as GetBufferSize, but measures the memory that
+ * is free without purging anything, so it is suited to deciding whether
+ * to go beyond the sizes that GetBufferSize allows.
+ */
+uint32_t GetTransferMemory(void) {
+    return MaxBlock() / 2;
+}
+
 bool InitBufferSize(void) {
     purgeableBufferHandle = NewHandle(0, userid(), attrNoSpec | attrPurge1, 0);
     return !toolerror();
@@ -22,6 +22,7 @@
 #include <stdint.h>
 
 uint16_t GetBufferSize(size_t desiredSize);
+uint32_t GetTransferMemory(void);
 bool InitBufferSize(void);
 
 #endif
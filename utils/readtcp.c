@@ -16,6 +16,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <tcpip.h>
 #include <misctool.h>
 #include <orca.h>
@@ -44,10 +45,37 @@
  */
 #define INACTIVITY_PERIOD (2*60*60) /* ticks */
 
+/*
+ * Received data is normally read from Marinetti into the connection's
+ * receive buffer, taking everything that is queued (up to the buffer size)
+ * in one call.  ReadTCP then gives out data from the buffer.  This way,
+ * the separate reads for the header and body of each message (and the
+ * messages in a compound response) normally do not need separate calls
+ * to Marinetti.  Large reads that cannot be satisfied from the buffer go
+ * directly to the caller's buffer, to avoid copying them.
+ */
+
+/*
+ * Check if any data has been received on the connection that has not
+ * yet been read.
+ */
+bool TCPDataAvailable(Connection *connection) {
+    static srBuff srBuf;
+
+    if (connection->rcvBufStart != connection->rcvBufEnd)
+        return true;
+
+    TCPIPPoll();
+    if (TCPIPStatusTCP(connection->ipid, &srBuf) || toolerror())
+        return false;
+    return srBuf.srRcvQueued != 0;
+}
+
 ReadStatus ReadTCP(Connection *connection, uint16_t size, void *buf) {
     static rrBuff rrBuf;
     static Long startTime;
     static uint16_t timeout;
+    uint16_t count;
     
     startTime = GetTick();
     if (startTime - connection->lastActivityTime > INACTIVITY_PERIOD) {
@@ -56,20 +84,49 @@ ReadStatus ReadTCP(Connection *connection, uint16_t size, void *buf) {
         timeout = READ_TIMEOUT;
     }
     connection->lastActivityTime = startTime;
+
+    // Use data already in the receive buffer
+    count = connection->rcvBufEnd - connection->rcvBufStart;
+    if (count != 0) {
+        if (count > size)
+            count = size;
+        memcpy(buf, connection->rcvBuf + connection->rcvBufStart, count);
+        connection->rcvBufStart += count;
+        size -= count;
+        if (size == 0)
+            return rsDone;
+        buf = (char*)buf + count;
+    }
     
     do {
         TCPIPPoll();
-        if (TCPIPReadTCP(connection->ipid, 0, (Ref)buf, size, &rrBuf)
-            || toolerror()) {
-            return rsError;
+        if (size < RCV_BUF_SIZE) {
+            // Read everything available into the receive buffer
+            if (TCPIPReadTCP(connection->ipid, 0, (Ref)connection->rcvBuf,
+                RCV_BUF_SIZE, &rrBuf) || toolerror()) {
+                connection->rcvBufStart = connection->rcvBufEnd = 0;
+                return rsError;
+            }
+            count = (uint16_t)rrBuf.rrBuffCount;
+            connection->rcvBufEnd = count;
+            if (count > size)
+                count = size;
+            memcpy(buf, connection->rcvBuf, count);
+            connection->rcvBufStart = count;
+        } else {
+            if (TCPIPReadTCP(connection->ipid, 0, (Ref)buf, size, &rrBuf)
+                || toolerror()) {
+                return rsError;
+            }
+            count = (uint16_t)rrBuf.rrBuffCount;
         }
     
-        size -= (uint16_t)rrBuf.rrBuffCount;
+        size -= count;
         if (size == 0)
             return rsDone;
 
-        if (rrBuf.rrBuffCount != 0) {
-            buf = (char*)buf + rrBuf.rrBuffCount;
+        if (count != 0) {
+            buf = (char*)buf + count;
             timeout = READ_TIMEOUT;
         }
     } while (GetTick() - startTime < timeout);
@@ -18,6 +18,7 @@
 #define READTCP_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <types.h>
 
 typedef enum {
@@ -30,5 +31,6 @@ typedef enum {
 } ReadStatus;
 
 ReadStatus ReadTCP(Connection *connection, uint16_t size, void *buf);
+bool TCPDataAvailable(Connection *connection);
 
 #endif